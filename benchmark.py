@@ -0,0 +1,235 @@
+import sys
+import time
+import pyopencl as cl
+import pyopencl.tools
+import pyopencl.array
+import numpy as np
+import serializer
+import bvhBuilder
+import bihBuilder
+
+BENCH_TRIANGLES = 100000 # Triangles of the random scene
+BENCH_RAYS = 1 << 20 # Rays cast per launch
+BENCH_RUNS = 5 # Timed launches per layout, the best one is kept
+BENCH_SPREAD = 10.0 # Size of the scene cube
+BENCH_TRIANGLE_SIZE = 0.2 # Size of a triangle
+RAY_SORT_MORTON_BITS = 9 # Bits per axis of the ray origin in the sort key, must match kernel/lightmodel_kernel.cl
+
+# Primitive BVH layouts to compare : name, build options and serialization (BVH bytes and root address)
+LAYOUTS = [("binary", " -D BVH", lambda builder: (builder.serializeBVH(), builder.getRoot())),
+           ("BVH4", " -D BVH -D BVH4", lambda builder: (builder.serializeWideBVH(4), 0)),
+           ("BVH8", " -D BVH -D BVH8", lambda builder: (builder.serializeWideBVH(8), 0)),
+           ("QBVH16", " -D BVH -D BVH_QUANTIZED=16", lambda builder: (builder.serializeQuantizedBVH(16), builder.getRoot())),
+           ("QBVH8", " -D BVH -D BVH_QUANTIZED=8", lambda builder: (builder.serializeQuantizedBVH(8), builder.getRoot())),
+           ("DFS", " -D BVH -D BVH_IMPLICIT_LEFT", lambda builder: (builder.serializeBVH(True), builder.getRoot())),
+           ("DFS-128", " -D BVH -D BVH_IMPLICIT_LEFT", lambda builder: (builder.serializeBVH(True, 2), builder.getRoot())),
+           ("DFS-QBVH8", " -D BVH -D BVH_IMPLICIT_LEFT -D BVH_QUANTIZED=8", lambda builder: (builder.serializeQuantizedBVH(8, True), builder.getRoot())),
+           ("short-4", " -D BVH -D BVH_SHORT_STACK=4", lambda builder: (builder.serializeBVH(), builder.getRoot())),
+           ("short-8", " -D BVH -D BVH_SHORT_STACK=8", lambda builder: (builder.serializeBVH(), builder.getRoot())),
+           ("DFS-short-4", " -D BVH -D BVH_IMPLICIT_LEFT -D BVH_SHORT_STACK=4", lambda builder: (builder.serializeBVH(True), builder.getRoot()))]
+
+# Build the binned SAH BVH of a primitive buffer, return the reordered primitives, their offsets, the BVH and its root address
+def buildSAHBVH(prims, offsets):
+    builder = bvhBuilder.BVHBuilder()
+    builder.buildBVH(serializer.Serializer().getPrimBounds(prims, offsets))
+    prims, offsets = builder.reorderPrimitives(prims, offsets)
+    return prims, offsets, builder.serializeBVH(), builder.getRoot()
+
+# Same with the BIH
+def buildBIH(prims, offsets):
+    builder = bihBuilder.BIHBuilder()
+    builder.buildBIH(serializer.Serializer().getPrimBounds(prims, offsets))
+    prims, offsets = builder.reorderPrimitives(prims, offsets)
+    return prims, offsets, builder.serializeBIH(), builder.getRoot()
+
+# Primitive acceleration structures to compare on build plus trace time : name, build options and build function
+ACCELERATORS = [("SAH BVH", " -D BVH", buildSAHBVH),
+                ("BIH", "", buildBIH)]
+
+# Random triangle soup, serialized as Polygon primitives
+def randomScene(ntriangles, seed):
+    rng = np.random.default_rng(seed)
+    centers = rng.random((ntriangles, 1, 3)) * BENCH_SPREAD
+    vertices = (centers + (rng.random((ntriangles, 3, 3)) - 0.5) * BENCH_TRIANGLE_SIZE).astype(np.float32)
+
+    polygons = np.zeros(ntriangles, dtype=serializer.Serializer().polygon)
+    polygons["type"] = serializer.POLYGON
+    polygons["groupIndex"] = np.arange(ntriangles)
+    polygons["xMin"], polygons["yMin"], polygons["zMin"] = vertices.min(axis=1).T
+    polygons["xMax"], polygons["yMax"], polygons["zMax"] = vertices.max(axis=1).T
+    polygons["point1"] = vertices[:, 0]
+    polygons["point2"] = vertices[:, 1]
+    polygons["point3"] = vertices[:, 2]
+    normals = np.cross(vertices[:, 1] - vertices[:, 0], vertices[:, 2] - vertices[:, 0])
+    polygons["faceNormal"] = normals / np.maximum(np.linalg.norm(normals, axis=1, keepdims=True), 1e-30)
+
+    offsets = (np.arange(ntriangles) * polygons.dtype.itemsize).astype(np.int32)
+    return polygons.tobytes(), offsets, vertices
+
+# Rays from random points of the scene cube towards random points of random triangles
+def randomRays(nrays, vertices, seed):
+    rng = np.random.default_rng(seed)
+    origins = rng.random((nrays, 3)) * BENCH_SPREAD
+    targets = vertices[rng.integers(0, len(vertices), nrays)].mean(axis=1)
+    directions = targets - origins
+    directions /= np.maximum(np.linalg.norm(directions, axis=1, keepdims=True), 1e-30)
+    return np.concatenate([origins, directions], axis=1).astype(np.float32)
+
+# Secondary rays of a bounce, as traced by the light model after the first hit : from the hit point of each ray, pushed
+# off the surface, in a random direction of the hemisphere it came from. The rays that missed restart from a random
+# point of the scene cube in a random direction. Neighbouring rays are incoherent, unlike the primary rays
+def randomSecondaryRays(rays, hitT, hitPrim, prims, seed):
+    rng = np.random.default_rng(seed)
+    polygons = np.frombuffer(prims, dtype=serializer.Serializer().polygon)
+    hit = hitPrim >= 0
+
+    normals = polygons["faceNormal"][np.where(hit, hitPrim, 0) // polygons.dtype.itemsize].astype(np.float64)
+    normals *= -np.sign(np.sum(normals * rays[:, 3:], axis=1, keepdims=True) + 1e-30)
+    directions = rng.normal(size=(len(rays), 3))
+    directions /= np.maximum(np.linalg.norm(directions, axis=1, keepdims=True), 1e-30)
+    directions = np.where(hit[:, None], directions * np.sign(np.sum(directions * normals, axis=1, keepdims=True) + 1e-30), directions)
+
+    origins = np.where(hit[:, None], rays[:, :3] + rays[:, 3:] * hitT[:, None] + normals * 1e-4, rng.random((len(rays), 3)) * BENCH_SPREAD)
+    return np.concatenate([origins, directions], axis=1).astype(np.float32)
+
+# Sort key of the rays, as in the sorted launch of the light model (-D RAY_SORTING) : Morton code of the origin in the
+# scene cube, followed by the octant of the direction
+def rayKeys(rays):
+    cells = 1 << RAY_SORT_MORTON_BITS
+    cell = np.clip((rays[:, :3] / BENCH_SPREAD * cells).astype(np.int64), 0, cells - 1)
+    keys = np.zeros(len(rays), np.uint32)
+    for bit in range(RAY_SORT_MORTON_BITS):
+        for axis in range(3):
+            keys |= (((cell[:, axis] >> bit) & 1) << (3 * bit + 2 - axis)).astype(np.uint32)
+    octant = ((rays[:, 3] < 0) * 4 + (rays[:, 4] < 0) * 2 + (rays[:, 5] < 0)).astype(np.uint32)
+    return (keys << 3) | octant
+
+# Cast the rays with one layout, return the best rays/s, the hits and the private memory of a work-item
+def castRays(context, queue, options, bufPrim, bufOffsets, root, bvh, rays):
+    kernelFile = open("kernel/benchmark_kernel.cl", "r")
+    kernelSource = kernelFile.read()
+    kernelFile.close()
+
+    program = cl.Program(context, kernelSource).build(options + " -I kernel/")
+    privateBytes = program.castRays.get_work_group_info(cl.kernel_work_group_info.PRIVATE_MEM_SIZE, context.devices[0])
+    mf = cl.mem_flags
+    nrays = len(rays)
+
+    bufBVH = cl.Buffer(context, mf.READ_ONLY | mf.COPY_HOST_PTR, hostbuf=bvh)
+    bufRays = cl.Buffer(context, mf.READ_ONLY | mf.COPY_HOST_PTR, hostbuf=rays)
+    bufHitT = cl.Buffer(context, mf.WRITE_ONLY, nrays * 4)
+    bufHitPrim = cl.Buffer(context, mf.WRITE_ONLY, nrays * 4)
+
+    best = float("inf")
+    for run in range(BENCH_RUNS + 1):
+        start = time.perf_counter()
+        program.castRays(queue, (nrays,), None, None, np.int32(nrays), bufRays, np.int32(0), bufPrim, bufOffsets, np.int32(root), bufBVH, bufHitT, bufHitPrim)
+        queue.finish()
+        # The first launch is a warm-up
+        if run > 0:
+            best = min(best, time.perf_counter() - start)
+
+    hitT = np.empty(nrays, np.float32)
+    hitPrim = np.empty(nrays, np.int32)
+    cl.enqueue_copy(queue, hitT, bufHitT)
+    cl.enqueue_copy(queue, hitPrim, bufHitPrim)
+
+    return nrays / best, hitT, hitPrim, privateBytes
+
+# Compare the rays/s of the BVH layouts on a random scene
+def benchmark(ntriangles = BENCH_TRIANGLES, nrays = BENCH_RAYS, seed = 0):
+    scenePrims, sceneOffsets, vertices = randomScene(ntriangles, seed)
+    rays = randomRays(nrays, vertices, seed + 1)
+
+    builder = bvhBuilder.BVHBuilder()
+    builder.buildBVH(serializer.Serializer().getPrimBounds(scenePrims, sceneOffsets))
+    prims, offsets = builder.reorderPrimitives(scenePrims, sceneOffsets)
+
+    context = cl.create_some_context()
+    queue = cl.CommandQueue(context)
+    mf = cl.mem_flags
+    bufPrim = cl.Buffer(context, mf.READ_ONLY | mf.COPY_HOST_PTR, hostbuf=prims)
+    bufOffsets = cl.Buffer(context, mf.READ_ONLY | mf.COPY_HOST_PTR, hostbuf=offsets)
+
+    print("Scene : ", ntriangles, " triangles, ", nrays, " rays")
+    reference = None
+    for name, options, serialize in LAYOUTS:
+        bvh, root = serialize(builder)
+        raysPerSecond, hitT, hitPrim, privateBytes = castRays(context, queue, options, bufPrim, bufOffsets, root, bvh, rays)
+
+        # Every layout must find the same hits as the first one
+        mismatches = 0
+        if reference is None:
+            reference = (hitT, hitPrim)
+        else:
+            mismatches = np.count_nonzero((hitPrim != reference[1]) & ~np.isclose(hitT, reference[0]))
+
+        print("%-12s %10.2f Mrays/s   %9d bytes   %6d private bytes   %d mismatches" % (name, raysPerSecond * 1e-6, len(bvh), privateBytes, mismatches))
+
+    # Binary layout traversing the compact triangle records put before the primitives, the hits are the same primitives shifted by the records
+    recordPrims, recordOffsets = serializer.Serializer().prependTriangleRecords(prims, offsets)
+    recordShift = len(recordPrims) - len(prims)
+    bufRecordPrims = cl.Buffer(context, mf.READ_ONLY | mf.COPY_HOST_PTR, hostbuf=recordPrims)
+    bufRecordOffsets = cl.Buffer(context, mf.READ_ONLY | mf.COPY_HOST_PTR, hostbuf=recordOffsets)
+    raysPerSecond, hitT, hitPrim, privateBytes = castRays(context, queue, " -D BVH -D TRIANGLE_RECORDS", bufRecordPrims, bufRecordOffsets, builder.getRoot(), builder.serializeBVH(), rays)
+    hitPrim = np.where(hitPrim >= 0, hitPrim - recordShift, hitPrim)
+    mismatches = np.count_nonzero((hitPrim != reference[1]) & ~np.isclose(hitT, reference[0]))
+    print("%-12s %10.2f Mrays/s   %9d bytes   %6d private bytes   %d mismatches" % ("records", raysPerSecond * 1e-6, recordShift, privateBytes, mismatches))
+
+    # Binary layout testing the leaves as SoA packs of 4 or 8 triangles, on a tree whose leaves are aligned on the packs
+    # The primitive order differs from the reference, the hits are compared on their distance only
+    for width in (4, 8):
+        packBuilder = bvhBuilder.BVHBuilder()
+        packBuilder.buildBVH(serializer.Serializer().getPrimBounds(scenePrims, sceneOffsets), packWidth = width)
+        packBuilder.alignLeaves(width)
+        packPrims, packOffsets = serializer.Serializer().prependTrianglePacks(*packBuilder.reorderPrimitives(scenePrims, sceneOffsets), width)
+        packShift = len(packPrims) - len(prims)
+        bufPackPrims = cl.Buffer(context, mf.READ_ONLY | mf.COPY_HOST_PTR, hostbuf=packPrims)
+        bufPackOffsets = cl.Buffer(context, mf.READ_ONLY | mf.COPY_HOST_PTR, hostbuf=packOffsets)
+        raysPerSecond, hitT, hitPrim, privateBytes = castRays(context, queue, " -D BVH -D TRIANGLE_PACKS=" + str(width), bufPackPrims, bufPackOffsets, packBuilder.getRoot(), packBuilder.serializeBVH(), rays)
+        mismatches = np.count_nonzero(~np.isclose(hitT, reference[0]))
+        print("%-12s %10.2f Mrays/s   %9d bytes   %6d private bytes   %d mismatches" % ("packs-" + str(width), raysPerSecond * 1e-6, packShift, privateBytes, mismatches))
+
+    # Binary layout reading the polygons as a typed array indexed by the leaves, the reordered scene already is one
+    raysPerSecond, hitT, hitPrim, privateBytes = castRays(context, queue, " -D BVH -D POLYGON_ARRAY", bufPrim, bufOffsets, builder.getRoot(), builder.serializeBVH(), rays)
+    mismatches = np.count_nonzero((hitPrim != reference[1]) & ~np.isclose(hitT, reference[0]))
+    print("%-12s %10.2f Mrays/s   %9d bytes   %6d private bytes   %d mismatches" % ("typed array", raysPerSecond * 1e-6, len(prims), privateBytes, mismatches))
+
+    # Same rays traced in the order of their sort key, with the binary layout (the sort itself is not timed), for the
+    # primary rays and for the incoherent secondary rays bounced off their hits
+    bvh, root = builder.serializeBVH(), builder.getRoot()
+    raysPerSecond, hitT, hitPrim, privateBytes = castRays(context, queue, " -D BVH", bufPrim, bufOffsets, root, bvh, rays)
+    secondaryRays = randomSecondaryRays(rays, hitT, hitPrim, prims, seed + 2)
+    for name, workload in (("primary", rays), ("secondary", secondaryRays)):
+        order = np.argsort(rayKeys(workload), kind='stable')
+        raysPerSecond, hitT, hitPrim, privateBytes = castRays(context, queue, " -D BVH", bufPrim, bufOffsets, root, bvh, workload)
+        sortedRaysPerSecond, sortedHitT, sortedHitPrim, privateBytes = castRays(context, queue, " -D BVH", bufPrim, bufOffsets, root, bvh, np.ascontiguousarray(workload[order]))
+        mismatches = np.count_nonzero((sortedHitPrim != hitPrim[order]) & ~np.isclose(sortedHitT, hitT[order]))
+        print("Ray sorting, %-9s : %10.2f Mrays/s unsorted   %10.2f Mrays/s sorted   %d mismatches" % (name, raysPerSecond * 1e-6, sortedRaysPerSecond * 1e-6, mismatches))
+
+    # Build plus trace time of each acceleration structure, built from the unordered scene
+    # The primitive order differs between structures, so the hits are compared on their distance only
+    print("Build plus trace : ")
+    reference = None
+    for name, options, build in ACCELERATORS:
+        start = time.perf_counter()
+        prims, offsets, bvh, root = build(scenePrims, sceneOffsets)
+        buildTime = time.perf_counter() - start
+
+        bufPrim = cl.Buffer(context, mf.READ_ONLY | mf.COPY_HOST_PTR, hostbuf=prims)
+        bufOffsets = cl.Buffer(context, mf.READ_ONLY | mf.COPY_HOST_PTR, hostbuf=offsets)
+        raysPerSecond, hitT, hitPrim, privateBytes = castRays(context, queue, options, bufPrim, bufOffsets, root, bvh, rays)
+        traceTime = nrays / raysPerSecond
+
+        mismatches = 0
+        if reference is None:
+            reference = hitT
+        else:
+            mismatches = np.count_nonzero(~np.isclose(hitT, reference))
+
+        print("%-12s %8.3f s build   %8.3f s trace   %8.3f s total   %9d bytes   %d mismatches" % (name, buildTime, traceTime, buildTime + traceTime, len(bvh), mismatches))
+
+if __name__ == '__main__':
+    ntriangles = int(sys.argv[1]) if len(sys.argv) > 1 else BENCH_TRIANGLES
+    nrays = int(sys.argv[2]) if len(sys.argv) > 2 else BENCH_RAYS
+    benchmark(ntriangles, nrays)
@@ -0,0 +1,252 @@
+import sys
+import numpy as np
+from openalea.plantgl.all import *
+import serializer
+import bvhBuilder
+
+MAX_LEAF_SIZE = 4 # Nodes with at most this many primitives become leaves
+MAX_DEPTH = 48 # Below this depth the nodes are split at the object median, the traversal stack has 64 entries
+
+# Bounding interval hierarchy builder and serializer
+# Each branch splits its primitives along one axis and keeps two planes : the upper bound of the left child and the
+# lower bound of the right child. The split plane halves a candidate box, starting from the scene bounds, and the
+# primitives are sorted on each side by centroid. When one side would be empty, the candidate box is shrunk to the
+# centroid bounds. No cost is evaluated, the build is O(n log n).
+# See "Instant Ray Tracing: The Bounding Interval Hierarchy", Waechter and Keller, EGSR 2006.
+class BIHBuilder():
+    def __init__(self):
+
+        # Structures
+        # Same layout as BIHNode in kernel/trace/bih/bih.h (16 bytes)
+        # c0idx holds the left child address shifted by two and the split axis in the low bits, c1idx the right child address
+        # left and right are the planes of a branch, a leaf holds its primitive index and count instead
+        self.node = [("c0idx", np.int32), ("c1idx", np.int32), ("left", np.float32), ("right", np.float32)]
+
+        # Attributes
+        self.clear()
+
+    # Reset the tree arrays
+    def clear(self):
+        self.nodeLeft = np.empty(0, np.int32) # Left child index, -1 for leaves
+        self.nodeRight = np.empty(0, np.int32) # Right child index, -1 for leaves
+        self.nodeAxis = np.empty(0, np.int32) # Split axis of a branch
+        self.nodePlanes = np.empty((0, 2), np.float32) # Left child upper plane and right child lower plane of a branch
+        self.nodeStart = np.empty(0, np.int32) # First primitive of a leaf
+        self.nodeCount = np.empty(0, np.int32) # Primitive count of a leaf, 0 for branches
+        self.primOrder = np.empty(0, np.int32) # Primitive permutation, leaf ranges index into it
+
+    # Build the BIH over primitive bounds, bounds is an (n, 6) array, one [x0, x1, y0, y1, z0, z1] box per primitive
+    def buildBIH(self, bounds, maxLeafSize = MAX_LEAF_SIZE):
+        bounds = np.asarray(bounds, dtype=np.float32).reshape(-1, 6)
+        assert len(bounds) > 0, "Can't build a BIH without primitives."
+
+        lo = bounds[:, 0::2]
+        hi = bounds[:, 1::2]
+        centroids = (lo.astype(np.float64) + hi) * 0.5
+
+        capacity = 2 * len(bounds) - 1
+        self.nodeLeft = np.full(capacity, -1, np.int32)
+        self.nodeRight = np.full(capacity, -1, np.int32)
+        self.nodeAxis = np.zeros(capacity, np.int32)
+        self.nodePlanes = np.zeros((capacity, 2), np.float32)
+        self.nodeStart = np.zeros(capacity, np.int32)
+        self.nodeCount = np.zeros(capacity, np.int32)
+        self.primOrder = np.arange(len(bounds), dtype=np.int32)
+        nodeTotal = 1
+
+        sceneBox = np.stack([lo.min(axis=0), hi.max(axis=0)], axis=1).astype(np.float64)
+        stack = [(0, 0, len(bounds), sceneBox, 1)]
+        while stack:
+            node, start, end, box, depth = stack.pop()
+            count = end - start
+            if count <= maxLeafSize:
+                self.nodeStart[node] = start
+                self.nodeCount[node] = count
+                continue
+
+            indices = self.primOrder[start:end]
+            c = centroids[indices]
+            axis, left = self.splitPrimitives(c, box, depth)
+
+            self.primOrder[start:end] = np.concatenate([indices[left], indices[~left]])
+            mid = start + int(np.count_nonzero(left))
+
+            self.nodeAxis[node] = axis
+            self.nodePlanes[node, 0] = hi[indices[left], axis].max()
+            self.nodePlanes[node, 1] = lo[indices[~left], axis].min()
+
+            # Children boxes, split at the largest left centroid
+            plane = c[left, axis].max()
+            leftBox = box.copy()
+            rightBox = box.copy()
+            leftBox[axis, 1] = plane
+            rightBox[axis, 0] = plane
+
+            self.nodeLeft[node] = nodeTotal
+            self.nodeRight[node] = nodeTotal + 1
+            nodeTotal += 2
+            stack.append((nodeTotal - 1, mid, end, rightBox, depth + 1))
+            stack.append((nodeTotal - 2, start, mid, leftBox, depth + 1))
+
+        self.nodeLeft = self.nodeLeft[:nodeTotal]
+        self.nodeRight = self.nodeRight[:nodeTotal]
+        self.nodeAxis = self.nodeAxis[:nodeTotal]
+        self.nodePlanes = self.nodePlanes[:nodeTotal]
+        self.nodeStart = self.nodeStart[:nodeTotal]
+        self.nodeCount = self.nodeCount[:nodeTotal]
+
+        print("BIH built : ", nodeTotal, " nodes")
+
+    # Split axis of a node and mask of the primitives going left, given their centroids and the candidate box
+    def splitPrimitives(self, centroids, box, depth):
+        count = len(centroids)
+        if depth < MAX_DEPTH:
+            for i in range(4):
+                axis = int(np.argmax(box[:, 1] - box[:, 0]))
+                plane = (box[axis, 0] + box[axis, 1]) * 0.5
+                left = centroids[:, axis] < plane
+                if 0 < np.count_nonzero(left) < count:
+                    return axis, left
+
+                # One side is empty, shrink the candidate box to the centroids
+                box = box.copy()
+                box[:, 0] = np.maximum(box[:, 0], centroids.min(axis=0))
+                box[:, 1] = np.minimum(box[:, 1], centroids.max(axis=0))
+                box[:, 1] = np.maximum(box[:, 0], box[:, 1])
+
+        # Object median along the widest centroid axis
+        axis = int(np.argmax(centroids.max(axis=0) - centroids.min(axis=0)))
+        left = np.zeros(count, bool)
+        left[np.argsort(centroids[:, axis], kind='stable')[:count // 2]] = True
+        return axis, left
+
+    # Root address to give to the kernel (a tree made of a single leaf is encoded as a leaf address)
+    def getRoot(self):
+        return 0 if self.nodeLeft[0] >= 0 else -1
+
+    # Reorder the primitive buffer so that each leaf covers a contiguous [idx, idx + pcount) range
+    def reorderPrimitives(self, prims, offsets):
+        return bvhBuilder.reorderPrimitives(self.primOrder, prims, offsets)
+
+    # Start each leaf on a pack of width triangles, before the primitives are reordered and the tree serialized
+    def alignLeaves(self, width):
+        self.primOrder, self.nodeStart = bvhBuilder.alignLeaves(self.primOrder, self.nodeStart, self.nodeCount, width)
+
+    # Serialize the BIH in the BIHNode layout, the node index is its address and a leaf child address is encoded as -index-1
+    def serializeBIH(self):
+        nodes = np.zeros(len(self.nodeLeft), dtype=self.node)
+        branches = np.nonzero(self.nodeLeft >= 0)[0]
+        leaves = np.nonzero(self.nodeLeft < 0)[0]
+
+        left = self.nodeLeft[branches]
+        right = self.nodeRight[branches]
+        leftAddress = np.where(self.nodeLeft[left] < 0, -left - 1, left)
+        rightAddress = np.where(self.nodeLeft[right] < 0, -right - 1, right)
+
+        nodes["c0idx"][branches] = (leftAddress << 2) | self.nodeAxis[branches]
+        nodes["c1idx"][branches] = rightAddress
+        nodes["left"][branches] = self.nodePlanes[branches, 0]
+        nodes["right"][branches] = self.nodePlanes[branches, 1]
+
+        # Leaves store their range in the plane slots
+        raw = nodes.view(np.int32).reshape(-1, 4)
+        raw[leaves, 2] = self.nodeStart[leaves]
+        raw[leaves, 3] = self.nodeCount[leaves]
+
+        return nodes.tobytes()
+
+    # Closest hit distance of a ray through a tree serialized by serializeBIH, walked on the host as bihTrace does
+    # intersectLeaf(start, count, origin, direction) returns the closest hit distance of a leaf range, inf when there is none
+    def traceHost(self, bih, root, origin, direction, intersectLeaf):
+        nodes = np.frombuffer(bih, dtype=self.node)
+        ranges = nodes.view(np.int32).reshape(-1, 4)[:, 2:4]
+        closest = np.inf
+        stack = [(int(root), 0.0, np.inf)]
+        while stack:
+            address, tMin, tMax = stack.pop()
+            tMax = min(tMax, closest)
+            if address < 0:
+                start, count = ranges[-address - 1]
+                closest = min(closest, intersectLeaf(int(start), int(count), origin, direction))
+                continue
+
+            # Interval of the ray in each child, between the node interval and the child plane
+            node = nodes[address]
+            axis = int(node["c0idx"]) & 0x3
+            nearChild, farChild = int(node["c0idx"]) >> 2, int(node["c1idx"])
+            invDirection = 1.0 / direction[axis]
+            tNear = (node["left"] - origin[axis]) * invDirection
+            tFar = (node["right"] - origin[axis]) * invDirection
+            if invDirection < 0.0:
+                tNear, tFar = tFar, tNear
+                nearChild, farChild = farChild, nearChild
+
+            if tMin > tMax:
+                continue
+            if tMax >= tFar:
+                stack.append((farChild, max(tMin, tFar), tMax))
+            if tMin <= tNear:
+                stack.append((nearChild, tMin, min(tMax, tNear)))
+        return closest
+
+    # Testing method : the BIH finds the same hits as the BVH over the same primitives
+    def test(self):
+        points = [(0.0, 0.0, 0.0),
+                  (0.0, 1.0, 0.0),
+                  (1.0, 0.0, 0.0),
+                  (1.0, 1.0, 1.0)]
+
+        indices = [(0, 1, 2),
+                   (0, 1, 3),
+                   (0, 2, 3),
+                   (1, 2, 3)]
+
+        tetra = TriangleSet(points, indices)
+        boule = Sphere(2)
+        tessel = Tesselator()
+        boule.apply(tessel)
+        triBoule = tessel.triangulation
+
+        # Small triangles scattered around the sphere
+        rng = np.random.default_rng(1)
+        cloud = (rng.uniform(-4.0, 4.0, (300, 1, 3)) + rng.uniform(-0.3, 0.3, (300, 3, 3))).reshape(-1, 3)
+        triCloud = TriangleSet(cloud.tolist(), [(3 * i, 3 * i + 1, 3 * i + 2) for i in range(300)])
+
+        # A single leaf tree, then a deeper one
+        for shapes in [[tetra], [tetra, triBoule, triCloud]]:
+            scene = Scene()
+            for shape in shapes:
+                scene.add(shape)
+
+            seri = serializer.Serializer()
+            prims, offsets = seri.serializeTriangleScene(scene)
+            bounds = seri.getPrimBounds(prims, offsets)
+
+            self.buildBIH(bounds)
+            bihPrims, bihOffsets = self.reorderPrimitives(prims, offsets)
+            bihVertices = seri.getTriangleVertices(bihPrims, bihOffsets)
+            bih = self.serializeBIH()
+
+            bvh = bvhBuilder.BVHBuilder()
+            bvh.buildBVH(bounds)
+            bvhPrims, bvhOffsets = bvh.reorderPrimitives(prims, offsets)
+            bvhVertices = seri.getTriangleVertices(bvhPrims, bvhOffsets)
+            bvhNodes = bvh.serializeBVH()
+
+            # Rays aimed at the triangle centers, and rays in random directions
+            centers = bvhVertices.mean(axis=1)
+            mismatches = 0
+            for i in range(200):
+                origin = rng.uniform(-6.0, 6.0, 3)
+                direction = (centers[rng.integers(len(centers))] if i % 2 else rng.uniform(-6.0, 6.0, 3)) - origin
+                found = self.traceHost(bih, self.getRoot(), origin, direction, lambda start, count, o, d: bvhBuilder.rayTriangles(bihVertices[start:start + count], o, d))
+                expected = bvh.traceHost(bvhNodes, bvh.getRoot(), origin, direction, lambda start, count, o, d: bvhBuilder.rayTriangles(bvhVertices[start:start + count], o, d))
+                if not np.isclose(found, expected, rtol=1e-6):
+                    mismatches += 1
+
+            print("BIH hits mismatching the BVH : ", mismatches, " / 200")
+            assert mismatches == 0, "Error : the BIH traversal misses hits of the BVH."
+
+if __name__ == '__main__':
+    builder = BIHBuilder()
+    builder.test()
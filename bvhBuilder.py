@@ -5,7 +5,21 @@ import pyopencl.array
 import numpy as np
 from openalea.plantgl.all import *
 import structfill
+import serializer
 import aabbtree
+import collections
+
+# SAH builder parameters
+SAH_BINS = 16 # Number of centroid bins per axis
+SAH_TRAVERSAL_COST = 1.0 # Cost of one node traversal step
+SAH_INTERSECTION_COST = 1.0 # Cost of one primitive intersection
+MAX_LEAF_SIZE = 4 # Leaves are only created above this size if no split plane is found
+
+LEVEL_BATCH_NODES = 1 << 14 # Nodes of a level split at once by the build, bounds the memory of their bins
+
+# Spatial split builder parameters
+SBVH_SPLIT_BUDGET = 0.3 # Allowed fraction of duplicated references
+SBVH_OVERLAP_THRESHOLD = 1e-5 # Spatial splits are only tried when the object split children overlap more than this fraction of the root area
 
 # Convert a PlantGL BoundingBox to an AABBTree BoundingBox
 def plantGLBBtoAABB(bb):
@@ -14,91 +28,798 @@ def plantGLBBtoAABB(bb):
 
     return aabbtree.AABB([(bb.getXMin(), bb.getXMax()), (bb.getYMin(), bb.getYMax()), (bb.getZMin(), bb.getZMax())])
 
+# Surface area of boxes stored as [x0, x1, y0, y1, z0, z1] (same order as the kernel AABB)
+def boxArea(bounds):
+    return cornerArea(np.moveaxis(bounds[..., 0::2], -1, 0), np.moveaxis(bounds[..., 1::2], -1, 0))
+
+# Surface area of boxes given by their min and max corners, with the coordinates on the first axis
+def cornerArea(lo, hi):
+    d = np.maximum(0.0, hi - lo)
+    return 2.0 * (d[0] * d[1] + d[0] * d[2] + d[1] * d[2])
+
+# Reorder a primitive byte chain in the order of the leaf ranges of a tree, primOrder is the primitive of each leaf entry
+# offsets is the byte offset of each primitive, the new offsets are returned per leaf entry
+# A primitive referenced by several leaf entries is stored once, at its first reference
+# The bytes before the first primitive (the shared arrays of the indexed meshes) are kept in place
+def reorderPrimitives(primOrder, prims, offsets):
+    raw = np.frombuffer(prims, dtype=np.uint8)
+    offsets = np.asarray(offsets, dtype=np.int64)
+    prefix = int(offsets.min())
+
+    # Size of each primitive in the byte chain
+    ends = np.empty_like(offsets)
+    sortedIdx = np.argsort(offsets, kind='stable')
+    ends[sortedIdx[:-1]] = offsets[sortedIdx[1:]]
+    ends[sortedIdx[-1]] = len(raw)
+    sizes = ends - offsets
+
+    # Primitives in order of first reference
+    first = np.unique(primOrder, return_index=True)[1]
+    stored = primOrder[np.sort(first)]
+
+    # Gather the primitives in leaf order
+    starts = offsets[stored]
+    lengths = sizes[stored]
+    storedOffsets = prefix + np.concatenate([[0], np.cumsum(lengths)[:-1]])
+    gather = np.concatenate([np.arange(prefix), np.repeat(starts - storedOffsets, lengths) + np.arange(prefix, prefix + lengths.sum())])
+
+    newOffsets = np.empty(len(offsets), np.int64)
+    newOffsets[stored] = storedOffsets
+    return raw[gather].tobytes(), newOffsets[primOrder].astype(np.int32)
+
+# Align the leaf ranges of a tree on multiples of width, for leaves read as packs of width triangles (-D TRIANGLE_PACKS)
+# A leaf keeps its count, the entries up to the next multiple repeat its last primitive and are never tested
+# Return the new primitive order and leaf starts
+def alignLeaves(primOrder, nodeStart, nodeCount, width):
+    leaves = np.nonzero(nodeCount > 0)[0]
+    leaves = leaves[np.argsort(nodeStart[leaves], kind='stable')]
+    padded = (nodeCount[leaves] + width - 1) // width * width
+    alignedStart = np.concatenate([[0], np.cumsum(padded)[:-1]]).astype(np.int32)
+
+    lane = np.arange(padded.sum()) - np.repeat(alignedStart, padded)
+    source = np.repeat(nodeStart[leaves], padded) + np.minimum(lane, np.repeat(nodeCount[leaves] - 1, padded))
+
+    nodeStart = nodeStart.copy()
+    nodeStart[leaves] = alignedStart
+    return primOrder[source], nodeStart
+
+# Entry and exit distances of a ray through boxes stored as [x0, x1, y0, y1, z0, z1], a box is hit when near <= far
+def rayBoxes(bounds, origin, direction):
+    t0 = (bounds[:, 0::2] - origin) / direction
+    t1 = (bounds[:, 1::2] - origin) / direction
+    near = np.maximum(np.minimum(t0, t1).max(axis=1), 0.0)
+    far = np.maximum(t0, t1).min(axis=1)
+    return near, far
+
+# Distance to the closest of (n, 3, 3) triangles hit by a ray (Moller-Trumbore), inf when they are all missed
+def rayTriangles(vertices, origin, direction):
+    vertices = np.asarray(vertices, np.float64)
+    e1 = vertices[:, 1] - vertices[:, 0]
+    e2 = vertices[:, 2] - vertices[:, 0]
+    p = np.cross(direction, e2)
+    det = np.einsum('ij,ij->i', e1, p)
+    s = origin - vertices[:, 0]
+    q = np.cross(s, e1)
+    with np.errstate(divide='ignore', invalid='ignore'):
+        u = np.einsum('ij,ij->i', s, p) / det
+        v = (q @ direction) / det
+        t = np.einsum('ij,ij->i', e2, q) / det
+    hit = (det != 0.0) & (u >= 0.0) & (v >= 0.0) & (u + v <= 1.0) & (t > 0.0)
+    return np.min(t[hit], initial=np.inf)
+
 class BVHBuilder():
     def __init__(self):
 
         # Structures
-        # left BBox XY min and Max, both BBOx Z min and max, and right BBox XY min and Max
-        self.firstInfos = [("n0xy", np.float32, 4), ("nz", np.float32, 4), ("n1xy", np.float32, 4)]
-        # left child and right child index
-        self.branch = self.firstInfos + [("c0idx", np.int32), ("c1idx", np.int32)]
-        # primitive index, and primitive count
-        self.leaf = self.firstInfos + [("idx", np.int32), ("pcount", np.int32)]
+        # Same layout as BVHNode in kernel/trace/bvh/bvh.h (3 float4 + 1 int4 = 64 bytes)
+        # left BBox XY min and Max, both BBox Z min and max, and right BBox XY min and Max
+        # cnodes holds the left and right child index for a branch, the primitive index and count for a leaf
+        self.node = [("n0xy", np.float32, 4), ("nz", np.float32, 4), ("n1xy", np.float32, 4), ("cnodes", np.int32, 4)]
 
         # Attributes
-        self.tree = aabbtree.AABBTree()
-        self.serializedNodes = 0
-
-    # Build the BVH from a PlantGL Scene using AABBTree
-    def buildBVHfromScene(self, scene):
-        # Type check
-        assert type(scene) == openalea.plantgl.scenegraph._pglsg.Scene, "Tree must be constructed with a PlantGL scene."
-
-        for i, shape in enumerate(scene):
-            bb = BoundingBox(shape)
-            aabb = plantGLBBtoAABB(bb)
-            self.tree.add(aabb, i)
-
-    # Set the BVHTree from an external source
+        self.clear()
+
+    # Reset the tree arrays
+    def clear(self):
+        self.nodeBounds = np.empty((0, 6), np.float32) # Bounds of each node, [x0, x1, y0, y1, z0, z1]
+        self.nodeLeft = np.empty(0, np.int32) # Left child index, -1 for leaves
+        self.nodeRight = np.empty(0, np.int32) # Right child index, -1 for leaves
+        self.nodeStart = np.empty(0, np.int32) # First primitive of a leaf
+        self.nodeCount = np.empty(0, np.int32) # Primitive count of a leaf, 0 for branches
+        self.primOrder = np.empty(0, np.int32) # Primitive permutation, leaf ranges index into it
+
+    # Build the BVH over primitive bounds with a binned SAH builder
+    # bounds is an (n, 6) array, one [x0, x1, y0, y1, z0, z1] box per primitive
+    # The tree is built level by level : the nodes of a level are binned, swept and partitioned together with numpy
+    # array operations, LEVEL_BATCH_NODES at a time, so the Python cost is per level instead of per node. The nodes are
+    # written in preallocated arrays, the children of a branch are consecutive
+    # With packWidth, the leaves are tested packWidth primitives at a time (-D TRIANGLE_PACKS) : the SAH counts the packs
+    # of a leaf instead of its primitives, and the leaves hold up to packWidth primitives
+    def buildBVH(self, bounds, maxLeafSize = MAX_LEAF_SIZE, packWidth = 1):
+        bounds = np.asarray(bounds, dtype=np.float32).reshape(-1, 6)
+        assert len(bounds) > 0, "Can't build a BVH without primitives."
+        count = len(bounds)
+
+        self.lo = np.ascontiguousarray(bounds[:, 0::2])
+        self.hi = np.ascontiguousarray(bounds[:, 1::2])
+        self.centroids = (self.lo + self.hi) * 0.5
+        self.maxLeafSize = max(maxLeafSize, packWidth)
+        self.packWidth = packWidth
+
+        # Preallocated node arrays, a binary tree over n primitives has at most 2n - 1 nodes
+        capacity = 2 * count - 1
+        self.nodeBounds = np.zeros((capacity, 6), np.float32)
+        self.nodeLeft = np.full(capacity, -1, np.int32)
+        self.nodeRight = np.full(capacity, -1, np.int32)
+        self.nodeStart = np.zeros(capacity, np.int32)
+        self.nodeCount = np.zeros(capacity, np.int32)
+        self.primOrder = np.arange(count, dtype=np.int32)
+        self.nodeTotal = 1
+
+        # Nodes of the current level and their primitive ranges [start, end)
+        nodes, starts, ends = np.zeros(1, np.int64), np.zeros(1, np.int64), np.full(1, count, np.int64)
+        while len(nodes) > 0:
+            nodes, starts, ends = self.singleLeaves(nodes, starts, ends)
+            # Nodes of similar sizes are split together, so the batches of small nodes use fewer bins
+            order = np.argsort(ends - starts, kind='stable')
+            nodes, starts, ends = nodes[order], starts[order], ends[order]
+            children = [self.splitLevel(nodes[batch:batch + LEVEL_BATCH_NODES], starts[batch:batch + LEVEL_BATCH_NODES], ends[batch:batch + LEVEL_BATCH_NODES])
+                        for batch in range(0, len(nodes), LEVEL_BATCH_NODES)]
+            nodes, starts, ends = [np.concatenate([np.empty(0, np.int64)] + [child[i] for child in children]) for i in range(3)]
+
+        self.nodeBounds = self.nodeBounds[:self.nodeTotal]
+        self.nodeLeft = self.nodeLeft[:self.nodeTotal]
+        self.nodeRight = self.nodeRight[:self.nodeTotal]
+        self.nodeStart = self.nodeStart[:self.nodeTotal]
+        self.nodeCount = self.nodeCount[:self.nodeTotal]
+        del self.lo, self.hi, self.centroids
+
+        print("BVH built : ", self.nodeTotal, " nodes, SAH cost : ", self.computeSAHCost())
+
+    # Make leaves of the nodes of a level holding a single primitive, without binning them
+    # Return the other nodes and their ranges
+    def singleLeaves(self, nodes, starts, ends):
+        single = ends - starts == 1
+        prims = self.primOrder[starts[single]]
+        self.nodeBounds[nodes[single], 0::2] = self.lo[prims]
+        self.nodeBounds[nodes[single], 1::2] = self.hi[prims]
+        self.nodeStart[nodes[single]] = starts[single]
+        self.nodeCount[nodes[single]] = 1
+        return nodes[~single], starts[~single], ends[~single]
+
+    # Split nodes of a level over their primitive ranges [starts, ends), with the same binned SAH split as objectSplit
+    # The nodes get their bounds, those that a split doesn't pay for become leaves, the others have their range
+    # partitioned (each side keeps its relative order) and their two children allocated
+    # Return the children nodes and their ranges
+    def splitLevel(self, nodes, starts, ends):
+        counts = ends - starts
+        first = np.cumsum(counts) - counts
+        segment = np.repeat(np.arange(len(nodes)), counts)
+        position = np.arange(len(segment)) + np.repeat(starts - first, counts)
+        indices = self.primOrder[position]
+        centroids = self.centroids[indices]
+
+        # Bounds of the nodes, and bins of their centroids. The bounds are handled as [lo, -hi] so a min reduces both
+        boxes = np.concatenate([self.lo[indices], -self.hi[indices]], axis=1)
+        nodeBoxes = np.minimum.reduceat(boxes, first, axis=0)
+        self.nodeBounds[nodes, 0::2] = nodeBoxes[:, :3]
+        self.nodeBounds[nodes, 1::2] = -nodeBoxes[:, 3:]
+        cmin = np.minimum.reduceat(centroids, first, axis=0)
+        cmax = np.maximum.reduceat(centroids, first, axis=0)
+        scale = np.where(cmax > cmin, SAH_BINS / np.maximum(cmax - cmin, 1e-30), 0.0)
+        bins = np.minimum(((centroids - cmin[segment]) * scale[segment]).astype(np.int32), SAH_BINS - 1)
+
+        # Nodes of fewer primitives than bins use fewer bins : a bin is replaced by its rank among the bins used on its
+        # axis, which only drops the empty bins, so the best split is the same
+        width = int(min(SAH_BINS, counts.max()))
+        if width < SAH_BINS:
+            used = np.zeros((len(nodes), 3, SAH_BINS), np.int32)
+            used[segment[:, None], np.arange(3), bins] = 1
+            bins = (np.cumsum(used, axis=2) - 1)[segment[:, None], np.arange(3), bins]
+
+        # Bins of axis a of node i are [(3 * i + a) * width, (3 * i + a + 1) * width), binBoxes holds one row per
+        # coordinate of the [lo, -hi] bounds of the bins
+        binCount = np.zeros(len(nodes) * 3 * width, np.int64)
+        binBoxes = np.full((6, len(nodes) * 3 * width), np.inf, np.float32)
+        columns = np.ascontiguousarray(boxes.T)
+        for axis in range(3):
+            flatBins = (segment * 3 + axis) * width + bins[:, axis]
+            binCount += np.bincount(flatBins, minlength=len(binCount))
+            for coordinate in range(6):
+                np.minimum.at(binBoxes[coordinate], flatBins, columns[coordinate])
+        binCount = binCount.reshape(-1, 3, width)
+        binBoxes = binBoxes.reshape(6, -1, 3, width)
+
+        # Sweep from both sides, split i puts bins [0, i] on the left
+        leftCount = np.cumsum(binCount, axis=2)[..., :-1]
+        rightCount = counts[:, None, None] - leftCount
+        leftBox = np.minimum.accumulate(binBoxes, axis=3)[..., :-1]
+        rightBox = np.minimum.accumulate(binBoxes[..., ::-1], axis=3)[..., ::-1][..., 1:]
+
+        leftPacks = (leftCount + self.packWidth - 1) // self.packWidth
+        rightPacks = (rightCount + self.packWidth - 1) // self.packWidth
+        with np.errstate(invalid='ignore'):
+            cost = cornerArea(leftBox[:3], -leftBox[3:]) * leftPacks + cornerArea(rightBox[:3], -rightBox[3:]) * rightPacks
+        cost[(leftCount == 0) | (rightCount == 0)] = np.inf
+        cost = cost.reshape(len(nodes), -1)
+
+        best = np.argmin(cost, axis=1)
+        bestCost = cost[np.arange(len(nodes)), best]
+        splitAxis, splitBin = np.divmod(best, width - 1)
+        parentArea = np.maximum(boxArea(self.nodeBounds[nodes]), 1e-30)
+        splitCost = SAH_TRAVERSAL_COST + SAH_INTERSECTION_COST * bestCost / parentArea
+        leafCost = SAH_INTERSECTION_COST * ((counts + self.packWidth - 1) // self.packWidth)
+        finite = np.isfinite(bestCost)
+        leaf = (counts <= 1) | ((counts <= self.maxLeafSize) & (~finite | (leafCost <= splitCost)))
+
+        self.nodeStart[nodes[leaf]] = starts[leaf]
+        self.nodeCount[nodes[leaf]] = counts[leaf]
+
+        # Left side of each primitive : its bin on the split axis, or the first half of the range when all the
+        # centroids fall in the same bin
+        left = np.where(finite[segment], bins[np.arange(len(segment)), splitAxis[segment]] <= splitBin[segment], position - starts[segment] < (counts // 2)[segment])
+        leftCounts = np.add.reduceat(left.astype(np.int64), first)
+        leftRank = np.cumsum(left) - (np.cumsum(leftCounts) - leftCounts)[segment]
+        rightRank = np.cumsum(~left) - (np.cumsum(counts - leftCounts) - (counts - leftCounts))[segment]
+        target = starts[segment] + np.where(left, leftRank - 1, leftCounts[segment] + rightRank - 1)
+        moved = ~leaf[segment]
+        self.primOrder[target[moved]] = indices[moved]
+
+        # Children of the split nodes, allocated in consecutive pairs
+        split = ~leaf
+        lefts = self.nodeTotal + 2 * np.arange(np.count_nonzero(split))
+        self.nodeTotal += 2 * len(lefts)
+        self.nodeLeft[nodes[split]] = lefts
+        self.nodeRight[nodes[split]] = lefts + 1
+        mids = starts[split] + leftCounts[split]
+        return np.concatenate([lefts, lefts + 1]), np.concatenate([starts[split], mids]), np.concatenate([mids, ends[split]])
+
+    # Bin the primitives of a node
+    # Return the primitive count, min and max bounds of each bin, bins of axis a are [a * SAH_BINS, (a + 1) * SAH_BINS)
+    def binPrimitives(self, indices, cmin, scale):
+        bins = np.minimum(((self.centroids[indices] - cmin) * scale).astype(np.int32), SAH_BINS - 1)
+        flatBins = (bins + np.arange(3, dtype=np.int32) * SAH_BINS).ravel()
+
+        binCount = np.bincount(flatBins, minlength=3 * SAH_BINS)
+        binLo = np.full((3 * SAH_BINS, 3), np.inf, np.float32)
+        binHi = np.full((3 * SAH_BINS, 3), -np.inf, np.float32)
+        np.minimum.at(binLo, flatBins, np.repeat(self.lo[indices], 3, axis=0))
+        np.maximum.at(binHi, flatBins, np.repeat(self.hi[indices], 3, axis=0))
+        return binCount, binLo, binHi
+
+    # Bin a node
+    def binNode(self, indices):
+        cmin = self.centroids[indices].min(axis=0)
+        cmax = self.centroids[indices].max(axis=0)
+        scale = np.where(cmax > cmin, SAH_BINS / np.maximum(cmax - cmin, 1e-30), 0.0)
+        return (cmin, scale) + self.binPrimitives(indices, cmin, scale)
+
+    # Best binned SAH object split of a node, also sets the bounds of the node
+    # Return the left mask (None if a leaf is cheaper), the split cost and the surface area of the overlap of both children
+    def objectSplit(self, node, indices):
+        count = len(indices)
+        cmin, scale, binCount, binLo, binHi = self.binNode(indices)
+        binCount = binCount.reshape(3, SAH_BINS)
+        binLo = binLo.reshape(3, SAH_BINS, 3)
+        binHi = binHi.reshape(3, SAH_BINS, 3)
+
+        # The bins of any axis cover the whole node
+        nodeBox = self.nodeBounds[node]
+        nodeBox[0::2] = binLo[0].min(axis=0)
+        nodeBox[1::2] = binHi[0].max(axis=0)
+
+        if count <= 1:
+            return None, np.inf, 0.0
+
+        # Sweep from both sides, split i puts bins [0, i] on the left
+        leftCount = np.cumsum(binCount, axis=1)[:, :-1]
+        rightCount = count - leftCount
+        leftBox = np.empty((3, SAH_BINS - 1, 6), np.float32)
+        rightBox = np.empty((3, SAH_BINS - 1, 6), np.float32)
+        leftBox[..., 0::2] = np.minimum.accumulate(binLo, axis=1)[:, :-1]
+        leftBox[..., 1::2] = np.maximum.accumulate(binHi, axis=1)[:, :-1]
+        rightBox[..., 0::2] = np.minimum.accumulate(binLo[:, ::-1], axis=1)[:, ::-1][:, 1:]
+        rightBox[..., 1::2] = np.maximum.accumulate(binHi[:, ::-1], axis=1)[:, ::-1][:, 1:]
+
+        # Intersection tests of a side, one per pack
+        leftPacks = (leftCount + self.packWidth - 1) // self.packWidth
+        rightPacks = (rightCount + self.packWidth - 1) // self.packWidth
+        with np.errstate(invalid='ignore'):
+            cost = boxArea(leftBox) * leftPacks + boxArea(rightBox) * rightPacks
+        cost[(leftCount == 0) | (rightCount == 0)] = np.inf
+
+        best = np.unravel_index(np.argmin(cost), cost.shape)
+        parentArea = max(boxArea(nodeBox), 1e-30)
+        splitCost = SAH_TRAVERSAL_COST + SAH_INTERSECTION_COST * cost[best] / parentArea
+        leafCost = SAH_INTERSECTION_COST * ((count + self.packWidth - 1) // self.packWidth)
+
+        if np.isfinite(cost[best]):
+            overlap = np.empty(6, np.float32)
+            overlap[0::2] = np.maximum(leftBox[best][0::2], rightBox[best][0::2])
+            overlap[1::2] = np.minimum(leftBox[best][1::2], rightBox[best][1::2])
+            overlapArea = boxArea(overlap) if (overlap[1::2] >= overlap[0::2]).all() else 0.0
+
+            if count <= self.maxLeafSize and leafCost <= splitCost:
+                return None, splitCost, overlapArea
+            axis, splitBin = best
+            return np.minimum(((self.centroids[indices, axis] - cmin[axis]) * scale[axis]).astype(np.int32), SAH_BINS - 1) <= splitBin, splitCost, overlapArea
+
+        # All centroids fall in the same bin, split the range in half if it is too big for a leaf
+        if count <= self.maxLeafSize:
+            return None, np.inf, boxArea(nodeBox)
+        split = np.zeros(count, bool)
+        split[:count // 2] = True
+        return split, np.inf, boxArea(nodeBox)
+
+    # Build a spatial split BVH (SBVH) over triangles, given as an (n, 3, 3) array of vertices
+    # Nodes whose object split children overlap may instead be split by a plane that clips the triangles straddling it,
+    # the triangle is then referenced on both sides. budget is the allowed fraction of extra references (0.3 = 30%).
+    # The leaf ranges index the reference array primOrder, which may hold a primitive more than once.
+    # See "Spatial Splits in Bounding Volume Hierarchies", Stich, Friedrich and Dietrich, HPG 2009.
+    def buildSBVH(self, triangles, budget = SBVH_SPLIT_BUDGET, maxLeafSize = MAX_LEAF_SIZE):
+        self.triangles = np.asarray(triangles, dtype=np.float32).reshape(-1, 3, 3)
+        count = len(self.triangles)
+        assert count > 0, "Can't build a BVH without primitives."
+
+        # References, a primitive and its clipped bounds
+        self.refPrim = list(range(count))
+        self.lo = self.triangles.min(axis=1)
+        self.hi = self.triangles.max(axis=1)
+        self.centroids = (self.lo + self.hi) * 0.5
+        self.maxLeafSize = maxLeafSize
+        self.packWidth = 1
+        self.refLimit = int(count * (1.0 + budget))
+
+        # A binary tree over the references has at most 2 * refLimit - 1 nodes
+        self.nodeBounds = np.empty((2 * self.refLimit, 6), np.float32)
+        nodeLeft, nodeRight, nodeStart, nodeCount = [], [], [], []
+        order = []
+
+        stack = [(np.arange(count), -1, False)]
+        while stack:
+            refs, parent, isRight = stack.pop()
+            node = len(nodeLeft)
+            nodeLeft.append(-1)
+            nodeRight.append(-1)
+            nodeStart.append(0)
+            nodeCount.append(0)
+            if parent >= 0:
+                if isRight:
+                    nodeRight[parent] = node
+                else:
+                    nodeLeft[parent] = node
+
+            split, splitCost, overlapArea = self.objectSplit(node, refs)
+            rootArea = max(boxArea(self.nodeBounds[0]), 1e-30)
+
+            left = right = None
+            if split is not None:
+                left, right = refs[split], refs[~split]
+
+            # Try a spatial split when the children of the object split overlap
+            if len(refs) > 1 and overlapArea / rootArea > SBVH_OVERLAP_THRESHOLD and len(self.refPrim) < self.refLimit:
+                spatial = self.spatialSplit(self.nodeBounds[node], refs)
+                objectCost = splitCost if split is not None else SAH_INTERSECTION_COST * len(refs)
+                if spatial is not None and spatial[0] < objectCost:
+                    spatialLeft, spatialRight = self.applySpatialSplit(refs, spatial[1], spatial[2])
+                    if len(spatialLeft) > 0 and len(spatialRight) > 0:
+                        left, right = spatialLeft, spatialRight
+
+            if left is None:
+                nodeStart[node] = len(order)
+                nodeCount[node] = len(refs)
+                order.extend(refs.tolist())
+                continue
+
+            stack.append((right, node, True))
+            stack.append((left, node, False))
+
+        self.nodeBounds = self.nodeBounds[:len(nodeLeft)]
+        self.nodeLeft = np.array(nodeLeft, dtype=np.int32)
+        self.nodeRight = np.array(nodeRight, dtype=np.int32)
+        self.nodeStart = np.array(nodeStart, dtype=np.int32)
+        self.nodeCount = np.array(nodeCount, dtype=np.int32)
+        self.primOrder = np.array(self.refPrim, dtype=np.int32)[order]
+        del self.lo, self.hi, self.centroids, self.triangles, self.refPrim
+
+        print("SBVH built : ", len(self.nodeLeft), " nodes, ", len(self.primOrder), " references for ", count, " primitives, SAH cost : ", self.computeSAHCost())
+
+    # Best binned spatial split of a node
+    # Return the split cost, the axis and the split plane, or None if no plane splits the node
+    def spatialSplit(self, nodeBox, refs):
+        parentArea = max(boxArea(nodeBox), 1e-30)
+        best = None
+
+        for axis in range(3):
+            origin = float(nodeBox[2 * axis])
+            width = (float(nodeBox[2 * axis + 1]) - origin) / SAH_BINS
+            if width <= 0.0:
+                continue
+
+            # Bins spanned by each reference
+            firstBin = np.clip(((self.lo[refs, axis] - origin) / width).astype(np.int64), 0, SAH_BINS - 1)
+            lastBin = np.clip(((self.hi[refs, axis] - origin) / width).astype(np.int64), firstBin, SAH_BINS - 1)
+            entries = np.bincount(firstBin, minlength=SAH_BINS)
+            exits = np.bincount(lastBin, minlength=SAH_BINS)
+
+            # Clip each reference to each of its bins
+            spans = lastBin - firstBin + 1
+            pairRef = np.repeat(refs, spans)
+            pairBin = np.repeat(firstBin, spans) + (np.arange(spans.sum()) - np.repeat(np.cumsum(spans) - spans, spans))
+            clipLo, clipHi = self.clipReferences(pairRef, axis, origin + pairBin * width, origin + (pairBin + 1) * width)
+            valid = (clipLo <= clipHi).all(axis=1)
+
+            binLo = np.full((SAH_BINS, 3), np.inf)
+            binHi = np.full((SAH_BINS, 3), -np.inf)
+            np.minimum.at(binLo, pairBin[valid], clipLo[valid])
+            np.maximum.at(binHi, pairBin[valid], clipHi[valid])
+
+            # Sweep, plane i is between bins i and i + 1
+            leftCount = np.cumsum(entries)[:-1]
+            rightCount = len(refs) - np.cumsum(exits)[:-1]
+            leftBox = np.empty((SAH_BINS - 1, 6))
+            rightBox = np.empty((SAH_BINS - 1, 6))
+            leftBox[:, 0::2] = np.minimum.accumulate(binLo, axis=0)[:-1]
+            leftBox[:, 1::2] = np.maximum.accumulate(binHi, axis=0)[:-1]
+            rightBox[:, 0::2] = np.minimum.accumulate(binLo[::-1], axis=0)[::-1][1:]
+            rightBox[:, 1::2] = np.maximum.accumulate(binHi[::-1], axis=0)[::-1][1:]
+
+            with np.errstate(invalid='ignore'):
+                cost = SAH_TRAVERSAL_COST + SAH_INTERSECTION_COST * (boxArea(leftBox) * leftCount + boxArea(rightBox) * rightCount) / parentArea
+            cost[(leftCount == 0) | (rightCount == 0) | ~np.isfinite(cost)] = np.inf
+
+            # Duplicated references must fit in the budget
+            straddling = leftCount + rightCount - len(refs)
+            cost[len(self.refPrim) + straddling > self.refLimit] = np.inf
+
+            i = int(np.argmin(cost))
+            if np.isfinite(cost[i]) and (best is None or cost[i] < best[0]):
+                best = (cost[i], axis, origin + (i + 1) * width)
+
+        return best
+
+    # Split the references of a node by a plane, the straddling ones are clipped and duplicated
+    def applySpatialSplit(self, refs, axis, plane):
+        lo = self.lo[refs, axis]
+        hi = self.hi[refs, axis]
+        isLeft = hi <= plane
+        isRight = (lo >= plane) & ~isLeft
+        straddling = refs[~isLeft & ~isRight]
+
+        # A straddling box may not hold any part of its triangle on one side, it then only goes to the other one
+        leftLo, leftHi = self.clipReferences(straddling, axis, np.full(len(straddling), -np.inf), np.full(len(straddling), plane))
+        rightLo, rightHi = self.clipReferences(straddling, axis, np.full(len(straddling), plane), np.full(len(straddling), np.inf))
+        onLeft = (leftLo <= leftHi).all(axis=1)
+        onRight = (rightLo <= rightHi).all(axis=1)
+        both = onLeft & onRight
+        toRight = onRight & ~onLeft
+
+        # The references keep their index on the left, the right copies are new references
+        self.lo[straddling[onLeft]] = leftLo[onLeft]
+        self.hi[straddling[onLeft]] = leftHi[onLeft]
+        self.lo[straddling[toRight]] = rightLo[toRight]
+        self.hi[straddling[toRight]] = rightHi[toRight]
+        copies = np.arange(len(self.refPrim), len(self.refPrim) + np.count_nonzero(both))
+        self.refPrim.extend([self.refPrim[r] for r in straddling[both]])
+        self.lo = np.concatenate([self.lo, rightLo[both]])
+        self.hi = np.concatenate([self.hi, rightHi[both]])
+        self.centroids = (self.lo + self.hi) * 0.5
+
+        left = np.concatenate([refs[isLeft], straddling[~toRight]])
+        right = np.concatenate([refs[isRight], straddling[toRight], copies])
+        return left, right
+
+    # Bounds of the triangles of the references clipped to the slab [a, b] of an axis, intersected with the reference bounds
+    # Computed in double precision and rounded outwards, an empty result has lo > hi
+    def clipReferences(self, refs, axis, a, b):
+        vertices = self.triangles[np.asarray([self.refPrim[r] for r in refs], dtype=np.int64)].astype(np.float64)
+        a = np.asarray(a, np.float64)[:, None]
+        b = np.asarray(b, np.float64)[:, None]
+
+        # Vertices inside the slab and intersections of the edges with both planes
+        points = [vertices]
+        inside = [(vertices[:, :, axis] >= a) & (vertices[:, :, axis] <= b)]
+        p = vertices
+        q = vertices[:, [1, 2, 0]]
+        for plane in (a, b):
+            with np.errstate(divide='ignore', invalid='ignore'):
+                t = (plane - p[:, :, axis]) / (q[:, :, axis] - p[:, :, axis])
+            crosses = (t >= 0.0) & (t <= 1.0)
+            cut = p + np.where(crosses, t, 0.0)[:, :, None] * (q - p)
+            cut[:, :, axis] = np.broadcast_to(plane, cut[:, :, axis].shape)
+            points.append(cut)
+            inside.append(crosses)
+        points = np.concatenate(points, axis=1)
+        inside = np.concatenate(inside, axis=1)[:, :, None]
+
+        lo = np.where(inside, points, np.inf).min(axis=1)
+        hi = np.where(inside, points, -np.inf).max(axis=1)
+        lo32 = lo.astype(np.float32)
+        hi32 = hi.astype(np.float32)
+        lo32 = np.where(lo32 > lo, np.nextafter(lo32, np.float32(-np.inf)), lo32)
+        hi32 = np.where(hi32 < hi, np.nextafter(hi32, np.float32(np.inf)), hi32)
+
+        return np.maximum(lo32, self.lo[refs]), np.minimum(hi32, self.hi[refs])
+
+    # Set the BVH tree from an external AABBTree (one primitive per leaf, the leaf value is the primitive index)
     def setBVH(self, aTree):
         #Type check
         assert type(aTree) == aabbtree.AABBTree, "External BVH tree must be made with AABBTree library."
-        self.tree = aTree
-
-    # Serialize the BVH
-    def serializeBVH(self):
-        bvhInBytes, tampon, tampon2 = self.serializeBVHRec(self.tree)
-        return bvhInBytes
-
-    # Serialize a node
-    # If node is a leaf, value1 refers to the prim index, and value2 refers to pcount.
-    # If node isn't a leaf, value1 refers to left child index, and value2 to right child index.
-    def serializeNode(self, isLeaf, value1, value2, n0xy, nz, n1xy):
-        buffer = np.array(1, dtype=self.leaf if isLeaf else self.branch)
-
-        if isLeaf:
-            buffer["idx"].fill(value1)
-            buffer["pcount"].fill(value2)
-        else:
-            buffer["c0idx"].fill(value1)
-            buffer["c1idx"].fill(value2)
-
-        buffer["n0xy"] = n0xy
-        buffer["nz"] = nz
-        buffer["n1xy"] = n1xy
 
-        print("Value 1 : ", value1)
-        print("Value 2 : ", value2)
-
-        return buffer.tobytes()
-
-    # Recursive call to serialize the tree 
-    def serializeBVHRec(self, node):
-        bufferInBytes = None
-        pcount = 0
-
-        if node.is_leaf:
-            bufferInBytes = self.serializeNode(True, node.value, 1, [-1.0, -1.0, -1.0, -1.0], [-1.0, -1.0, -1.0, -1.0], [-1.0, -1.0, -1.0, -1.0])
-            pcount = 1
-        else:
-            tamponGauche, c0idx, pcountLeft = self.serializeBVHRec(node.left)
-            tamponDroit, c1idx, pcountRight = self.serializeBVHRec(node.right)
-            
-            pcount = pcountLeft + pcountRight
-
-            if node.left.is_leaf:
-                c0idx = -c0idx - 1
-
-            if node.right.is_leaf:
-                c1idx = -c1idx - 1
-
-            bufferInBytes = self.serializeNode(False, c0idx, c1idx, [node.left.aabb.limits[0][0], node.left.aabb.limits[0][1], node.left.aabb.limits[1][0], node.left.aabb.limits[1][1]], [node.left.aabb.limits[2][0], node.left.aabb.limits[2][1], node.right.aabb.limits[2][0], node.right.aabb.limits[2][1]], [node.right.aabb.limits[0][0], node.right.aabb.limits[0][1], node.right.aabb.limits[1][0], node.right.aabb.limits[1][1]])
-
-            bufferInBytes = bufferInBytes + tamponGauche + tamponDroit
-
-        self.serializedNodes+= 1
-
-        return bufferInBytes, self.serializedNodes, pcount
+        nodeBounds, nodeLeft, nodeRight, nodeStart, nodeCount = [], [], [], [], []
+
+        stack = [(aTree, -1, False)]
+        while stack:
+            node, parent, isRight = stack.pop()
+            index = len(nodeBounds)
+            limits = node.aabb.limits
+            nodeBounds.append([limits[0][0], limits[0][1], limits[1][0], limits[1][1], limits[2][0], limits[2][1]])
+            nodeLeft.append(-1)
+            nodeRight.append(-1)
+            nodeStart.append(node.value if node.is_leaf else 0)
+            nodeCount.append(1 if node.is_leaf else 0)
+
+            if parent >= 0:
+                if isRight:
+                    nodeRight[parent] = index
+                else:
+                    nodeLeft[parent] = index
+
+            if not node.is_leaf:
+                stack.append((node.right, index, True))
+                stack.append((node.left, index, False))
+
+        self.nodeBounds = np.array(nodeBounds, dtype=np.float32).reshape(-1, 6)
+        self.nodeLeft = np.array(nodeLeft, dtype=np.int32)
+        self.nodeRight = np.array(nodeRight, dtype=np.int32)
+        self.nodeStart = np.array(nodeStart, dtype=np.int32)
+        self.nodeCount = np.array(nodeCount, dtype=np.int32)
+        self.primOrder = np.arange(len(self.nodeStart), dtype=np.int32)
+
+    # SAH cost of the tree, relative to the root surface area
+    def computeSAHCost(self):
+        areas = boxArea(self.nodeBounds.astype(np.float64))
+        isLeaf = self.nodeLeft < 0
+        cost = SAH_TRAVERSAL_COST * areas[~isLeaf].sum() + SAH_INTERSECTION_COST * (areas[isLeaf] * self.nodeCount[isLeaf]).sum()
+        return cost / max(areas[0], 1e-30)
+
+    # Root address to give to the kernel (a tree made of a single leaf is encoded as a leaf address)
+    # nodeBase is the address of the first node when the tree is serialized after other trees
+    def getRoot(self, nodeBase = 0):
+        return nodeBase if self.nodeLeft[0] >= 0 else -nodeBase - 1
+
+    # Parent of each serialized node, -1 for the root (used by the device refit)
+    def getParents(self):
+        parents = np.full(len(self.nodeLeft), -1, np.int32)
+        branches = np.nonzero(self.nodeLeft >= 0)[0]
+        parents[self.nodeLeft[branches]] = branches
+        parents[self.nodeRight[branches]] = branches
+        return parents
+
+    # Number of levels of the tree, a single leaf has depth 1
+    def getDepth(self):
+        depth = 1
+        level = np.array([0])
+        while True:
+            level = level[self.nodeLeft[level] >= 0]
+            if len(level) == 0:
+                return depth
+            level = np.concatenate([self.nodeLeft[level], self.nodeRight[level]])
+            depth += 1
+
+    # Index of each leaf node in the serialized BVH
+    def getLeaves(self):
+        return np.nonzero(self.nodeLeft < 0)[0].astype(np.int32)
+
+    # Reorder the primitive buffer so that each leaf covers a contiguous [idx, idx + pcount) range
+    # prims is the primitive byte chain and offsets the byte offset of each primitive in it
+    # With spatial splits, a primitive referenced by several leaves is stored once, at its first reference
+    def reorderPrimitives(self, prims, offsets):
+        return reorderPrimitives(self.primOrder, prims, offsets)
+
+    # Start each leaf on a pack of width triangles, before the primitives are reordered and the tree serialized
+    def alignLeaves(self, width):
+        self.primOrder, self.nodeStart = alignLeaves(self.primOrder, self.nodeStart, self.nodeCount, width)
+
+    # Address of each node in the serialized buffer and size of the buffer
+    # By default the node index of the tree is its address. With implicitLeft, the nodes are laid out depth first
+    # so that the left child of a branch follows it. With blockNodes, a right subtree that fits in a block of that
+    # many nodes is moved to the next block instead of straddling two (the gap is left empty)
+    def nodeLayout(self, implicitLeft = False, blockNodes = 0):
+        count = len(self.nodeLeft)
+        if not implicitLeft:
+            return np.arange(count), count
+
+        # Children always have a greater index than their parent
+        subtreeSize = np.ones(count, np.int64)
+        for node in np.nonzero(self.nodeLeft >= 0)[0][::-1]:
+            subtreeSize[node] += subtreeSize[self.nodeLeft[node]] + subtreeSize[self.nodeRight[node]]
+
+        address = np.empty(count, np.int64)
+        position = 0
+        stack = [(0, False)]
+        while stack:
+            node, followsParent = stack.pop()
+            size = subtreeSize[node]
+            if blockNodes and not followsParent and size <= blockNodes and position // blockNodes != (position + size - 1) // blockNodes:
+                position = (position // blockNodes + 1) * blockNodes
+            address[node] = position
+            position += 1
+            if self.nodeLeft[node] >= 0:
+                stack.append((self.nodeRight[node], False))
+                stack.append((self.nodeLeft[node], True))
+
+        return address, position
+
+    # Child addresses of the branches, a leaf child address is encoded as -address-1
+    # With implicitLeft, the left address is replaced by the node flags :
+    # bit 0 is set when the left child is a leaf, bits 1-2 hold the split axis (axis of the largest distance between the child centers)
+    def childAddresses(self, branches, address, implicitLeft):
+        left = self.nodeLeft[branches]
+        right = self.nodeRight[branches]
+        leftLeaf = self.nodeLeft[left] < 0
+        leftAddress = np.where(leftLeaf, -address[left] - 1, address[left])
+        rightAddress = np.where(self.nodeLeft[right] < 0, -address[right] - 1, address[right])
+
+        if not implicitLeft:
+            return leftAddress, rightAddress
+
+        centers = self.nodeBounds[:, 0::2] + self.nodeBounds[:, 1::2]
+        axis = np.argmax(np.abs(centers[right] - centers[left]), axis=1)
+        return rightAddress, leftLeaf.astype(np.int32) | (axis.astype(np.int32) << 1)
+
+    # Serialize the BVH in the BVHNode layout, see nodeLayout for the node addresses
+    # A leaf child address is encoded as -index-1. With implicitLeft, cnodes holds the right child and the flags of childAddresses
+    # nodeBase and primBase are added to the node addresses and leaf ranges, for a tree stored after other trees
+    # cnodes.z holds the parent address of every node (-1 for the root), used by the short stack traversal
+    def serializeBVH(self, implicitLeft = False, blockNodes = 0, nodeBase = 0, primBase = 0):
+        address, size = self.nodeLayout(implicitLeft, blockNodes)
+        nodes = np.zeros(size, dtype=self.node)
+
+        branches = np.nonzero(self.nodeLeft >= 0)[0]
+        leaves = np.nonzero(self.nodeLeft < 0)[0]
+        leftBounds = self.nodeBounds[self.nodeLeft[branches]]
+        rightBounds = self.nodeBounds[self.nodeRight[branches]]
+        at = address[branches]
+
+        nodes["n0xy"][at] = leftBounds[:, 0:4]
+        nodes["nz"][at] = np.concatenate([leftBounds[:, 4:6], rightBounds[:, 4:6]], axis=1)
+        nodes["n1xy"][at] = rightBounds[:, 0:4]
+        nodes["cnodes"][at, 0], nodes["cnodes"][at, 1] = self.childAddresses(branches, address + nodeBase, implicitLeft)
+
+        # Leaves keep their own bounds in the left box slot
+        at = address[leaves]
+        nodes["n0xy"][at] = self.nodeBounds[leaves, 0:4]
+        nodes["nz"][at, 0:2] = self.nodeBounds[leaves, 4:6]
+        nodes["cnodes"][at, 0] = self.nodeStart[leaves] + primBase
+        nodes["cnodes"][at, 1] = self.nodeCount[leaves]
+
+        parents = self.getParents()
+        nodes["cnodes"][address, 2] = np.where(parents >= 0, address[parents] + nodeBase, -1)
+
+        return nodes.tobytes()
+
+    # Same layout as WideBVHNode in kernel/trace/bvh/widebvh.h, one vector of width floats or ints per field
+    def wideNode(self, width):
+        return [("x0", np.float32, width), ("x1", np.float32, width),
+                ("y0", np.float32, width), ("y1", np.float32, width),
+                ("z0", np.float32, width), ("z1", np.float32, width),
+                ("child", np.int32, width), ("count", np.int32, width)]
+
+    # Collapse the binary tree into a 4-wide or 8-wide BVH and serialize it, the root is node 0
+    # Each wide node opens its largest branch child until it has width children
+    def serializeWideBVH(self, width):
+        assert width in (4, 8), "Error : the wide BVH is either 4 or 8 wide."
+
+        areas = boxArea(self.nodeBounds.astype(np.float64))
+        isLeaf = self.nodeLeft < 0
+
+        # Binary nodes of the children of each wide node, in breadth first order
+        wideChildren = []
+        pending = collections.deque([0])
+        wideIndex = {0: 0}
+        while pending:
+            node = pending.popleft()
+            children = [node] if isLeaf[node] else [self.nodeLeft[node], self.nodeRight[node]]
+            while len(children) < width:
+                branches = [c for c in children if not isLeaf[c]]
+                if not branches:
+                    break
+                largest = max(branches, key=lambda c: areas[c])
+                children.remove(largest)
+                children += [self.nodeLeft[largest], self.nodeRight[largest]]
+
+            for c in children:
+                if not isLeaf[c]:
+                    wideIndex[c] = len(wideIndex)
+                    pending.append(c)
+            wideChildren.append(children)
+
+        nodes = np.zeros(len(wideChildren), dtype=self.wideNode(width))
+        nodes["count"] = -1
+        for w, children in enumerate(wideChildren):
+            for slot, c in enumerate(children):
+                for axis, name in enumerate(["x0", "x1", "y0", "y1", "z0", "z1"]):
+                    nodes[name][w, slot] = self.nodeBounds[c, axis]
+                if isLeaf[c]:
+                    nodes["child"][w, slot] = self.nodeStart[c]
+                    nodes["count"][w, slot] = self.nodeCount[c]
+                else:
+                    nodes["child"][w, slot] = wideIndex[c]
+                    nodes["count"][w, slot] = 0
+
+        return nodes.tobytes()
+
+    # Same layout as QBVHNode in kernel/trace/bvh/qbvh.h (36 bytes with 8 bits, 48 bytes with 16 bits)
+    def quantizedNode(self, bits):
+        return [("origin", np.float32, 3), ("exponent", np.int8, 3), ("pad", np.int8),
+                ("q", np.uint8 if bits == 8 else np.uint16, 12), ("cnodes", np.int32, 2)]
+
+    # Serialize the BVH with quantized child boxes, same node addresses and child addresses as serializeBVH
+    # Each branch stores its child boxes as integers in its own frame : origin + q * 2^e on each axis
+    # Planes are decoded in float32 like the kernel does, and rounded outwards so that the boxes stay conservative
+    def serializeQuantizedBVH(self, bits, implicitLeft = False, blockNodes = 0, nodeBase = 0, primBase = 0):
+        assert bits in (8, 16), "Error : quantized BVH nodes use either 8 or 16 bits."
+        qmax = (1 << bits) - 1
+
+        address, size = self.nodeLayout(implicitLeft, blockNodes)
+        nodes = np.zeros(size, dtype=self.quantizedNode(bits))
+        branches = np.nonzero(self.nodeLeft >= 0)[0]
+        leaves = np.nonzero(self.nodeLeft < 0)[0]
+
+        # Frame of each branch, the scale is the smallest power of two that spans the node in qmax - 1 steps
+        origin = self.nodeBounds[branches][:, 0::2]
+        extent = self.nodeBounds[branches][:, 1::2].astype(np.float64) - origin
+        exponent = np.ceil(np.log2(np.maximum(extent / (qmax - 1), 2.0 ** -126)))
+        exponent = np.clip(exponent, -126, 127).astype(np.int32)
+        scale = np.ldexp(np.float32(1), exponent).astype(np.float32)
+
+        # Child planes, [x0, x1, y0, y1, z0, z1] of the left then the right child
+        planes = np.concatenate([self.nodeBounds[self.nodeLeft[branches]], self.nodeBounds[self.nodeRight[branches]]], axis=1)
+        axis = np.tile(np.arange(6) // 2, 2)
+        lower = np.tile(np.arange(6) % 2 == 0, 2)
+        o = origin[:, axis]
+        s = scale[:, axis]
+
+        q = np.where(lower, np.floor((planes - o) / s), np.ceil((planes - o) / s))
+        q = np.clip(q, 0, qmax).astype(np.float32)
+
+        # Fix the float32 rounding of the decoding, a lower plane must not move up and an upper plane must not move down
+        for i in range(4):
+            decoded = o + q * s
+            q = np.where(lower & (decoded > planes), np.maximum(q - 1, 0), q)
+            q = np.where(~lower & (decoded < planes), np.minimum(q + 1, qmax), q)
+
+        at = address[branches]
+        nodes["origin"][at] = origin
+        nodes["exponent"][at] = exponent
+        nodes["q"][at] = q
+        nodes["cnodes"][at, 0], nodes["cnodes"][at, 1] = self.childAddresses(branches, address + nodeBase, implicitLeft)
+        nodes["cnodes"][address[leaves], 0] = self.nodeStart[leaves] + primBase
+        nodes["cnodes"][address[leaves], 1] = self.nodeCount[leaves]
+
+        return nodes.tobytes()
+
+    # Closest hit distance of a ray through a tree serialized by serializeBVH (default layout), walked on the host as the kernel does
+    # intersectLeaf(start, count, origin, direction) returns the closest hit distance of a leaf range, inf when there is none
+    def traceHost(self, bvh, root, origin, direction, intersectLeaf):
+        nodes = np.frombuffer(bvh, dtype=self.node)
+        closest = np.inf
+        stack = [int(root)]
+        while stack:
+            address = stack.pop()
+            if address < 0:
+                start, count = nodes["cnodes"][-address - 1, 0:2]
+                closest = min(closest, intersectLeaf(int(start), int(count), origin, direction))
+                continue
+
+            node = nodes[address]
+            boxes = np.array([np.concatenate([node["n0xy"], node["nz"][0:2]]), np.concatenate([node["n1xy"], node["nz"][2:4]])], np.float64)
+            near, far = rayBoxes(boxes, origin, direction)
+            for child in range(2):
+                if near[child] <= far[child] and near[child] < closest:
+                    stack.append(int(node["cnodes"][child]))
+        return closest
 
     # Testing method
     def test(self):
@@ -121,10 +842,21 @@ class BVHBuilder():
         scene.add(tetra)
         scene.add(triBoule)
 
-        self.buildBVHfromScene(scene)
-        print(builder.tree)
+        seri = serializer.Serializer()
+        prims, offsets = seri.serializeTriangleScene(scene)
+        bounds = seri.getPrimBounds(prims, offsets)
+
+        self.buildBVH(bounds)
+        prims, offsets = self.reorderPrimitives(prims, offsets)
+
+        # Each primitive is referenced by exactly one leaf, and leaves contain their primitives
+        leaves = np.nonzero(self.nodeLeft < 0)[0]
+        assert np.array_equal(np.sort(self.primOrder), np.arange(len(bounds))), "Leaves don't cover every primitive once."
+        for leaf in leaves:
+            leafPrims = bounds[self.primOrder[self.nodeStart[leaf]:self.nodeStart[leaf] + self.nodeCount[leaf]]]
+            assert np.all(leafPrims[:, 0::2] >= self.nodeBounds[leaf, 0::2]) and np.all(leafPrims[:, 1::2] <= self.nodeBounds[leaf, 1::2]), "Leaf bounds don't contain its primitives."
 
-        bytechain = builder.serializeBVH()
+        bytechain = self.serializeBVH()
 
         # GPUFlux specific options
         options = " -D MEASURE_FULL_SPECTRUM"
@@ -161,26 +893,17 @@ class BVHBuilder():
         context = cl.create_some_context()
         queue = cl.CommandQueue(context)
 
-        taille = len(bytechain) / 56
-        taille = int(taille)
+        taille = len(bytechain) // np.dtype(self.node).itemsize
 
         kernelSource =  """
                         #include "trace/bvh/bvh.h"
 
-                        __kernel void structTest(__global char* buffer, __global int* value1, __global int* value2) {
+                        __kernel void structTest(__global BVHNode* nodes, __global int* value1, __global int* value2) {
                             int i = get_global_id(0);
-                            int offset = i * 56;
-                            const __global BVHNode* node = (const __global BVHNode*)(buffer + offset);
-                            if(node->nz.s0 == -1.0) {
-                                value1[i] = node->idx;
-                                value2[i] = node->pcount;
-                            } else {
-                                value1[i] = node->c0idx;
-                                value2[i] = node->c1idx;
-                            }
-
-                            printf("Value 1 for Node %d : %d ", i, value1[i]);
-                            printf("Value 2 for Node %d : %d ", i, value2[i]);
+                            if(i == 0)
+                                printf("sizeof(BVHNode) : %d ", (int)sizeof(BVHNode));
+                            value1[i] = nodes[i].cnodes.x;
+                            value2[i] = nodes[i].cnodes.y;
                         }
                         """
 
@@ -188,8 +911,8 @@ class BVHBuilder():
         bufTree = cl.Buffer(context, cl.mem_flags.READ_ONLY | cl.mem_flags.COPY_HOST_PTR, hostbuf=bytechain)
 
         #Output buffers
-        bufValue1 = cl.Buffer(context, cl.mem_flags.WRITE_ONLY, taille)
-        bufValue2 = cl.Buffer(context, cl.mem_flags.WRITE_ONLY, taille)
+        bufValue1 = cl.Buffer(context, cl.mem_flags.WRITE_ONLY, taille * 4)
+        bufValue2 = cl.Buffer(context, cl.mem_flags.WRITE_ONLY, taille * 4)
 
         program = cl.Program(context, kernelSource).build(options)
 
@@ -204,6 +927,6 @@ class BVHBuilder():
         print(value1)
         print(value2)
 
-if __name__ == __main__:
+if __name__ == '__main__':
     builder = BVHBuilder()
-    builder.test()
\ No newline at end of file
+    builder.test()
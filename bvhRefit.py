@@ -0,0 +1,82 @@
+import sys
+import pyopencl as cl
+import pyopencl.tools
+import pyopencl.array
+import numpy as np
+import bvhBuilder
+
+REFIT_GROUP_SIZE = 64 # Work-group size of the refit kernels (power of two)
+REBUILD_THRESHOLD = 1.5 # A full rebuild is advised once the SAH cost grows past this factor of the cost at build time
+
+# Round a work size up to a multiple of the work-group size
+def globalSize(n):
+    return max(1, (n + REFIT_GROUP_SIZE - 1) // REFIT_GROUP_SIZE) * REFIT_GROUP_SIZE
+
+# Refit of a primitive BVH already on the device
+# The topology is kept, the primitive and node bounds are recomputed from the updated vertices
+class BVHRefitter():
+    def __init__(self, context, options, threshold = REBUILD_THRESHOLD) -> None:
+        kernelFile = open("kernel/refit_kernel.cl", "r")
+        kernelSource = kernelFile.read()
+        kernelFile.close()
+
+        self.context = context
+        self.program = cl.Program(context, kernelSource).build(options)
+        self.threshold = threshold
+        self.bufBVH = None
+
+    # Register the tree to refit
+    # parents is the parent of each node (-1 for the root) and leaves the index of each leaf node, as buffers or numpy arrays
+    def setTree(self, queue, nnodes, root, bufBVH, parents, leaves, nleaves):
+        mf = cl.mem_flags
+        if isinstance(parents, np.ndarray):
+            parents = cl.Buffer(self.context, mf.READ_ONLY | mf.COPY_HOST_PTR, hostbuf=parents.astype(np.int32))
+        if isinstance(leaves, np.ndarray):
+            leaves = cl.Buffer(self.context, mf.READ_ONLY | mf.COPY_HOST_PTR, hostbuf=leaves.astype(np.int32))
+
+        self.nnodes = nnodes
+        self.nleaves = nleaves
+        self.root = root
+        self.bufBVH = bufBVH
+        self.bufParents = parents
+        self.bufLeaves = leaves
+        self.bufFlags = cl.Buffer(self.context, mf.READ_WRITE, nnodes * 4)
+        self.bufPartial = cl.Buffer(self.context, mf.READ_WRITE, globalSize(nnodes) // REFIT_GROUP_SIZE * 4)
+        self.bufRootArea = cl.Buffer(self.context, mf.READ_WRITE, 4)
+
+        # Reference quality of the tree
+        self.buildCost = self.computeSAHCost(queue)
+
+    # Update the primitive bounds from the vertices, then the node bounds bottom-up
+    # Return the new SAH cost
+    def refit(self, queue, nprims, bufPrims, bufOffsets):
+        assert self.bufBVH is not None, "Error : no BVH to refit."
+
+        n = np.int32(nprims)
+        local = (REFIT_GROUP_SIZE,)
+        cl.enqueue_fill_buffer(queue, self.bufFlags, np.int32(0), 0, self.nnodes * 4)
+
+        self.program.updatePrimBounds(queue, (globalSize(nprims),), local, None, n, bufPrims, bufOffsets)
+        self.program.refitBVH(queue, (globalSize(self.nleaves),), local, None, np.int32(self.nleaves), self.bufLeaves, bufPrims, bufOffsets, self.bufBVH, self.bufParents, self.bufFlags)
+
+        return self.computeSAHCost(queue)
+
+    # SAH cost of the tree on the device, relative to the root area
+    def computeSAHCost(self, queue):
+        groups = globalSize(self.nnodes) // REFIT_GROUP_SIZE
+        self.program.computeSAHCost(queue, (globalSize(self.nnodes),), (REFIT_GROUP_SIZE,), None,
+                                    np.int32(self.nnodes), np.int32(self.root),
+                                    np.float32(bvhBuilder.SAH_TRAVERSAL_COST), np.float32(bvhBuilder.SAH_INTERSECTION_COST),
+                                    self.bufBVH, self.bufParents, self.bufPartial, self.bufRootArea,
+                                    cl.LocalMemory(REFIT_GROUP_SIZE * 4))
+
+        partial = np.empty(groups, np.float32)
+        rootArea = np.empty(1, np.float32)
+        cl.enqueue_copy(queue, partial, self.bufPartial)
+        cl.enqueue_copy(queue, rootArea, self.bufRootArea)
+
+        return float(partial.astype(np.float64).sum() / max(float(rootArea[0]), 1e-30))
+
+    # True when the refitted tree has degraded enough to be rebuilt
+    def needsRebuild(self, cost):
+        return cost > self.threshold * self.buildCost
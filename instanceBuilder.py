@@ -0,0 +1,173 @@
+import sys
+import numpy as np
+from openalea.plantgl.all import *
+import serializer
+import bvhBuilder
+
+# Corners of the unit box, to transform the mesh bounds
+BOX_CORNERS = np.array([[x, y, z] for x in (0, 1) for y in (0, 1) for z in (0, 1)], np.float64)
+
+# Two-level BVH of a scene made of copies of a few meshes (-D BVH_INSTANCES)
+# Each distinct mesh is serialized once with its own bottom-level BVH (BLAS). Every shape becomes an instance holding
+# its world to object matrix and the root of the BLAS of its mesh, and a top-level BVH (TLAS) is built over the instances.
+# The kernel buffers are laid out as :
+#   prims   : the instances in TLAS order, then the triangles of each mesh
+#   offsets : one per instance, then one per mesh triangle
+#   bvh     : the TLAS nodes, then the nodes of each BLAS, whose node and primitive addresses are rebased
+class InstanceBuilder():
+    def __init__(self, aSerializer) -> None:
+        self.serializer = aSerializer # Shared with the light model, it keeps the group areas of the detectors
+
+    # Serialize one BVH after the others, in the node layout given to build
+    def serializeTree(self, builder, nodeBase, primBase):
+        if self.quantization:
+            return builder.serializeQuantizedBVH(self.quantization, self.implicitLeft, self.blockNodes, nodeBase, primBase)
+        return builder.serializeBVH(self.implicitLeft, self.blockNodes, nodeBase, primBase)
+
+    # Build the two-level BVH of a PlantGL scene, the node layout options are those of FluxLightModel
+    # Return the primitives, their offsets, the BVH and its root address
+    def build(self, scene, quantization = 0, implicitLeft = False, blockNodes = 0, splitBudget = 0.0):
+        self.quantization = quantization
+        self.implicitLeft = implicitLeft
+        self.blockNodes = blockNodes
+        nodeSize = {0: 64, 8: 36, 16: 48}[quantization]
+
+        geometries, meshIndex, matrices = self.serializer.getSceneInstances(scene)
+        opaque = np.array([self.serializer.isOpaque(shape) for shape in scene], bool)
+
+        # Bottom-level BVHs, one per distinct mesh
+        # The triangles are shared by the instances, they are only flagged opaque when all the instances of the mesh are
+        meshes = []
+        for mesh, trSet in enumerate(geometries):
+            groupIndex = int(np.argmax(meshIndex == mesh))
+            prims, offsets, sah = self.serializer.serializeTriangleSet(trSet, groupIndex, 0, 0.0, bool(np.all(opaque[meshIndex == mesh])))
+            builder = bvhBuilder.BVHBuilder()
+            if splitBudget > 0.0:
+                builder.buildSBVH(self.serializer.getTriangleVertices(prims, offsets), splitBudget)
+            else:
+                builder.buildBVH(self.serializer.getPrimBounds(prims, offsets))
+            prims, offsets = builder.reorderPrimitives(prims, offsets)
+            meshes.append((builder, prims, offsets))
+
+        # World bounds of each instance, from the transformed corners of its mesh bounds, rounded outwards
+        meshBounds = np.array([builder.nodeBounds[0] for builder, prims, offsets in meshes], np.float64)[meshIndex]
+        lo = meshBounds[:, 0::2]
+        hi = meshBounds[:, 1::2]
+        corners = lo[:, None, :] + BOX_CORNERS[None, :, :] * (hi - lo)[:, None, :]
+        corners = np.einsum('nij,nkj->nki', matrices[:, :3, :3], corners) + matrices[:, None, :3, 3]
+        bounds = np.empty((len(meshIndex), 6), np.float32)
+        bounds[:, 0::2] = np.nextafter(corners.min(axis=1).astype(np.float32), np.float32(-np.inf))
+        bounds[:, 1::2] = np.nextafter(corners.max(axis=1).astype(np.float32), np.float32(np.inf))
+
+        # Top-level BVH, each instance gets its own leaf
+        tlas = bvhBuilder.BVHBuilder()
+        tlas.buildBVH(bounds, maxLeafSize = 1)
+        order = tlas.primOrder
+        tlasNodes = self.serializeTree(tlas, 0, 0)
+
+        # Append the BLAS nodes and mesh primitives after the top level, each BLAS starts on a block boundary
+        ninstances = len(meshIndex)
+        nodeChunks = [tlasNodes]
+        nodeBase = len(tlasNodes) // nodeSize
+        instanceBytes = ninstances * np.dtype(self.serializer.instance).itemsize
+        primChunks = []
+        offsetChunks = []
+        primBase = ninstances
+        byteBase = instanceBytes
+        roots = np.empty(len(meshes), np.int32)
+        for mesh, (builder, prims, offsets) in enumerate(meshes):
+            if blockNodes and nodeBase % blockNodes:
+                padding = blockNodes - nodeBase % blockNodes
+                nodeChunks.append(bytes(padding * nodeSize))
+                nodeBase += padding
+
+            nodes = self.serializeTree(builder, nodeBase, primBase)
+            roots[mesh] = builder.getRoot(nodeBase)
+            nodeChunks.append(nodes)
+            nodeBase += len(nodes) // nodeSize
+
+            primChunks.append(prims)
+            offsetChunks.append(offsets + byteBase)
+            primBase += len(offsets)
+            byteBase += len(prims)
+
+        # World to object matrix of each instance : inverse linear part, then the translation
+        worldToObject = np.concatenate([np.linalg.inv(matrices[:, :3, :3]).reshape(-1, 9), matrices[:, :3, 3]], axis=1)
+        instances, instanceOffsets = self.serializer.serializeInstances(order, bounds[order], worldToObject[order], roots[meshIndex[order]], opaque[order])
+
+        prims = b"".join([instances] + primChunks)
+        offsets = np.concatenate([instanceOffsets] + offsetChunks).astype(np.int32)
+        bvh = b"".join(nodeChunks)
+
+        flatTriangles = sum(len(meshes[mesh][2]) for mesh in meshIndex)
+        print("Instancing : ", ninstances, " shapes, ", len(meshes), " distinct meshes, ", primBase - ninstances, " triangles stored instead of ", flatTriangles)
+        return prims, offsets, bvh, tlas.getRoot()
+
+    # Testing method : the traversal of the instances finds the same hits as a brute force walk of the flattened scene
+    def test(self):
+        points = [(0.0, 0.0, 0.0),
+                  (0.0, 1.0, 0.0),
+                  (1.0, 0.0, 0.0),
+                  (1.0, 1.0, 1.0)]
+
+        indices = [(0, 1, 2),
+                   (0, 1, 3),
+                   (0, 2, 3),
+                   (1, 2, 3)]
+
+        tetra = TriangleSet(points, indices)
+        boule = Sphere(2)
+        tessel = Tesselator()
+        boule.apply(tessel)
+        triBoule = tessel.triangulation
+
+        # Rotated, scaled and moved copies of both meshes
+        rng = np.random.default_rng(1)
+        scene = Scene()
+        for i in range(20):
+            axis = rng.normal(size=3)
+            rotated = AxisRotated(Vector3(*(axis / np.linalg.norm(axis)).tolist()), float(rng.uniform(0.0, 2.0 * np.pi)), tetra if i % 2 else triBoule)
+            scaled = Scaled(Vector3(*rng.uniform(0.5, 2.0, 3).tolist()), rotated)
+            scene.add(Shape(Translated(Vector3(*rng.uniform(-10.0, 10.0, 3).tolist()), scaled)))
+
+        prims, offsets, bvh, root = self.build(scene)
+
+        # Flattened scene, each copy tessellated in world space
+        flat = Scene()
+        for shape in scene:
+            shape.geometry.apply(tessel)
+            flat.add(Shape(tessel.triangulation))
+        flatSeri = serializer.Serializer()
+        flatPrims, flatOffsets = flatSeri.serializeTriangleScene(flat)
+        flatVertices = flatSeri.getTriangleVertices(flatPrims, flatOffsets)
+
+        ninstances = len(scene)
+        instances = np.frombuffer(prims, dtype=self.serializer.instance, count=ninstances)
+        vertices = self.serializer.getTriangleVertices(prims, offsets[ninstances:])
+        tree = bvhBuilder.BVHBuilder()
+
+        # A top-level leaf moves the ray to the object space of its instance and walks the mesh BVH, as the kernel does
+        def intersectLeaf(start, count, origin, direction):
+            if start >= ninstances:
+                return bvhBuilder.rayTriangles(vertices[start - ninstances:start - ninstances + count], origin, direction)
+            matrix = instances["WtOMatrix"][start].astype(np.float64)
+            linear = matrix[:9].reshape(3, 3)
+            return tree.traceHost(bvh, instances["root"][start], linear @ (origin - matrix[9:]), linear @ direction, intersectLeaf)
+
+        # Rays aimed at the triangle centers, and rays in random directions
+        centers = flatVertices.mean(axis=1)
+        mismatches = 0
+        for i in range(200):
+            origin = rng.uniform(-15.0, 15.0, 3)
+            target = centers[rng.integers(len(centers))] if i % 2 else rng.uniform(-15.0, 15.0, 3)
+            expected = bvhBuilder.rayTriangles(flatVertices, origin, target - origin)
+            found = tree.traceHost(bvh, root, origin, target - origin, intersectLeaf)
+            if not np.isclose(found, expected, rtol=1e-4):
+                mismatches += 1
+
+        print("Instanced hits mismatching the flattened scene : ", mismatches, " / 200")
+        assert mismatches == 0, "Error : the instanced traversal misses hits of the flattened scene."
+
+if __name__ == '__main__':
+    builder = InstanceBuilder(serializer.Serializer())
+    builder.test()
@@ -0,0 +1,37 @@
+#include "util/debug.h"
+
+#include "geo/intersect.h"
+#include "trace/trace.h"
+
+/*
+	Ray casting benchmark of the primitive acceleration structure.
+	rays holds 6 floats per ray (origin, direction), the nearest hit distance and the byte offset
+	of the hit primitive (-1 for a miss) are written for each ray.
+*/
+__kernel void castRays( DEBUG_PAR ,
+	int nrays,
+	const __global float *rays,
+	int np,
+	const __global char *prims,
+	const __global int *offsets,
+	int root,
+	const __global char *bvh,
+	__global float *hitT,
+	__global int *hitPrim
+	)
+{
+	int idx = get_global_id(0);
+	if( idx >= nrays )
+		return;
+
+	Ray r;
+	r.o.x = rays[6*idx+0]; r.o.y = rays[6*idx+1]; r.o.z = rays[6*idx+2];
+	r.d.x = rays[6*idx+3]; r.d.y = rays[6*idx+4]; r.d.z = rays[6*idx+5];
+
+	Intc intc;
+	intc_init( &intc, FLT_MAX, 0 );
+	trace( DEBUG_ARG, &intc, &r, np, 0, prims, offsets, bvh, root, false );
+
+	hitT[idx] = intc.t;
+	hitPrim[idx] = intc.prim ? (int)((const __global char*)intc.prim - prims) : -1;
+}
@@ -55,14 +55,19 @@ bool connect( DEBUG_PAR,
 
 	for( int k = 0; k < depth; k++ )
 	{
-		// trace shadow ray
-		trace( DEBUG_ARG, &intc, &r, np, ninfp, prims, offsets, bvh, root, false );
+		// trace shadow ray, it stops at the first opaque primitive
+		trace( DEBUG_ARG, &intc, &r, np, ninfp, prims, offsets, bvh, root, true );
 		
 		// if connection is clear
 		if( intc.prim == 0 )
 		{
 			return true;
 		}
+		else if( prim_opaque( intc.prim ) )
+		{
+			// blocked, the shader transmits nothing
+			break;
+		}
 		else
 		{
 			
@@ -117,14 +122,19 @@ bool connectMax( DEBUG_PAR,
 
 	for( int k = 0; k < depth; k++ )
 	{
-		// trace shadow ray
-		trace( DEBUG_ARG, &intc, &r, np, ninfp, prims, offsets, bvh, root, false );
+		// trace shadow ray, it stops at the first opaque primitive
+		trace( DEBUG_ARG, &intc, &r, np, ninfp, prims, offsets, bvh, root, true );
 		
 		// if connection is clear
 		if( intc.prim == 0 )
 		{
 			return true;
 		}
+		else if( prim_opaque( intc.prim ) )
+		{
+			// blocked, the shader transmits nothing
+			break;
+		}
 		else
 		{
 			// compute intersection environment
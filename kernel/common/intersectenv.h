@@ -39,21 +39,32 @@ void computeIntersectEnv( DEBUG_PAR ,
 	// load intersection data
 	rmarch( &env->p , intc->t , r );
 		
-	// get primitive
+	// get primitive, and the instance holding it if any
 	const __global Prim *prim = intc->prim;
+	const __global Prim *owner = intc_owner( intc );
 	
 	// transform intersection point to object space
-	Mat34 m = prim->m;
+	Mat34 m = owner->m;
 	m34submul( &env->lp , &m , &env->p );
 	
 	// get normal and uv coordinates
+#ifdef BVH_INSTANCES
+	if( intc->instance != 0 )
+	{
+		// the mesh lives in the object space of the instance, bring its normal back to global space
+		computePrimitiveNormalUV( DEBUG_ARG, &env->norm, &env->uv, intc, &env->lp, prim );
+		m34vtransmul( &env->norm , &m , &env->norm );
+		v3norm( &env->norm , &env->norm );
+	}
+	else
+#endif
 	computePrimitiveNormalUV( DEBUG_ARG, &env->norm, &env->uv, intc, &env->p, prim );
 
 	// set primitive IOR
-	env->ior = prim->IOR;
+	env->ior = owner->IOR;
 	
 	// side switch shader
-	const __global Shader *shader = evalSwitchShader( prim->shader_offset, shaders, &r->d, &env->norm );
+	const __global Shader *shader = evalSwitchShader( owner->shader_offset, shaders, &r->d, &env->norm );
 	
 	// ior shader
 	env->shader = evalIORShader( shader, &env->ior, spectrum, shaders );
@@ -54,4 +54,19 @@ inline int testRayAABB( const __global AABB *glb_aabb, const float t, const RayA
 	return traverse;
 }
 
+inline void aabbMerge( AABB *a, const AABB *b )
+{
+	a->x0 = min( a->x0, b->x0 ); a->x1 = max( a->x1, b->x1 );
+	a->y0 = min( a->y0, b->y0 ); a->y1 = max( a->y1, b->y1 );
+	a->z0 = min( a->z0, b->z0 ); a->z1 = max( a->z1, b->z1 );
+}
+
+inline float aabbArea( const AABB *a )
+{
+	float dx = max( a->x1 - a->x0, 0.f );
+	float dy = max( a->y1 - a->y0, 0.f );
+	float dz = max( a->z1 - a->z0, 0.f );
+	return 2.f * (dx * dy + dx * dz + dy * dz);
+}
+
 #endif
\ No newline at end of file
@@ -32,6 +32,26 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #include "geo/polygon.h"
 #include "geo/aabb.h"
 
+#ifdef TRIANGLE_RECORDS
+	#include "geo/trianglerecord.h"
+#endif
+
+#ifdef INDEXED_MESHES
+	#include "geo/mesh.h"
+#endif
+
+#ifdef TRIANGLE_PACKS
+	#include "geo/trianglepack.h"
+#endif
+
+#if defined(POLYGON_ARRAY) && (defined(BVH_INSTANCES) || defined(INDEXED_MESHES) || defined(TRIANGLE_RECORDS))
+	#error "The typed polygon array only holds polygons"
+#endif
+
+#if defined(TRIANGLE_PACKS) && (defined(INDEXED_MESHES) || defined(TRIANGLE_RECORDS) || defined(POLYGON_ARRAY))
+	#error "The triangle packs are an alternative to the other leaf formats"
+#endif
+
 bool computePrimitiveIntersect( DEBUG_PAR ,
 	Intc *intc ,
 	int pidx , 
@@ -45,8 +65,22 @@ bool computePrimitiveIntersect( DEBUG_PAR ,
 		
 	const __global Prim *prim = (const __global Prim*)(prims + offset);
 	
-	#ifdef BIH
-		// primitive aabb test	
+	#ifdef INDEXED_MESHES
+		// triangle of an indexed mesh, it has no bounds of its own
+		if( (prim->type & PRIM_NOP_MASK) == PRIM_MESH_TRIANGLE )
+		{
+			Intc mesh_intc;
+			if( computeMeshTriangleIntersect( &mesh_intc, r, prims, (const __global MeshTriangle*)prim ) && mesh_intc.t > 0 && mesh_intc.t < intc->t )
+			{
+				*intc = mesh_intc;
+				return true;
+			}
+			return false;
+		}
+	#endif
+	
+	#ifndef BVH
+		// primitive aabb test, the BIH leaves have no bounds	
 		if( testRayAABB( &prim->aabb, intc->t, aux ) == 0 )
 			return false;
 	#endif
@@ -100,6 +134,12 @@ bool computePrimitiveIntersect( DEBUG_PAR ,
 							return false;
 					}
 					break;
+				case PRIM_DISC:
+					{
+						if( !computeDiscIntersect( &prim_intc, &lr, (const __global Plane*)tp ) )
+							return false;
+					}
+					break;
 				};
 			
 				//prim_intc.t += 10000.f;
@@ -123,7 +163,8 @@ bool computePrimitiveIntersect( DEBUG_PAR ,
 	return false;
  }
 
- // return true iff shadow ray is blocked
+ // return true iff shadow ray is blocked : a shadow ray stops at the first opaque primitive,
+ // the nearest transmissive hit is kept like for other rays
 bool computeIntersect( DEBUG_PAR ,
 	Intc *intc ,
 	int start , int num , 
@@ -136,10 +177,67 @@ bool computeIntersect( DEBUG_PAR ,
 {
 	for( int pidx = start ; pidx < start + num ; pidx++ )
 	{
-		if(computePrimitiveIntersect( DEBUG_ARG, intc, pidx, prims, offsets, r, aux ) && shadowRay )
+		if(computePrimitiveIntersect( DEBUG_ARG, intc, pidx, prims, offsets, r, aux ) && shadowRay && prim_opaque( intc->prim ) )
 			return true;
 	}
 	return false;
 }
 
+#ifdef POLYGON_ARRAY
+ // leaf of a typed polygon array (-D POLYGON_ARRAY) : prims holds one polygon per leaf entry, indexed directly
+ // without the offsets load nor the type switch, return true iff shadow ray is blocked
+bool computePolygonArrayIntersect( DEBUG_PAR ,
+	Intc *intc ,
+	int start , int num , 
+	const __global Polygon *polys,
+	const Ray *r,
+	const RayAux *aux,
+	bool shadowRay
+	)
+{
+	for( int pidx = start ; pidx < start + num ; pidx++ )
+	{
+		const __global Polygon *poly = polys + pidx;
+		
+		#ifndef BVH
+			// primitive aabb test, the BIH leaves have no bounds
+			if( testRayAABB( &poly->base.aabb, intc->t, aux ) == 0 )
+				continue;
+		#endif
+		
+		Intc prim_intc;
+		intc_init( &prim_intc ,0.f ,&poly->base  );
+		if( !computePolygonIntersect( &prim_intc, r, aux, poly ) || prim_intc.t <= 0 || prim_intc.t >= intc->t )
+			continue;
+		
+		*intc = prim_intc;
+		if( shadowRay && prim_opaque( intc->prim ) )
+			return true;
+	}
+	return false;
+}
+#endif
+
+ // intersections of the primitives of a BVH or BIH leaf, return true iff shadow ray is blocked
+inline bool computeLeafIntersect( DEBUG_PAR ,
+	Intc *intc ,
+	int start , int num , 
+	const __global char *prims,
+	const __global int *offsets,
+	const Ray *r,
+	const RayAux *aux,
+	bool shadowRay
+	)
+{
+#if defined(TRIANGLE_RECORDS)
+	return computeRecordsIntersect( DEBUG_ARG, intc, start, num, prims, offsets, r, shadowRay );
+#elif defined(TRIANGLE_PACKS)
+	return computePacksIntersect( DEBUG_ARG, intc, start, num, prims, offsets, r, shadowRay );
+#elif defined(POLYGON_ARRAY)
+	return computePolygonArrayIntersect( DEBUG_ARG, intc, start, num, (const __global Polygon*)prims, r, aux, shadowRay );
+#else
+	return computeIntersect( DEBUG_ARG, intc, start, num, prims, offsets, r, aux, shadowRay );
+#endif
+}
+
 #endif
\ No newline at end of file
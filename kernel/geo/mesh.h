@@ -0,0 +1,134 @@
+#ifndef _MESH_H
+#define _MESH_H
+
+#include "geo/prim.h"
+
+/*
+	Indexed triangle meshes (-D INDEXED_MESHES).
+
+	A mesh is stored once at the start of the primitive buffer : a Prim header (group, shader, IOR and bounds of the
+	whole mesh) followed by its shared vertex, normal and uv arrays and its index buffer (three uints per triangle).
+	The entries of the BVH leaves are 12 bytes MeshTriangle references, the vertices are read through the index buffer.
+	A hit keeps the mesh as its primitive and the triangle in intc->tri.
+*/
+
+#ifdef BVH_INSTANCES
+	#error "The indexed meshes can't be instanced"
+#endif
+
+#ifdef TRIANGLE_RECORDS
+	#error "The triangle records only hold polygons"
+#endif
+
+typedef struct
+{
+	Prim base;
+	int vertices;	// byte offsets of the Vec3 vertices, Vec3 normals, Vec2 uvs and uint indices from the mesh
+	int normals;
+	int uvs;
+	int indices;
+}Mesh;
+
+typedef struct
+{
+	int type;		// PRIM_MESH_TRIANGLE, with the flags of the mesh
+	int mesh;		// byte offset of the mesh in the primitive buffer
+	int tri;		// triangle of the mesh
+}MeshTriangle;
+
+inline const __global uint* meshIndices( const __global Mesh *mesh, int tri )
+{ return (const __global uint*)((const __global char*)mesh + mesh->indices) + 3 * tri; }
+
+inline Vec3 meshVertex( const __global Mesh *mesh, uint idx )
+{ return ((const __global Vec3*)((const __global char*)mesh + mesh->vertices))[idx]; }
+
+// same test as computePolygonIntersect, on the vertices read by index
+bool computeMeshTriangleIntersect( Intc *intc, const Ray *r, const __global char *prims, const __global MeshTriangle *mt )
+{
+	const __global Mesh *mesh = (const __global Mesh*)(prims + mt->mesh);
+	const __global uint *idx = meshIndices( mesh, mt->tri );
+
+	const Vec3 vert0 = meshVertex( mesh, idx[0] );
+	const Vec3 vert1 = meshVertex( mesh, idx[1] );
+	const Vec3 vert2 = meshVertex( mesh, idx[2] );
+
+	Vec3 edge1, edge2;
+	v3sub( &edge1, &vert1, &vert0 );
+	v3sub( &edge2, &vert2, &vert0 );
+
+	Vec3 pvec;
+	v3cross( &pvec, &r->d, &edge2 );
+
+	float det = v3dot( &edge1, &pvec );
+	float inv_det = 1.f / det;
+
+	if( det > -EPSILON && det < EPSILON )
+		return false;
+
+	Vec3 tvec;
+	v3sub( &tvec, &r->o, &vert0 );
+
+	float u = v3dot( &tvec, &pvec ) * inv_det;
+	if( u < 0.f || u > 1.f )
+		return false;
+
+	Vec3 qvec;
+	v3cross( &qvec, &tvec, &edge1 );
+
+	float v = v3dot( &r->d, &qvec ) * inv_det;
+	if( v < 0 || u + v > 1.f )
+		return false;
+
+	intc->t = v3dot( &edge2, &qvec ) * inv_det;
+	intc->prim = (const __global Prim*)mesh;
+	intc->tri = mt->tri;
+	v2init( &intc->uv, u, v );
+
+	return true;
+}
+
+// same as computePolygonNormalUV, the face normal is computed from the vertices
+void computeMeshNormalUV( Vec3 *norm, Vec2 *tex_uv, const Intc *intc, const __global Mesh *mesh )
+{
+	const __global uint *idx = meshIndices( mesh, intc->tri );
+	const __global Vec2 *uvs = (const __global Vec2*)((const __global char*)mesh + mesh->uvs);
+
+	Vec2 uv0 = uvs[idx[0]];
+	Vec2 uv1 = uvs[idx[1]];
+	Vec2 uv2 = uvs[idx[2]];
+
+	Vec2 tri_uv = intc->uv;
+
+	v2smul( &uv0, &uv0, 1.f - tri_uv.x - tri_uv.y );
+	v2smul( &uv1, &uv1, tri_uv.x );
+	v2smul( &uv2, &uv2, tri_uv.y );
+
+	v2add( tex_uv, v2add( tex_uv, &uv0, &uv1 ), &uv2 );
+
+#ifdef INTERPOLATE_NORMALS
+	// interpolate shading normal
+	const __global Vec3 *normals = (const __global Vec3*)((const __global char*)mesh + mesh->normals);
+	Vec3 n0 = normals[idx[0]];
+	Vec3 n1 = normals[idx[1]];
+	Vec3 n2 = normals[idx[2]];
+
+	v3smul( &n0, &n0, 1.f - tri_uv.x - tri_uv.y );
+	v3smul( &n1, &n1, tri_uv.x );
+	v3smul( &n2, &n2, tri_uv.y );
+
+	v3add( norm, v3add( norm, &n0, &n1 ), &n2 );
+#else
+	const Vec3 vert0 = meshVertex( mesh, idx[0] );
+	const Vec3 vert1 = meshVertex( mesh, idx[1] );
+	const Vec3 vert2 = meshVertex( mesh, idx[2] );
+
+	Vec3 edge1, edge2;
+	v3sub( &edge1, &vert1, &vert0 );
+	v3sub( &edge2, &vert2, &vert0 );
+	v3cross( norm, &edge1, &edge2 );
+#endif
+
+	v3norm( norm , norm );
+}
+
+#endif
@@ -31,6 +31,10 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #include "geo/box.h"
 #include "geo/polygon.h"
 
+#ifdef INDEXED_MESHES
+	#include "geo/mesh.h"
+#endif
+
 void computePrimitiveNormalUV( DEBUG_PAR ,
 	Vec3 *norm,
 	Vec2 *uv,
@@ -51,9 +55,10 @@ void computePrimitiveNormalUV( DEBUG_PAR ,
 		m34submul( norm , &m , intp );
 		
 		// perform type-dependant compute normal routine
-		switch(tp->type)
+		switch(tp->type & PRIM_NOP_MASK)
 		{
 		case PRIM_PLANE:
+		case PRIM_DISC:
 			{
 				computePlaneNormalUV( norm, uv, intc, norm, (__global Plane*)tp );
 			}
@@ -81,6 +86,12 @@ void computePrimitiveNormalUV( DEBUG_PAR ,
 		// normalize normal
 		v3norm( norm , norm );
 	}
+#ifdef INDEXED_MESHES
+	else if( (prim->type & PRIM_NOP_MASK) == PRIM_MESH )
+	{
+		computeMeshNormalUV( norm, uv, intc, (__global Mesh*)prim );
+	}
+#endif
 	else
 	{
 		computePolygonNormalUV( norm, uv, intc, norm, (__global Polygon*)prim );
@@ -41,6 +41,22 @@ bool computePlaneIntersect( Intc *intc, const Ray *r, const __global Plane *plan
 	return false; 
 }
 
+// unit disc of the z = 0 plane, its normal and uvs are those of the plane
+bool computeDiscIntersect( Intc *intc, const Ray *r, const __global Plane *disc )
+{
+	if (r->d.z == 0)
+		return false;
+	
+	const float t = -r->o.z / r->d.z;
+	const float x = r->o.x + t * r->d.x;
+	const float y = r->o.y + t * r->d.y;
+	if( x * x + y * y > 1.f )
+		return false;
+	
+	intc->t = t;
+	return true;
+}
+
 void computePlaneNormalUV( Vec3 *norm, Vec2 *uv, const Intc *intc, const Vec3 *intp, const __global Plane *plane )
 {
 	v2init( uv, intp->x, intp->y );
@@ -84,7 +84,7 @@ bool computePolygonIntersect( Intc *intc, const Ray *r, const RayAux *aux, const
 	if( v < 0 )
 		return false;
 	
-	if( poly->base.type == PRIM_TRIANGLE ) {
+	if( (poly->base.type & PRIM_NOP_MASK) == PRIM_TRIANGLE ) {
 		if( u + v > 1.f )
 			return false;
 	} else {
@@ -27,7 +27,8 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #define  PRIM_TRANSFORMABLE 0x80
 #define  PRIM_NOP 0x100
 #define  PRIM_NOP_2 0x200
-#define  PRIM_NOP_MASK (~(PRIM_NOP|PRIM_NOP_2))
+#define  PRIM_OPAQUE 0x400		// the shader transmits no light : shadow rays stop at the first hit of such a primitive
+#define  PRIM_NOP_MASK (~(PRIM_NOP|PRIM_NOP_2|PRIM_OPAQUE))
 
 #define  PRIM_PLANE (PRIM_TRANSFORMABLE | 1)
 #define  PRIM_SPHERE (PRIM_TRANSFORMABLE | 2)
@@ -35,6 +36,10 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #define  PRIM_BOX (PRIM_TRANSFORMABLE | 4)
 #define  PRIM_TRIANGLE (5)
 #define  PRIM_PARALLEL (6)
+#define  PRIM_INSTANCE (PRIM_TRANSFORMABLE | 7)
+#define  PRIM_MESH (8)
+#define  PRIM_MESH_TRIANGLE (9)
+#define  PRIM_DISC (PRIM_TRANSFORMABLE | 10)
 
 #include "math/ray.h"
 #include "math/math.h"
@@ -54,10 +59,24 @@ typedef struct
 	Mat34 m;
 }Prim;
 
+// instance of a shared mesh (-D BVH_INSTANCES) : the matrix of the base moves the ray to the object space of the mesh,
+// whose bottom-level BVH starts at node root of the BVH buffer. The instance carries the group, shader and IOR of its hits
+typedef struct
+{
+	Prim base;
+	int root;
+}Instance;
+
 typedef struct
 {
 	float t;
 	const __global Prim *prim;
+#ifdef BVH_INSTANCES
+	const __global Prim *instance;	// instance of the mesh holding prim, 0 outside instances
+#endif
+#ifdef INDEXED_MESHES
+	int tri;	// triangle of the hit when prim is an indexed mesh
+#endif
 	union
 	{
 		int side;
@@ -65,7 +84,22 @@ typedef struct
 	};
 }Intc;
 
-inline Intc* intc_init( Intc *intc, float t, const __global Prim *prim )
-{ intc->t = t; intc->prim = prim; return intc; }
+inline bool prim_opaque( const __global Prim *prim )
+{ return (prim->type & PRIM_OPAQUE) != 0; }
+
+#ifdef BVH_INSTANCES
+	inline Intc* intc_init( Intc *intc, float t, const __global Prim *prim )
+	{ intc->t = t; intc->prim = prim; intc->instance = 0; return intc; }
+
+	// primitive carrying the group, shader and IOR of the intersection
+	inline const __global Prim* intc_owner( const Intc *intc )
+	{ return intc->instance != 0 ? intc->instance : intc->prim; }
+#else
+	inline Intc* intc_init( Intc *intc, float t, const __global Prim *prim )
+	{ intc->t = t; intc->prim = prim; return intc; }
+
+	inline const __global Prim* intc_owner( const Intc *intc )
+	{ return intc->prim; }
+#endif
 
 #endif
\ No newline at end of file
@@ -0,0 +1,130 @@
+#ifndef _TRIANGLE_PACK_H
+#define _TRIANGLE_PACK_H
+
+#include "geo/prim.h"
+
+/*
+	SoA triangle packs (-D TRIANGLE_PACKS=4 or 8).
+
+	The primitive buffer starts with one pack per TRIANGLE_PACKS leaf entries, in leaf order. The first vertex, the two
+	edges and the type of the triangles of a pack are each stored as one float vector, and the intersection test runs on
+	all of them at once. The BVH leaves start on a pack (BVHBuilder.alignLeaves), the lanes past the leaf count are masked.
+	The full primitives follow and are only read for the kept hit, as with the triangle records.
+*/
+
+#ifdef BVH_INSTANCES
+	#error "The triangle packs can't hold the instances of a two-level BVH"
+#endif
+
+#if TRIANGLE_PACKS == 4
+	typedef float4 packf;
+	typedef int4 packi;
+	#define PACK_LANES (int4)(0, 1, 2, 3)
+	#define PACK_STORE vstore4
+	#define PACK_AS_INT as_int4
+	inline float packMin( float4 a ) { const float2 m = fmin( a.lo, a.hi ); return fmin( m.x, m.y ); }
+#elif TRIANGLE_PACKS == 8
+	typedef float8 packf;
+	typedef int8 packi;
+	#define PACK_LANES (int8)(0, 1, 2, 3, 4, 5, 6, 7)
+	#define PACK_STORE vstore8
+	#define PACK_AS_INT as_int8
+	inline float packMin( float8 a ) { const float4 m = fmin( a.lo, a.hi ); const float2 n = fmin( m.lo, m.hi ); return fmin( n.x, n.y ); }
+#else
+	#error "The triangle packs hold either 4 or 8 triangles"
+#endif
+
+typedef struct
+{
+	packf v0x, v0y, v0z;	// first vertices
+	packf e1x, e1y, e1z;	// vert1 - vert0
+	packf e2x, e2y, e2z;	// vert2 - vert0
+	packf type;				// primitive types (as_float)
+}TrianglePack;
+
+// same test as computePolygonIntersect on each lane of a pack, the mask of the lanes hit nearer than maxT is returned
+inline packi computeTrianglePackIntersect( packf *t, packf *u, packf *v, const Ray *r, const __global TrianglePack *pack, float maxT )
+{
+	const packf dx = (packf)(r->d.x), dy = (packf)(r->d.y), dz = (packf)(r->d.z);
+
+	// pvec = d x e2
+	const packf px = dy * pack->e2z - dz * pack->e2y;
+	const packf py = dz * pack->e2x - dx * pack->e2z;
+	const packf pz = dx * pack->e2y - dy * pack->e2x;
+
+	const packf det = pack->e1x * px + pack->e1y * py + pack->e1z * pz;
+	const packf inv_det = 1.f / det;
+
+	// tvec = o - v0
+	const packf tx = (packf)(r->o.x) - pack->v0x;
+	const packf ty = (packf)(r->o.y) - pack->v0y;
+	const packf tz = (packf)(r->o.z) - pack->v0z;
+
+	*u = (tx * px + ty * py + tz * pz) * inv_det;
+
+	// qvec = tvec x e1
+	const packf qx = ty * pack->e1z - tz * pack->e1y;
+	const packf qy = tz * pack->e1x - tx * pack->e1z;
+	const packf qz = tx * pack->e1y - ty * pack->e1x;
+
+	*v = (dx * qx + dy * qy + dz * qz) * inv_det;
+	*t = (pack->e2x * qx + pack->e2y * qy + pack->e2z * qz) * inv_det;
+
+	const packi triangle = (PACK_AS_INT( pack->type ) & PRIM_NOP_MASK) == PRIM_TRIANGLE;
+	const packi inside = select( *v <= 1.f, *u + *v <= 1.f, triangle );
+
+	return (fabs( det ) >= EPSILON) & (*u >= 0.f) & (*u <= 1.f) & (*v >= 0.f) & inside & (*t > 0.f) & (*t < maxT);
+}
+
+// intersections of the leaf entries [start, start + num), start being the first entry of a pack
+// return true iff shadow ray is blocked
+bool computePacksIntersect( DEBUG_PAR ,
+	Intc *intc ,
+	int start , int num ,
+	const __global char *prims,
+	const __global int *offsets,
+	const Ray *r,
+	bool shadowRay
+	)
+{
+	const __global TrianglePack *packs = (const __global TrianglePack*)prims;
+	for( int first = start ; first < start + num ; first += TRIANGLE_PACKS )
+	{
+		const __global TrianglePack *pack = packs + first / TRIANGLE_PACKS;
+
+		packf t, u, v;
+		packi hit = computeTrianglePackIntersect( &t, &u, &v, r, pack, intc->t );
+		hit &= (PACK_LANES < (packi)(start + num - first));
+
+		// a shadow ray only keeps the opaque hits once one is found
+		const packi opaque = hit & ((PACK_AS_INT( pack->type ) & PRIM_OPAQUE) != 0);
+		const bool blocked = shadowRay && any( opaque );
+		if( blocked )
+			hit = opaque;
+
+		if( !any( hit ) )
+			continue;
+
+		// nearest lane
+		t = select( (packf)(INFINITY), t, hit );
+		const float tmin = packMin( t );
+		float ts[TRIANGLE_PACKS], us[TRIANGLE_PACKS], vs[TRIANGLE_PACKS];
+		PACK_STORE( t, 0, ts );
+		PACK_STORE( u, 0, us );
+		PACK_STORE( v, 0, vs );
+
+		int lane = 0;
+		while( ts[lane] != tmin )
+			lane++;
+
+		intc->t = tmin;
+		intc->prim = (const __global Prim*)(prims + offsets[first + lane]);
+		v2init( &intc->uv, us[lane], vs[lane] );
+
+		if( blocked )
+			return true;
+	}
+	return false;
+}
+
+#endif
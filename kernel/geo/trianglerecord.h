@@ -0,0 +1,105 @@
+#ifndef _TRIANGLE_RECORD_H
+#define _TRIANGLE_RECORD_H
+
+#include "geo/prim.h"
+
+/*
+	Compact triangle records (-D TRIANGLE_RECORDS).
+
+	The primitive buffer starts with one 48 bytes record per leaf entry of the BVH, in leaf order, holding only what
+	the intersection test reads. The full primitives follow : they are the attributes of the hit (normals, uvs, group,
+	shader), located through offsets[] and only read when the kept hit is shaded.
+*/
+
+#ifdef BVH_INSTANCES
+	#error "The triangle records can't hold the instances of a two-level BVH"
+#endif
+
+typedef struct
+{
+	float4 v0;		// first vertex, w holds the primitive type (as_float)
+	float4 e1;		// vert1 - vert0
+	float4 e2;		// vert2 - vert0
+}TriangleRecord;
+
+// same test as computePolygonIntersect, on the precomputed edges
+bool computeTriangleRecordIntersect( Intc *intc, const Ray *r, const TriangleRecord *rec )
+{
+	Vec3 vert0, edge1, edge2;
+	v3init( &vert0, rec->v0.x, rec->v0.y, rec->v0.z );
+	v3init( &edge1, rec->e1.x, rec->e1.y, rec->e1.z );
+	v3init( &edge2, rec->e2.x, rec->e2.y, rec->e2.z );
+	
+	Vec3 pvec;
+	v3cross( &pvec, &r->d, &edge2 );
+	
+	float det = v3dot( &edge1, &pvec );
+	float inv_det = 1.f / det;
+	
+	if( det > -EPSILON && det < EPSILON )
+		return false;
+	
+	Vec3 tvec;
+	v3sub( &tvec, &r->o, &vert0 );
+	
+	float u = v3dot( &tvec, &pvec ) * inv_det;
+	if( u < 0.f || u > 1.f )
+		return false;
+	
+	Vec3 qvec;
+	v3cross( &qvec, &tvec, &edge1 );
+	
+	float v = v3dot( &r->d, &qvec ) * inv_det;
+	
+	if( v < 0 )
+		return false;
+	
+	if( (as_int( rec->v0.w ) & PRIM_NOP_MASK) == PRIM_TRIANGLE ) {
+		if( u + v > 1.f )
+			return false;
+	} else {
+		if( v > 1.f )
+			return false;
+	}
+	
+	intc->t = v3dot( &edge2, &qvec ) * inv_det;
+	v2init( &intc->uv, u, v );
+	
+	return true;
+}
+
+// return true iff shadow ray is blocked, like computeIntersect for the leaf entries [start, start + num)
+bool computeRecordsIntersect( DEBUG_PAR ,
+	Intc *intc ,
+	int start , int num ,
+	const __global char *prims,
+	const __global int *offsets,
+	const Ray *r,
+	bool shadowRay
+	)
+{
+	const __global TriangleRecord *records = (const __global TriangleRecord*)prims;
+	
+	for( int pidx = start ; pidx < start + num ; pidx++ )
+	{
+		const TriangleRecord rec = records[pidx];
+		
+		Intc rec_intc;
+		if( !computeTriangleRecordIntersect( &rec_intc, r, &rec ) )
+			continue;
+		
+		// track nearest intersection, the full primitive is only located
+		if( rec_intc.t > 0 && rec_intc.t < intc->t )
+		{
+			intc->t = rec_intc.t;
+			intc->uv = rec_intc.uv;
+			intc->prim = (const __global Prim*)(prims + offsets[pidx]);
+			
+			if( shadowRay && (as_int( rec.v0.w ) & PRIM_OPAQUE) != 0 )
+				return true;
+		}
+	}
+	return false;
+}
+
+#endif
@@ -0,0 +1,239 @@
+#include "util/debug.h"
+
+#include "geo/prim.h"
+#include "trace/bvh/bvh.h"
+#include "trace/bvh/fit.h"
+#include "util/morton.h"
+
+/*
+	Linear BVH build on the device.
+
+	"Maximizing Parallelism in the Construction of BVHs, Octrees, and k-d Trees",
+	Tero Karras,
+	Proc. High-Performance Graphics 2012
+
+	For n primitives, internal node i is stored at bvh[i] (the root is node 0) and leaf k,
+	which holds the k-th primitive in Morton order, at bvh[n-1+k]. Child addresses follow the
+	BVHNode convention of trace/bvh/trace.h: a leaf child is encoded as -index-1.
+*/
+
+#define MORTON_BITS 10
+
+// map a float to an unsigned int with the same ordering, so that bounds can be reduced with integer atomics
+inline uint floatToOrderedUint( float f )
+{
+	uint u = as_uint( f );
+	return (u & 0x80000000) ? ~u : (u | 0x80000000);
+}
+
+inline float orderedUintToFloat( uint u )
+{
+	return as_float( (u & 0x80000000) ? (u & 0x7FFFFFFF) : ~u );
+}
+
+// length of the common prefix of the keys i and j, the index breaks ties between equal codes
+inline int commonPrefix( int n, const __global uint *codes, int i, int j )
+{
+	if( j < 0 || j >= n )
+		return -1;
+
+	uint a = codes[i];
+	uint b = codes[j];
+
+	if( a == b )
+		return 32 + clz( (uint)(i ^ j) );
+
+	return clz( a ^ b );
+}
+
+inline const __global Prim* getPrim( const __global char *prims, const __global int *offsets, int pidx )
+{
+	return (const __global Prim*)(prims + offsets[pidx]);
+}
+
+// scene bounds as 6 ordered uints (x0,y0,z0 mins then x1,y1,z1 maxs), initialized to (UINT_MAX, 0)
+__kernel void computeSceneBounds( DEBUG_PAR ,
+	int np,
+	const __global char *prims,
+	const __global int *offsets,
+	__global uint *bounds,
+	__local float *scratch
+	)
+{
+	int idx = get_global_id(0);
+	int lid = get_local_id(0);
+	int lsize = get_local_size(0);
+
+	// centroid of the primitive
+	float3 c = (float3)(FLT_MAX, FLT_MAX, FLT_MAX);
+	float3 d = (float3)(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+	if( idx < np )
+	{
+		AABB aabb = getPrim( prims, offsets, idx )->aabb;
+		c = (float3)(aabb.x0 + aabb.x1, aabb.y0 + aabb.y1, aabb.z0 + aabb.z1) * 0.5f;
+		d = c;
+	}
+
+	__local float *lo = scratch;
+	__local float *hi = scratch + 3 * lsize;
+	lo[3*lid+0] = c.x; lo[3*lid+1] = c.y; lo[3*lid+2] = c.z;
+	hi[3*lid+0] = d.x; hi[3*lid+1] = d.y; hi[3*lid+2] = d.z;
+
+	// reduce the work-group
+	for( int stride = lsize >> 1 ; stride > 0 ; stride >>= 1 )
+	{
+		barrier( CLK_LOCAL_MEM_FENCE );
+		if( lid < stride )
+		{
+			for( int a = 0 ; a < 3 ; a++ )
+			{
+				lo[3*lid+a] = min( lo[3*lid+a], lo[3*(lid+stride)+a] );
+				hi[3*lid+a] = max( hi[3*lid+a], hi[3*(lid+stride)+a] );
+			}
+		}
+	}
+
+	if( lid == 0 )
+	{
+		for( int a = 0 ; a < 3 ; a++ )
+		{
+			atomic_min( &bounds[a], floatToOrderedUint( lo[a] ) );
+			atomic_max( &bounds[3+a], floatToOrderedUint( hi[a] ) );
+		}
+	}
+}
+
+__kernel void computeMortonCodes( DEBUG_PAR ,
+	int np,
+	const __global char *prims,
+	const __global int *offsets,
+	const __global uint *bounds,
+	__global uint *codes,
+	__global int *indices
+	)
+{
+	int idx = get_global_id(0);
+	if( idx >= np )
+		return;
+
+	float3 lo = (float3)(orderedUintToFloat( bounds[0] ), orderedUintToFloat( bounds[1] ), orderedUintToFloat( bounds[2] ));
+	float3 hi = (float3)(orderedUintToFloat( bounds[3] ), orderedUintToFloat( bounds[4] ), orderedUintToFloat( bounds[5] ));
+	float3 extent = hi - lo;
+
+	AABB aabb = getPrim( prims, offsets, idx )->aabb;
+	float3 c = (float3)(aabb.x0 + aabb.x1, aabb.y0 + aabb.y1, aabb.z0 + aabb.z1) * 0.5f;
+
+	// normalize the centroid in the scene bounds
+	c = (c - lo) / max( extent, (float3)(FLT_EPSILON, FLT_EPSILON, FLT_EPSILON) );
+
+	codes[idx] = morton3D( c.x, c.y, c.z, MORTON_BITS );
+	indices[idx] = idx;
+}
+
+// gather the primitive offsets in Morton order
+__kernel void permuteOffsets( DEBUG_PAR ,
+	int np,
+	const __global int *indices,
+	const __global int *offsetsIn,
+	__global int *offsetsOut
+	)
+{
+	int idx = get_global_id(0);
+	if( idx >= np )
+		return;
+
+	offsetsOut[idx] = offsetsIn[indices[idx]];
+}
+
+// one work-item per internal node, find the range of keys it covers and its split position
+__kernel void buildHierarchy( DEBUG_PAR ,
+	int np,
+	const __global uint *codes,
+	__global BVHNode *bvh,
+	__global int *parents
+	)
+{
+	int i = get_global_id(0);
+
+	// leaf k holds the k-th primitive
+	if( i < np )
+	{
+		__global BVHNode *leaf = &bvh[np - 1 + i];
+		leaf->idx = i;
+		leaf->pcount = 1;
+	}
+
+	// the root has no parent, it is a leaf when there is a single primitive
+	// the parent links are also kept in the nodes for the short stack traversal
+	if( i == 0 )
+	{
+		parents[0] = -1;
+		bvh[0].cnodes.z = -1;
+	}
+
+	if( i >= np - 1 )
+		return;
+
+	// direction of the range
+	int d = (commonPrefix( np, codes, i, i + 1 ) - commonPrefix( np, codes, i, i - 1 )) >= 0 ? 1 : -1;
+
+	// upper bound of the range length
+	int deltaMin = commonPrefix( np, codes, i, i - d );
+	int lmax = 2;
+	while( commonPrefix( np, codes, i, i + lmax * d ) > deltaMin )
+		lmax <<= 1;
+
+	// binary search of the other end
+	int l = 0;
+	for( int t = lmax >> 1 ; t >= 1 ; t >>= 1 )
+	{
+		if( commonPrefix( np, codes, i, i + (l + t) * d ) > deltaMin )
+			l += t;
+	}
+	int j = i + l * d;
+
+	// binary search of the split position
+	int deltaNode = commonPrefix( np, codes, i, j );
+	int s = 0;
+	int t = l;
+	do
+	{
+		t = (t + 1) >> 1;
+		if( commonPrefix( np, codes, i, i + (s + t) * d ) > deltaNode )
+			s += t;
+	}while( t > 1 );
+	int gamma = i + s * d + min( d, 0 );
+
+	// children, leaves are stored after the np-1 internal nodes
+	int c0 = (min( i, j ) == gamma) ? np - 1 + gamma : gamma;
+	int c1 = (max( i, j ) == gamma + 1) ? np + gamma : gamma + 1;
+
+	bvh[i].c0idx = (min( i, j ) == gamma) ? -c0 - 1 : c0;
+	bvh[i].c1idx = (max( i, j ) == gamma + 1) ? -c1 - 1 : c1;
+
+	parents[c0] = i;
+	parents[c1] = i;
+	bvh[c0].cnodes.z = i;
+	bvh[c1].cnodes.z = i;
+}
+
+/*
+	Fit the child bounds bottom-up, one work-item per leaf (see trace/bvh/fit.h).
+	flags must be zero initialized.
+*/
+__kernel void fitBounds( DEBUG_PAR ,
+	int nleaves,
+	int leafBase,
+	const __global char *prims,
+	const __global int *offsets,
+	__global BVHNode *bvh,
+	const __global int *parents,
+	__global int *flags
+	)
+{
+	int k = get_global_id(0);
+	if( k >= nleaves )
+		return;
+
+	fitLeaf( leafBase + k, prims, offsets, bvh, parents, flags );
+}
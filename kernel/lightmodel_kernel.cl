@@ -23,6 +23,220 @@
 
 #include "common/intersectenv.h"
 
+#ifdef RAY_SORTING
+	#include "util/morton.h"
+#endif
+
+// start the path of sample idx : sample its wavelengths, a light source and a ray leaving it
+void startPath( DEBUG_PAR ,
+	Ray *r,
+	Spectrum *rad,
+	Spectrum *spectrum,
+	Random *rnd,
+	unsigned int idx,
+	int nsamples,
+	int nl,
+	__global char *lights,
+	__global int *lightOffsets,
+	__global float *cumLightPower,
+	SphereVolume *bounds,
+	int seed )
+{
+	initRandom( rnd, idx, seed );
+	
+	// spectrum sampling
+	SampleUnitSpectum( spectrum, rnd );
+	//SampleSpectrum( spectrum, rnd );
+	
+	// select a light source proportional to light power
+	// all threads are stratified over all light sources
+	float cumpower = (float)(idx + random1f(rnd)) / (float)nsamples;
+	
+	float lprob; // sample probabilitiy
+	__global Light* light = sampleLightSource( &lprob, cumpower, nl, lights, lightOffsets, cumLightPower );
+	
+	// generate a random ray from that light source
+	GenerateLight(DEBUG_ARG, r, rad, spectrum, light, rnd, bounds, lights, lights );
+
+	// correct for light selection probability
+	specsmul( rad, rad, invSafe(lprob) );
+}
+
+// scatter a path at its intersection : sample the reflected ray and compute the power absorbed by the primitive
+// Return false when the path ends
+bool scatter( DEBUG_PAR ,
+	Ray *r,
+	Spectrum *rad,
+	Spectrum *absorbed,
+	const Spectrum *spectrum,
+	Random *rnd,
+	const Intc *intc,
+	__global char *shaders,
+	__global char *channels,
+	int depth,
+	float minPower )
+{
+	// load intersection data
+	Environment env;
+	computeIntersectEnv( DEBUG_ARG, &env, spectrum, intc, r, shaders );
+			
+	Vec3 refl_out;
+	Spectrum refl_bsdf;
+	
+	// sample outgoing direction
+	SampleBSDF( &refl_out, &refl_bsdf, spectrum, &env, &r->d, channels, true, rnd );
+
+	// compute new radiance after reflection
+	Spectrum new_rad;
+	specmul( &new_rad, rad, &refl_bsdf );
+			
+	// compute absorbed power
+	specsub( absorbed, rad, &new_rad );
+
+	// don't clamp the absorbed power! 
+	// due to probabilistic nature of BSDF sampling, the absorbed power may be negative
+	// clamping would bias the net absorbed power
+			
+	//specone( absorbed );
+	//specsmul( absorbed, absorbed, 100.f );
+	
+	// check if radiance power is big enough for reflection
+	if( specsum( &new_rad ) < minPower )
+		return false;
+
+#ifdef RUSSIAN_ROULETTE
+	if( depth >= RUSSIAN_ROULETTE_DEPTH )
+	{
+		// Russian roulette performs importance sampling with respect to path length
+		
+		// compute reflection probability
+		float pbrRussian = clamp( specsum( &new_rad ) / SPECTAL_CHANNELS, 0.f, 1.f);
+		
+		// russian roulette
+		if( random1f( rnd ) >= pbrRussian )
+			return false;
+		
+		// correct radiance accordingly
+		specsmul( &new_rad, &new_rad, invSafe(pbrRussian) );
+	}
+#endif	
+		
+	// set reflection ray
+	*rad = new_rad;		
+	rinit( r, &env.p, &refl_out );
+	rmarch( &r->o, SCATTER_EPSILON, r );
+	return true;
+}
+
+// bounce d of a path : trace the ray, accumulate the sensed irradiance and the absorbed power, then sample the
+// reflected ray. Return false when the path ends
+bool bounce( DEBUG_PAR ,
+	Ray *r,
+	Spectrum *rad,
+	const Spectrum *spectrum,
+	Random *rnd,
+	int d,
+	// output buffers
+	__global Measurement *power,
+	__global Measurement *irradiance,
+	// detectors
+	__global Detector *detectors,
+	int measurementBits,
+	// scene
+	int np , int ninfp ,
+	__global char *prims,
+	__global int *offsets,
+	int root,
+	__global char *bvh,
+	__global char *shaders,
+	__global char *channels,
+	// sensors
+	int ns,
+	__global Sensor *sensors,
+	int sensor_root,
+	__global BVHTraceNode *sensorBvh,
+	// params
+	int depth,
+	float minPower,
+	__global MeasurementSensitivityCurve *sensitivityCurves )
+{
+	// compute first intersection between ray and scene
+	Intc intc;
+	intc_init( &intc , FLT_MAX , 0);
+	
+	trace( DEBUG_ARG, &intc, r, np, ninfp, prims, offsets, bvh, root, false );
+	
+#ifdef ENABLE_SENSORS
+	// find all sensors on the unintersected line segment and accumulate irradiance
+	traceSensor( DEBUG_ARG, irradiance, detectors, sensitivityCurves, d, measurementBits, rad, spectrum, intc.t, r, ns, sensors, sensorBvh, sensor_root );
+#endif
+	
+	// stop when the ray missed the scene
+	if( intc.prim == 0 )
+		return false;
+	
+	const __global Prim *prim = intc_owner( &intc );
+	
+	Spectrum absorbed;
+	const bool alive = scatter( DEBUG_ARG, r, rad, &absorbed, spectrum, rnd, &intc, shaders, channels, depth, minPower );
+			
+	// accumulate absorbed power
+	int measurementIdx = GetMeasurementIdx( detectors, d, measurementBits, prim->group_idx );
+	AtomicAddSpectrum( &power[measurementIdx], &absorbed, spectrum, sensitivityCurves );
+	//AddSpectrum( &power[measurementIdx], &absorbed, spectrum, sensitivityCurves );
+	
+	return alive;
+}
+
+// trace the path of sample idx until the maximum depth is reached or it ends
+void tracePath( DEBUG_PAR ,
+	int idx,
+	int nsamples,
+	// output buffers
+	__global Measurement *power,
+	__global Measurement *irradiance,
+	// detectors
+	__global Detector *detectors,
+	int measurementBits,
+	// scene
+	int np , int ninfp ,
+	__global char *prims,
+	__global int *offsets,
+	int root,
+	__global char *bvh,
+	__global char *shaders,
+	__global char *channels,
+	int nl,
+	__global char *lights,
+	__global int *lightOffsets,
+	__global float *cumLightPower,
+	// sensors
+	int ns,
+	__global Sensor *sensors,
+	int sensor_root,
+	__global BVHTraceNode *sensorBvh,
+	// params
+	int depth,
+	float minPower,
+	SphereVolume *bounds,
+	__global MeasurementSensitivityCurve *sensitivityCurves,
+	int seed
+	)
+{
+	Ray r;
+	Spectrum rad;
+	Spectrum spectrum;
+	Random rnd;
+	startPath( DEBUG_ARG, &r, &rad, &spectrum, &rnd, idx, nsamples, nl, lights, lightOffsets, cumLightPower, bounds, seed );
+	
+	// bounce until the maximum depth is reached
+	for(int d=0; d<=depth; d++)
+	{
+		if( !bounce( DEBUG_ARG, &r, &rad, &spectrum, &rnd, d, power, irradiance, detectors, measurementBits, np, ninfp, prims, offsets, root, bvh, shaders, channels, ns, sensors, sensor_root, sensorBvh, depth, minPower, sensitivityCurves ) )
+			break;
+	}
+}
+
 __kernel void compute( DEBUG_PAR ,
 	int nthreads,
 	int sampleOffset,
@@ -50,7 +264,7 @@ __kernel void compute( DEBUG_PAR ,
 	int ns,
 	__global Sensor *sensors,
 	int sensor_root,
-	__global BVHNode *sensorBvh,
+	__global BVHTraceNode *sensorBvh,
 	// params
 	int depth,
 	float minPower,
@@ -64,106 +278,397 @@ __kernel void compute( DEBUG_PAR ,
 	if( idx >= nthreads )
 		return;
 		
-	idx += sampleOffset;
-	
-	Random rnd;
-	initRandom( &rnd, idx, seed );
-	
-	// spectrum sampling
+	tracePath( DEBUG_ARG, idx + sampleOffset, nsamples, power, irradiance, detectors, measurementBits, np, ninfp, prims, offsets, root, bvh, shaders, channels, nl, lights, lightOffsets, cumLightPower, ns, sensors, sensor_root, sensorBvh, depth, minPower, &bounds, sensitivityCurves, seed );
+}
+
+#ifdef PERSISTENT_THREADS
+
+/*
+	Persistent threads (-D PERSISTENT_THREADS) : a fixed number of work-groups, sized to fill the compute units of the
+	device, is launched once. Each work-item fetches the next PERSISTENT_BATCH paths from a global counter, traces them
+	and fetches again until the nthreads paths are taken, so the work-items done with short paths keep tracing instead
+	of idling until the longest paths of the launch end.
+*/
+
+#ifndef PERSISTENT_BATCH
+	#define PERSISTENT_BATCH 4				// paths fetched by one atomic
+#endif
+
+__kernel void computePersistent( DEBUG_PAR ,
+	int nthreads,
+	int sampleOffset,
+	int nsamples,
+	__global int *pathCounter,
+	// output buffers
+	__global Measurement *power,
+	__global Measurement *irradiance,
+	// detectors
+	__global Detector *detectors,
+	int measurementBits,
+	// scene
+	int np , int ninfp ,
+	__global char *prims,
+	__global int *offsets,
+	int root,
+	__global char *bvh,
+	__global char *shaders,
+	__global char *channels,
+	int nl,
+	__global char *lights,
+	__global int *lightOffsets,
+	__global float *cumLightPower,
+	int skyOffset,
+	// sensors
+	int ns,
+	__global Sensor *sensors,
+	int sensor_root,
+	__global BVHTraceNode *sensorBvh,
+	// params
+	int depth,
+	float minPower,
+	SphereVolume bounds,
+	__global MeasurementSensitivityCurve *sensitivityCurves,
+	int seed
+	)
+{
+	for(;;)
+	{
+		const int first = atomic_add( pathCounter, PERSISTENT_BATCH );
+		if( first >= nthreads )
+			return;
+		
+		const int last = min( first + PERSISTENT_BATCH, nthreads );
+		for( int idx = first ; idx < last ; idx++ )
+			tracePath( DEBUG_ARG, idx + sampleOffset, nsamples, power, irradiance, detectors, measurementBits, np, ninfp, prims, offsets, root, bvh, shaders, channels, nl, lights, lightOffsets, cumLightPower, ns, sensors, sensor_root, sensorBvh, depth, minPower, &bounds, sensitivityCurves, seed );
+	}
+}
+
+#endif
+
+#if defined(RAY_SORTING) || defined(WAVEFRONT)
+
+// state of a path between two bounces
+typedef struct
+{
+	Ray r;
+	Spectrum rad;
 	Spectrum spectrum;
-	SampleUnitSpectum( &spectrum, &rnd );
-	//SampleSpectrum( &spectrum, &rnd );
+	Random rnd;
+	int alive;
+}PathState;
+
+__kernel void pathStateSize( DEBUG_PAR , __global int *size )
+{
+	*size = sizeof( PathState );
+}
+
+__kernel void generatePaths( DEBUG_PAR ,
+	int nthreads,
+	int sampleOffset,
+	int nsamples,
+	int nl,
+	__global char *lights,
+	__global int *lightOffsets,
+	__global float *cumLightPower,
+	SphereVolume bounds,
+	int seed,
+	__global PathState *paths,
+	__global int *pathQueue
+	)
+{
+	unsigned int idx = get_global_id(0);
 	
-	// select a light source proportional to light power
-	// all threads are stratified over all light sources
-	float cumpower = (float)(idx + random1f(&rnd)) / (float)nsamples;
+	if( idx >= nthreads )
+		return;
 	
-	float lprob; // sample probabilitiy
-	__global Light* light = sampleLightSource( &lprob, cumpower, nl, lights, lightOffsets, cumLightPower );
+	PathState path;
+	startPath( DEBUG_ARG, &path.r, &path.rad, &path.spectrum, &path.rnd, idx + sampleOffset, nsamples, nl, lights, lightOffsets, cumLightPower, &bounds, seed );
+	path.alive = 1;
 	
-	Ray r;
-	Spectrum rad;
+	paths[idx] = path;
+	pathQueue[idx] = idx;
+}
 
-	// generate a random ray from that light source
-	GenerateLight(DEBUG_ARG, &r, &rad, &spectrum, light, &rnd, &bounds, lights, lights );
+#endif
 
-	// correct for light selection probability
-	specsmul( &rad, &rad, invSafe(lprob) );
+#ifdef RAY_SORTING
+
+/*
+	Coherence sorted launch (-D RAY_SORTING) : the paths are traced bounce by bounce, their state is kept in a buffer
+	between two bounces. Before each bounce, the queue of the paths still alive is sorted by a key made of the Morton
+	code of the ray origin in the scene bounds and of the octant of its direction, so that neighbouring work-items
+	trace neighbouring rays of similar directions. Each work-item reads and writes back the state of its path by index.
+*/
+
+#define RAY_SORT_MORTON_BITS 9					// bits per axis of the origin, 27 bits plus 3 bits of octant
+#define RAY_SORT_DEAD_KEY 0xFFFFFFFFu			// ended paths sort after the living ones
+
+__kernel void pathKeys( DEBUG_PAR ,
+	int n,
+	const __global int *pathQueue,
+	const __global PathState *paths,
+	SphereVolume bounds,
+	__global uint *keys
+	)
+{
+	int idx = get_global_id(0);
 	
-	// bounce until the maximum depth is reached
-	for(int d=0; d<=depth; d++)
+	if( idx >= n )
+		return;
+	
+	const __global PathState *path = &paths[pathQueue[idx]];
+	if( !path->alive )
 	{
-		// compute first intersection between ray and scene
-		Intc intc;
-		intc_init( &intc , FLT_MAX , 0);
-		
-		trace( DEBUG_ARG, &intc, &r, np, ninfp, prims, offsets, bvh, root, false );
-		
+		keys[idx] = RAY_SORT_DEAD_KEY;
+		return;
+	}
+	
+	// origin in the bounding cube of the scene sphere
+	const float scale = 0.5f * invSafe( bounds.radius );
+	const float x = (path->r.o.x - bounds.p.x) * scale + 0.5f;
+	const float y = (path->r.o.y - bounds.p.y) * scale + 0.5f;
+	const float z = (path->r.o.z - bounds.p.z) * scale + 0.5f;
+	
+	const uint octant = (path->r.d.x < 0.f ? 4 : 0) | (path->r.d.y < 0.f ? 2 : 0) | (path->r.d.z < 0.f ? 1 : 0);
+	keys[idx] = (morton3D( x, y, z, RAY_SORT_MORTON_BITS ) << 3) | octant;
+}
+
+__kernel void bouncePaths( DEBUG_PAR ,
+	int n,
+	int d,
+	const __global int *pathQueue,
+	__global PathState *paths,
+	__global int *alive,
+	// output buffers
+	__global Measurement *power,
+	__global Measurement *irradiance,
+	// detectors
+	__global Detector *detectors,
+	int measurementBits,
+	// scene
+	int np , int ninfp ,
+	__global char *prims,
+	__global int *offsets,
+	int root,
+	__global char *bvh,
+	__global char *shaders,
+	__global char *channels,
+	// sensors
+	int ns,
+	__global Sensor *sensors,
+	int sensor_root,
+	__global BVHTraceNode *sensorBvh,
+	// params
+	int depth,
+	float minPower,
+	__global MeasurementSensitivityCurve *sensitivityCurves
+	)
+{
+	int idx = get_global_id(0);
+	
+	if( idx >= n )
+		return;
+	
+	const int pathIdx = pathQueue[idx];
+	PathState path = paths[pathIdx];
+	
+	path.alive = bounce( DEBUG_ARG, &path.r, &path.rad, &path.spectrum, &path.rnd, d, power, irradiance, detectors, measurementBits, np, ninfp, prims, offsets, root, bvh, shaders, channels, ns, sensors, sensor_root, sensorBvh, depth, minPower, sensitivityCurves );
+	if( path.alive )
+		atomic_inc( alive );
+	
+	paths[pathIdx] = path;
+}
+
+#endif
+
+#ifdef WAVEFRONT
+
+/*
+	Wavefront pipeline (-D WAVEFRONT) : the bounce of the megakernel is split into one kernel per stage, run over
+	queues of path indices. Each bounce extends the queued paths to their closest hit, appending the hits to a hit
+	queue, accumulates the sensed irradiance on the traced segments, shades the hits and appends the paths still alive
+	to the queue of the next bounce, then accumulates the absorbed power. The queue lengths are counters updated with
+	atomics on the device, a stage is launched on the length of the previous queue and its work-items past the counter
+	return at once, so the host only reads the counters back once per bounce.
+*/
+
+#define WAVEFRONT_QUEUED 0		// counters : paths of the bounce, hits, paths of the next bounce
+#define WAVEFRONT_HITS 1
+#define WAVEFRONT_NEXT 2
+
+// closest hit of a path, the primitive is kept as a byte offset since buffer addresses may change between launches
+typedef struct
+{
+	float t;
+	int prim;			// byte offset of the hit primitive in prims, -1 for a miss
+	int instance;		// byte offset of its instance (-D BVH_INSTANCES), -1 outside instances
+	int tri;			// triangle of an indexed mesh (-D INDEXED_MESHES)
+	Vec2 uv;			// uv or side of the intersection
+	Spectrum absorbed;	// power absorbed by the hit, and where it is accumulated
+	int measurementIdx;
+}PathHit;
+
+__kernel void pathHitSize( DEBUG_PAR , __global int *size )
+{
+	*size = sizeof( PathHit );
+}
+
+inline void storeHit( __global PathHit *hit, const Intc *intc, const __global char *prims )
+{
+	hit->t = intc->t;
+	hit->prim = intc->prim != 0 ? (const __global char*)intc->prim - prims : -1;
+	hit->uv = intc->uv;
+#ifdef BVH_INSTANCES
+	hit->instance = intc->instance != 0 ? (const __global char*)intc->instance - prims : -1;
+#endif
+#ifdef INDEXED_MESHES
+	hit->tri = intc->tri;
+#endif
+}
+
+inline void loadHit( Intc *intc, const __global PathHit *hit, const __global char *prims )
+{
+	intc_init( intc, hit->t, (const __global Prim*)(prims + hit->prim) );
+	intc->uv = hit->uv;
+#ifdef BVH_INSTANCES
+	if( hit->instance >= 0 )
+		intc->instance = (const __global Prim*)(prims + hit->instance);
+#endif
+#ifdef INDEXED_MESHES
+	intc->tri = hit->tri;
+#endif
+}
+
+// extend stage : closest hit of each queued path
+__kernel void extendPaths( DEBUG_PAR ,
+	__global int *counters,
+	const __global int *pathQueue,
+	const __global PathState *paths,
+	__global PathHit *hits,
+	__global int *hitQueue,
+	// scene
+	int np , int ninfp ,
+	__global char *prims,
+	__global int *offsets,
+	int root,
+	__global char *bvh
+	)
+{
+	int idx = get_global_id(0);
+	
+	if( idx >= counters[WAVEFRONT_QUEUED] )
+		return;
+	
+	const int pathIdx = pathQueue[idx];
+	Ray r = paths[pathIdx].r;
+	
+	Intc intc;
+	intc_init( &intc , FLT_MAX , 0);
+	trace( DEBUG_ARG, &intc, &r, np, ninfp, prims, offsets, bvh, root, false );
+	
+	storeHit( &hits[pathIdx], &intc, prims );
+	if( intc.prim != 0 )
+		hitQueue[atomic_inc( &counters[WAVEFRONT_HITS] )] = pathIdx;
+}
+
+// sensor stage : irradiance sensed on the segment of each queued path, up to its hit
+__kernel void senseSegments( DEBUG_PAR ,
+	const __global int *counters,
+	const __global int *pathQueue,
+	const __global PathState *paths,
+	const __global PathHit *hits,
+	int d,
+	// output buffers
+	__global Measurement *irradiance,
+	// detectors
+	__global Detector *detectors,
+	int measurementBits,
+	// sensors
+	int ns,
+	__global Sensor *sensors,
+	int sensor_root,
+	__global BVHTraceNode *sensorBvh,
+	__global MeasurementSensitivityCurve *sensitivityCurves
+	)
+{
 #ifdef ENABLE_SENSORS
-		// find all sensors on the unintersected line segment and accumulate irradiance
-		traceSensor( DEBUG_ARG, irradiance, detectors, sensitivityCurves, d, measurementBits, &rad, &spectrum, intc.t, &r, ns, sensors, sensorBvh, sensor_root );
+	int idx = get_global_id(0);
+	
+	if( idx >= counters[WAVEFRONT_QUEUED] )
+		return;
+	
+	const int pathIdx = pathQueue[idx];
+	Ray r = paths[pathIdx].r;
+	Spectrum rad = paths[pathIdx].rad;
+	const Spectrum spectrum = paths[pathIdx].spectrum;
+	
+	traceSensor( DEBUG_ARG, irradiance, detectors, sensitivityCurves, d, measurementBits, &rad, &spectrum, hits[pathIdx].t, &r, ns, sensors, sensorBvh, sensor_root );
 #endif
-		
-		// stop when the ray missed the scene
-		if( intc.prim == 0 )
-			return;
-		
-		const __global Prim *prim = intc.prim;
-		
-		// load intersection data
-		Environment env;
-		computeIntersectEnv( DEBUG_ARG, &env, &spectrum, &intc, &r, shaders );
-				
-		Vec3 refl_out;
-		Spectrum refl_bsdf;
-		
-		// sample outgoing direction
-		SampleBSDF( &refl_out, &refl_bsdf, &spectrum, &env, &r.d, channels, true, &rnd );
-
-		// compute new radiance after reflection
-		Spectrum new_rad;
-		specmul( &new_rad, &rad, &refl_bsdf );
-				
-		// compute absorbed power
-		Spectrum absorbed;
-		specsub( &absorbed, &rad, &new_rad );
-
-		// don't clamp the absorbed power! 
-		// due to probabilistic nature of BSDF sampling, the absorbed power may be negative
-		// clamping would bias the net absorbed power
-				
-		//specone( &absorbed );
-		//specsmul( &absorbed, &absorbed, 100.f );
-				
-		// accumulate absorbed power
-		int measurementIdx = GetMeasurementIdx( detectors, d, measurementBits, prim->group_idx );
-		AtomicAddSpectrum( &power[measurementIdx], &absorbed, &spectrum, sensitivityCurves );
-		//AddSpectrum( &power[measurementIdx], &absorbed, &spectrum, sensitivityCurves );
-		
-		// check if radiance power is big enough for reflection
-		if( specsum( &new_rad ) < minPower )
-			break;
+}
 
-#ifdef RUSSIAN_ROULETTE
-		if( depth >= RUSSIAN_ROULETTE_DEPTH )
-		{
-			// Russian roulette performs importance sampling with respect to path length
-			
-			// compute reflection probability
-			float pbrRussian = clamp( specsum( &new_rad ) / SPECTAL_CHANNELS, 0.f, 1.f);
-			
-			// russian roulette
-			if( random1f( &rnd ) >= pbrRussian )
-				break;
-			
-			// correct radiance accordingly
-			specsmul( &new_rad, &new_rad, invSafe(pbrRussian) );
-		}
-#endif	
-			
-		// set reflection ray
-		rad = new_rad;		
-		rinit( &r, &env.p, &refl_out );
-		rmarch( &r.o, SCATTER_EPSILON, &r );
-	}
+// shade stage : absorbed power and reflected ray of each hit, the paths still alive are queued for the next bounce
+__kernel void shadePaths( DEBUG_PAR ,
+	__global int *counters,
+	const __global int *hitQueue,
+	__global PathState *paths,
+	__global PathHit *hits,
+	__global int *nextQueue,
+	int d,
+	// detectors
+	__global Detector *detectors,
+	int measurementBits,
+	// scene
+	__global char *prims,
+	__global char *shaders,
+	__global char *channels,
+	// params
+	int depth,
+	float minPower
+	)
+{
+	int idx = get_global_id(0);
+	
+	if( idx >= counters[WAVEFRONT_HITS] )
+		return;
+	
+	const int pathIdx = hitQueue[idx];
+	PathState path = paths[pathIdx];
+	
+	Intc intc;
+	loadHit( &intc, &hits[pathIdx], prims );
+	
+	Spectrum absorbed;
+	path.alive = scatter( DEBUG_ARG, &path.r, &path.rad, &absorbed, &path.spectrum, &path.rnd, &intc, shaders, channels, depth, minPower );
+	
+	hits[pathIdx].absorbed = absorbed;
+	hits[pathIdx].measurementIdx = GetMeasurementIdx( detectors, d, measurementBits, intc_owner( &intc )->group_idx );
+	
+	paths[pathIdx] = path;
+	if( path.alive )
+		nextQueue[atomic_inc( &counters[WAVEFRONT_NEXT] )] = pathIdx;
 }
+
+// accumulate stage : power absorbed by each hit
+__kernel void accumulatePaths( DEBUG_PAR ,
+	const __global int *counters,
+	const __global int *hitQueue,
+	const __global PathState *paths,
+	const __global PathHit *hits,
+	// output buffers
+	__global Measurement *power,
+	__global MeasurementSensitivityCurve *sensitivityCurves
+	)
+{
+	int idx = get_global_id(0);
+	
+	if( idx >= counters[WAVEFRONT_HITS] )
+		return;
+	
+	const int pathIdx = hitQueue[idx];
+	const Spectrum absorbed = hits[pathIdx].absorbed;
+	const Spectrum spectrum = paths[pathIdx].spectrum;
+	
+	AtomicAddSpectrum( &power[hits[pathIdx].measurementIdx], &absorbed, &spectrum, sensitivityCurves );
+}
+
+#endif
@@ -0,0 +1,112 @@
+#include "util/debug.h"
+
+/*
+	Stable LSD radix sort of (key, value) pairs, RADIX_BITS bits per pass.
+
+	Each work-item of a pass owns a contiguous chunk of the input. The histograms are stored digit major
+	(hist[digit * nitems + item]), so their exclusive scan gives every work-item the output position of
+	its first element of each digit while keeping the input order of equal digits.
+	Only plain global memory and barriers are used, so it also runs on CPU runtimes.
+*/
+
+#define RADIX_BITS 4
+#define RADIX_DIGITS (1 << RADIX_BITS)
+#define RADIX_MASK (RADIX_DIGITS - 1)
+
+__kernel void radixHistogram( DEBUG_PAR ,
+	int n,
+	int chunk,
+	int shift,
+	const __global uint *keys,
+	__global int *hist
+	)
+{
+	int item = get_global_id(0);
+	int nitems = get_global_size(0);
+
+	int count[RADIX_DIGITS];
+	for( int d = 0 ; d < RADIX_DIGITS ; d++ )
+		count[d] = 0;
+
+	int begin = min( item * chunk, n );
+	int end = min( begin + chunk, n );
+	for( int i = begin ; i < end ; i++ )
+		count[(keys[i] >> shift) & RADIX_MASK]++;
+
+	for( int d = 0 ; d < RADIX_DIGITS ; d++ )
+		hist[d * nitems + item] = count[d];
+}
+
+// exclusive scan of size ints, run by a single work-group
+__kernel void radixScan( DEBUG_PAR ,
+	int size,
+	__global int *data,
+	__local int *sums
+	)
+{
+	int lid = get_local_id(0);
+	int lsize = get_local_size(0);
+
+	// each work-item scans a contiguous segment
+	int segment = (size + lsize - 1) / lsize;
+	int begin = min( lid * segment, size );
+	int end = min( begin + segment, size );
+
+	int sum = 0;
+	for( int i = begin ; i < end ; i++ )
+		sum += data[i];
+	sums[lid] = sum;
+
+	barrier( CLK_LOCAL_MEM_FENCE );
+
+	// scan the segment sums
+	if( lid == 0 )
+	{
+		int acc = 0;
+		for( int i = 0 ; i < lsize ; i++ )
+		{
+			int s = sums[i];
+			sums[i] = acc;
+			acc += s;
+		}
+	}
+
+	barrier( CLK_LOCAL_MEM_FENCE );
+
+	int acc = sums[lid];
+	for( int i = begin ; i < end ; i++ )
+	{
+		int v = data[i];
+		data[i] = acc;
+		acc += v;
+	}
+}
+
+__kernel void radixScatter( DEBUG_PAR ,
+	int n,
+	int chunk,
+	int shift,
+	const __global uint *keysIn,
+	const __global int *valuesIn,
+	const __global int *hist,
+	__global uint *keysOut,
+	__global int *valuesOut
+	)
+{
+	int item = get_global_id(0);
+	int nitems = get_global_size(0);
+
+	int pos[RADIX_DIGITS];
+	for( int d = 0 ; d < RADIX_DIGITS ; d++ )
+		pos[d] = hist[d * nitems + item];
+
+	int begin = min( item * chunk, n );
+	int end = min( begin + chunk, n );
+	for( int i = begin ; i < end ; i++ )
+	{
+		uint key = keysIn[i];
+		int dst = pos[(key >> shift) & RADIX_MASK]++;
+		keysOut[dst] = key;
+		valuesOut[dst] = valuesIn[i];
+	}
+}
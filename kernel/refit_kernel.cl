@@ -0,0 +1,121 @@
+#include "util/debug.h"
+
+#include "geo/prim.h"
+#include "geo/polygon.h"
+#include "trace/bvh/bvh.h"
+#include "trace/bvh/fit.h"
+
+/*
+	BVH refit, the topology of the tree is kept and the bounds are recomputed from the
+	vertices of the primitives. Used between simulation steps when the geometry moves but
+	the primitives stay the same.
+*/
+
+// recompute the AABB of each triangle from its vertices
+__kernel void updatePrimBounds( DEBUG_PAR ,
+	int np,
+	__global char *prims,
+	const __global int *offsets
+	)
+{
+	int idx = get_global_id(0);
+	if( idx >= np )
+		return;
+
+	__global Polygon *poly = (__global Polygon*)(prims + offsets[idx]);
+	if( (poly->base.type & PRIM_NOP_MASK) != PRIM_TRIANGLE )
+		return;
+
+	const Vec3 v0 = poly->vert0;
+	const Vec3 v1 = poly->vert1;
+	const Vec3 v2 = poly->vert2;
+
+	AABB b;
+	b.x0 = min( v0.x, min( v1.x, v2.x ) ); b.x1 = max( v0.x, max( v1.x, v2.x ) );
+	b.y0 = min( v0.y, min( v1.y, v2.y ) ); b.y1 = max( v0.y, max( v1.y, v2.y ) );
+	b.z0 = min( v0.z, min( v1.z, v2.z ) ); b.z1 = max( v0.z, max( v1.z, v2.z ) );
+	poly->base.aabb = b;
+}
+
+// one work-item per leaf, flags must be zero initialized
+__kernel void refitBVH( DEBUG_PAR ,
+	int nleaves,
+	const __global int *leaves,
+	const __global char *prims,
+	const __global int *offsets,
+	__global BVHNode *bvh,
+	const __global int *parents,
+	__global int *flags
+	)
+{
+	int k = get_global_id(0);
+	if( k >= nleaves )
+		return;
+
+	fitLeaf( leaves[k], prims, offsets, bvh, parents, flags );
+}
+
+/*
+	SAH cost of the tree, relative to the root area. Every node adds its area weighted by the
+	traversal cost (branch) or by the intersection cost of its primitives (leaf). The area of a
+	node is read from the box stored in its parent, the root box is the union of its children.
+	Each work-group writes its partial sum, the host adds them up.
+*/
+__kernel void computeSAHCost( DEBUG_PAR ,
+	int nnodes,
+	int root,
+	float traversalCost,
+	float intersectionCost,
+	const __global BVHNode *bvh,
+	const __global int *parents,
+	__global float *partial,
+	__global float *rootArea,
+	__local float *scratch
+	)
+{
+	int n = get_global_id(0);
+	int lid = get_local_id(0);
+	int lsize = get_local_size(0);
+
+	float cost = 0.f;
+	if( n < nnodes )
+	{
+		int parent = parents[n];
+		AABB b;
+		bool leaf;
+
+		if( parent < 0 )
+		{
+			// root
+			leaf = root < 0;
+			b = loadChildBounds( &bvh[n], 0 );
+			if( !leaf )
+			{
+				AABB b1 = loadChildBounds( &bvh[n], 1 );
+				aabbMerge( &b, &b1 );
+			}
+			*rootArea = aabbArea( &b );
+		}
+		else
+		{
+			int side = (bvh[parent].c0idx == n || bvh[parent].c0idx == -n - 1) ? 0 : 1;
+			leaf = (side == 0 ? bvh[parent].c0idx : bvh[parent].c1idx) < 0;
+			b = loadChildBounds( &bvh[parent], side );
+		}
+
+		cost = aabbArea( &b ) * (leaf ? intersectionCost * bvh[n].pcount : traversalCost);
+	}
+
+	scratch[lid] = cost;
+
+	// reduce the work-group
+	for( int stride = lsize >> 1 ; stride > 0 ; stride >>= 1 )
+	{
+		barrier( CLK_LOCAL_MEM_FENCE );
+		if( lid < stride )
+			scratch[lid] += scratch[lid + stride];
+	}
+
+	if( lid == 0 )
+		partial[get_group_id(0)] = scratch[0];
+}
@@ -36,7 +36,7 @@ typedef struct
 {
 	float tMin, tMax;
 	int nodeAddr;
-}Stack;
+}BIHStack;
 
 void bihTrace( DEBUG_PAR,
 	Intc *intc, 
@@ -48,7 +48,7 @@ void bihTrace( DEBUG_PAR,
 	int root,
 	bool shadowRay )
 {
-	Stack traversalStack[RAY_RESULT_POS+1];
+	BIHStack traversalStack[RAY_RESULT_POS+1];
 	
 	//-----------------------------------------------------
 	// Traversal init
@@ -88,10 +88,13 @@ void bihTrace( DEBUG_PAR,
 			{
 			case 0:
 				o = r->o.x; id = aux->idir.x;
+				break;
 			case 1:
 				o = r->o.y; id = aux->idir.y;
-			case 2:
+				break;
+			default:
 				o = r->o.z; id = aux->idir.z;
+				break;
 			};
 			
 			float tNear = (bih[nodeAddr].left - o) * id;
@@ -160,7 +163,7 @@ void bihTrace( DEBUG_PAR,
 			// Ray-primitive intersections
 			//---------------------------------------------------------
 			
-			if( computeIntersect( DEBUG_ARG, intc, primAddr, primCount, prims, offsets, r, aux, shadowRay ) )
+			if( computeLeafIntersect( DEBUG_ARG, intc, primAddr, primCount, prims, offsets, r, aux, shadowRay ) )
 			{
 				// Terminate for shadow ray intersection
 				return;
@@ -0,0 +1,92 @@
+#ifndef _BVH_FIT_H
+#define _BVH_FIT_H
+
+#include "geo/prim.h"
+#include "trace/bvh/bvh.h"
+
+/*
+	Bottom-up fitting of the child bounds of a BVH, shared by the device build and the refit.
+	The topology is given by the parent of each node (-1 for the root). A leaf keeps the
+	bounds of its primitives in its own left box slot, branches store the box of each child.
+*/
+
+inline void storeChildBounds( volatile __global BVHNode *node, int side, const AABB *b )
+{
+	if( side == 0 )
+	{
+		node->n0xy = (float4)(b->x0, b->x1, b->y0, b->y1);
+		node->nz.x = b->z0;
+		node->nz.y = b->z1;
+	}
+	else
+	{
+		node->n1xy = (float4)(b->x0, b->x1, b->y0, b->y1);
+		node->nz.z = b->z0;
+		node->nz.w = b->z1;
+	}
+}
+
+inline AABB loadChildBounds( const volatile __global BVHNode *node, int side )
+{
+	float4 xy = side == 0 ? node->n0xy : node->n1xy;
+	float4 z = node->nz;
+
+	AABB b;
+	b.x0 = xy.x; b.x1 = xy.y;
+	b.y0 = xy.z; b.y1 = xy.w;
+	b.z0 = side == 0 ? z.x : z.z;
+	b.z1 = side == 0 ? z.y : z.w;
+	return b;
+}
+
+/*
+	Fit the leaf node and walk up to the root. Each work-item stores the bounds of its node in
+	the parent, the second work-item to reach a parent (counted with an atomic flag) merges
+	both children and continues upwards. flags must be zero initialized.
+*/
+inline void fitLeaf( int node,
+	const __global char *prims,
+	const __global int *offsets,
+	__global BVHNode *bvh,
+	const __global int *parents,
+	__global int *flags
+	)
+{
+	// bounds of the primitives of the leaf
+	int first = bvh[node].idx;
+	int count = bvh[node].pcount;
+
+	AABB b = ((const __global Prim*)(prims + offsets[first]))->aabb;
+	for( int p = first + 1 ; p < first + count ; p++ )
+	{
+		AABB pb = ((const __global Prim*)(prims + offsets[p]))->aabb;
+		aabbMerge( &b, &pb );
+	}
+	storeChildBounds( &bvh[node], 0, &b );
+
+	int encoded = -node - 1;
+	int parent = parents[node];
+
+	while( parent >= 0 )
+	{
+		volatile __global BVHNode *p = &bvh[parent];
+		int side = (p->c0idx == encoded) ? 0 : 1;
+
+		storeChildBounds( p, side, &b );
+		write_mem_fence( CLK_GLOBAL_MEM_FENCE );
+
+		// the first work-item to arrive stops, its sibling has not been fitted yet
+		if( atomic_inc( &flags[parent] ) == 0 )
+			return;
+
+		read_mem_fence( CLK_GLOBAL_MEM_FENCE );
+
+		AABB sb = loadChildBounds( p, 1 - side );
+		aabbMerge( &b, &sb );
+
+		encoded = parent;
+		parent = parents[parent];
+	}
+}
+
+#endif
@@ -0,0 +1,106 @@
+#ifndef _QBVH_H
+#define _QBVH_H
+
+#include "trace/bvh/bvh.h"
+
+/*
+	Quantized BVH node (-D BVH_QUANTIZED=8 or -D BVH_QUANTIZED=16).
+
+	Same topology as BVHNode, but the two child boxes are stored as 8 or 16 bit integers in the
+	frame of the node : a box plane is origin + q * 2^e on each axis. The host rounds the lower
+	planes down and the upper planes up, so the decoded boxes always contain the exact ones.
+	A leaf only uses idx and pcount. The node is 36 (8 bit) or 48 (16 bit) bytes instead of 64.
+*/
+
+/*
+	Implicit left child (-D BVH_IMPLICIT_LEFT).
+
+	The nodes are laid out depth first and the left child of a branch is the next node. The first
+	child slot of cnodes holds the right child and the second one the node flags, BVH_LEFT_LEAF when
+	the left child is a leaf and the split axis in BVH_AXIS_MASK.
+*/
+
+#define BVH_LEFT_LEAF 0x1
+#define BVH_AXIS_SHIFT 1
+#define BVH_AXIS_MASK 0x6
+
+#ifdef BVH_IMPLICIT_LEFT
+	// child addresses (x left, y right) and flags (z) of a branch
+	inline int4 bvhChildren( int nodeAddr, int right, int flags )
+	{ return (int4)( (flags & BVH_LEFT_LEAF) ? -(nodeAddr + 1) - 1 : nodeAddr + 1, right, flags, 0 ); }
+#else
+	inline int4 bvhChildren( int nodeAddr, int c0idx, int c1idx )
+	{ return (int4)( c0idx, c1idx, 0, 0 ); }
+#endif
+
+#ifdef BVH_QUANTIZED
+
+#if defined(BVH4) || defined(BVH8)
+	#error "The quantized nodes are only available for the binary BVH"
+#endif
+
+#if BVH_QUANTIZED == 8
+	typedef uchar qbvh_t;
+#else
+	typedef ushort qbvh_t;
+#endif
+
+typedef struct
+{
+	float ox, oy, oz;		// origin of the node frame (lower corner of the node)
+	char ex, ey, ez;		// scale exponent of each axis
+	char pad;
+	qbvh_t q[12];			// child 0 x0,x1,y0,y1,z0,z1 then child 1, in units of the scale
+
+	union {
+		struct {
+			int c0idx, c1idx;
+		};
+		struct {
+			int idx, pcount;
+		};
+	};
+}QBVHNode;
+
+typedef QBVHNode BVHTraceNode;
+
+// exact power of two of a biased float exponent
+inline float qbvhScale( char e )
+{ return as_float( ((int)e + 127) << 23 ); }
+
+// decode the node in the BVHNode box layout
+inline int4 bvhFetchNode( const __global BVHTraceNode *bvh, int nodeAddr, float4 *n0xy, float4 *nz, float4 *n1xy )
+{
+	const __global QBVHNode *node = &bvh[nodeAddr];
+
+	const float ox = node->ox, oy = node->oy, oz = node->oz;
+	const float sx = qbvhScale( node->ex );
+	const float sy = qbvhScale( node->ey );
+	const float sz = qbvhScale( node->ez );
+
+	*n0xy = (float4)(ox + node->q[0] * sx, ox + node->q[1] * sx, oy + node->q[2] * sy, oy + node->q[3] * sy);
+	*n1xy = (float4)(ox + node->q[6] * sx, ox + node->q[7] * sx, oy + node->q[8] * sy, oy + node->q[9] * sy);
+	*nz = (float4)(oz + node->q[4] * sz, oz + node->q[5] * sz, oz + node->q[10] * sz, oz + node->q[11] * sz);
+
+	return bvhChildren( nodeAddr, node->c0idx, node->c1idx );
+}
+
+#else
+
+typedef BVHNode BVHTraceNode;
+
+inline int4 bvhFetchNode( const __global BVHTraceNode *bvh, int nodeAddr, float4 *n0xy, float4 *nz, float4 *n1xy )
+{
+	*n0xy = bvh[nodeAddr].n0xy;	// node0: x0,x1,y0,y1
+	*nz = bvh[nodeAddr].nz;		// node0: z0,z1, node1: z0,z1
+	*n1xy = bvh[nodeAddr].n1xy;	// node1: x0,x1,y0,y1
+	return bvhChildren( nodeAddr, bvh[nodeAddr].c0idx, bvh[nodeAddr].c1idx );
+}
+
+#endif
+
+// primitive range of a leaf : x = first primitive, y = count
+inline int2 bvhFetchLeaf( const __global BVHTraceNode *bvh, int leafAddr )
+{ return (int2)(bvh[leafAddr].idx, bvh[leafAddr].pcount); }
+
+#endif
@@ -0,0 +1,79 @@
+#ifndef _BVH_SHORT_STACK_H
+#define _BVH_SHORT_STACK_H
+
+#include "trace/bvh/bvh.h"
+#include "trace/bvh/qbvh.h"
+
+/*
+	Short traversal stack (-D BVH_SHORT_STACK=n, n entries instead of 64).
+
+	The path from the root to the current node is kept as a trail of bits, one per level, set while
+	the far child of that level is still to be visited. The stack only caches the last n far children :
+	when it overflows the oldest entry is dropped, and a dropped far child is found again by walking
+	up the parent links stored in cnodes.z (-1 for the root) and taking the sibling of the near child.
+	The trail limits the tree depth to 64 levels.
+*/
+
+#ifdef BVH_QUANTIZED
+	#error "The short stack traversal needs the parent links of the full precision nodes"
+#endif
+
+#ifdef BVH_INSTANCES
+	#error "The short stack traversal does not walk back up from an instance"
+#endif
+
+typedef struct
+{
+	int entries[BVH_SHORT_STACK];	// ring buffer of the last far children
+	int top;						// next entry
+	int count;						// cached entries, at most BVH_SHORT_STACK
+	ulong trail;					// bit 0 is the level of the current node
+}ShortStack;
+
+inline void shortStackInit( ShortStack *stack )
+{ stack->top = 0; stack->count = 0; stack->trail = 0; }
+
+// descend into a single child
+inline void shortStackDescend( ShortStack *stack )
+{ stack->trail <<= 1; }
+
+// descend into the near child, the far one is pending
+inline void shortStackPush( ShortStack *stack, int farAddr )
+{
+	stack->trail = (stack->trail << 1) | 1;
+	stack->entries[stack->top] = farAddr;
+	stack->top = (stack->top + 1) % BVH_SHORT_STACK;
+	stack->count = min( stack->count + 1, BVH_SHORT_STACK );
+}
+
+// parent of a node, nodeAddr is encoded as -index-1 for a leaf
+inline int bvhParent( const __global BVHNode *bvh, int nodeAddr )
+{ return bvh[nodeAddr < 0 ? -nodeAddr - 1 : nodeAddr].cnodes.z; }
+
+// next node to visit once the subtree of nodeAddr is done, sentinel when the traversal is over
+inline int shortStackPop( ShortStack *stack, const __global BVHNode *bvh, int nodeAddr, int sentinel )
+{
+	if( stack->trail == 0 )
+		return sentinel;
+
+	// levels up to the pending far child (trailing zeros of the trail)
+	const int up = (int)popcount( (stack->trail & (~stack->trail + 1)) - 1 );
+	stack->trail = (stack->trail >> up) ^ 1;
+
+	if( stack->count > 0 )
+	{
+		stack->top = (stack->top + BVH_SHORT_STACK - 1) % BVH_SHORT_STACK;
+		--stack->count;
+		return stack->entries[stack->top];
+	}
+
+	// dropped entry : the far child is the sibling of the near child up that many levels
+	for( int i = 0 ; i < up ; i++ )
+		nodeAddr = bvhParent( bvh, nodeAddr );
+
+	const int parentAddr = bvhParent( bvh, nodeAddr );
+	const int4 children = bvhChildren( parentAddr, bvh[parentAddr].c0idx, bvh[parentAddr].c1idx );
+	return children.x == nodeAddr ? children.y : children.x;
+}
+
+#endif
@@ -26,11 +26,16 @@
 #define _BVH_TRACE_H
 
 #include "trace/bvh/bvh.h"
+#include "trace/bvh/qbvh.h"
+#ifdef BVH_SHORT_STACK
+	#include "trace/bvh/shortstack.h"
+#endif
 #include "geo/intersect.h"
 #include "util/util.h"
 
 #define RAY_RESULT_POS		63		// steal one entry from stack (saves a register)
 #define ENTRYPOINT_SENTINEL 0x76543210
+#define INSTANCE_SENTINEL	(-0x7fffffff - 1)	// pushed when entering an instance, popped when leaving it
 
 void bvhTrace( DEBUG_PAR,
 	Intc *intc, 
@@ -38,18 +43,34 @@ void bvhTrace( DEBUG_PAR,
 	const RayAux *aux,
 	const __global char *prims,
 	const __global int *offsets,
-	const __global BVHNode *bvh,
+	const __global BVHTraceNode *bvh,
 	int root,
 	bool shadowRay )
 {
+#ifdef BVH_SHORT_STACK
+	ShortStack stack;
+	shortStackInit( &stack );
+#else
 	int traversalStack[RAY_RESULT_POS+1];
+#endif
+
+#ifdef BVH_INSTANCES
+	// r and aux are moved to the object space of the instance being traversed
+	const Ray *worldRay = r;
+	const RayAux *worldAux = aux;
+	Ray instanceRay;
+	RayAux instanceAux;
+	const __global Prim *instance = 0;
+#endif
 	
 	//-----------------------------------------------------
 	// Traversal init
 	//-----------------------------------------------------
 
+#ifndef BVH_SHORT_STACK
 	traversalStack[0] = ENTRYPOINT_SENTINEL;	// init traversal stack
 	int traversalStackPtr = 0;
+#endif
 	int nodeAddr = root;
 	
 	//------------------------------------------------------
@@ -64,11 +85,12 @@ void bvhTrace( DEBUG_PAR,
 
 		for(;nodeAddr>=0 && nodeAddr!=ENTRYPOINT_SENTINEL;)
 		{
-			// Fetch 2 child nodes (boxes + header)
-			const float4 n0xy 	= bvh[nodeAddr].n0xy;	// node0: x0,x1,y0,y1
-			const float4 nz		= bvh[nodeAddr].nz;		// node0: z0,z1, node1: z0,z1
-			const float4 n1xy 	= bvh[nodeAddr].n1xy;	// node1: x0,x1,y0,y1
-			const int4 	 cnodes = bvh[nodeAddr].cnodes;
+			// Fetch 2 child nodes (boxes + header), decoded when quantized
+			float4 n0xy, nz, n1xy;
+			const int4 	 cnodes = bvhFetchNode( bvh, nodeAddr, &n0xy, &nz, &n1xy );
+#ifdef BVH_SHORT_STACK
+			const int branchAddr = nodeAddr;
+#endif
 			
 			// Perform 2 ray-box tests
 			const float x0Child0 = n0xy.x * aux->idir.x - aux->ood.x;
@@ -111,21 +133,32 @@ void bvhTrace( DEBUG_PAR,
 			{
 				if(traverseChild1)
 					nodeAddr = nodeAddrChild1;
+#ifdef BVH_SHORT_STACK
+				shortStackDescend( &stack );
+#endif
 			}
 			else
 			{
 				if(!traverseChild0)	// Neither
 				{
+#ifdef BVH_SHORT_STACK
+					nodeAddr = shortStackPop( &stack, bvh, branchAddr, ENTRYPOINT_SENTINEL );
+#else
 					nodeAddr = traversalStack[traversalStackPtr];
 					--traversalStackPtr;
+#endif
 				}
 				else				// Both
 				{
 					if(tminChild1 < tminChild0)					// Ensure Child0 is near, Child1 is far
 						swapInt( &nodeAddr , &nodeAddrChild1 );
 
+#ifdef BVH_SHORT_STACK
+					shortStackPush( &stack, nodeAddrChild1 );
+#else
 					++traversalStackPtr;								// a separate statement thanks to 2.1 compiler shortcoming
 					traversalStack[traversalStackPtr] = nodeAddrChild1;	// push far
+#endif
 				}
 			}
 		}
@@ -136,24 +169,73 @@ void bvhTrace( DEBUG_PAR,
 
 		if(nodeAddr<0)
 		{
+#ifdef BVH_INSTANCES
+			if(nodeAddr == INSTANCE_SENTINEL)
+			{
+				// Leave the instance, back to the world ray
+				r = worldRay;
+				aux = worldAux;
+				instance = 0;
+
+				nodeAddr = traversalStack[traversalStackPtr];
+				--traversalStackPtr;
+				continue;
+			}
+#endif
+
 			// Fetch node header
-			int4 leaf = bvh[(-nodeAddr-1)].cnodes;
+			int2 leaf = bvhFetchLeaf( bvh, -nodeAddr-1 );
 			int primAddr  = leaf.x;					// stored as int
 			int primCount = leaf.y;					// stored as int
+
+#ifdef BVH_INSTANCES
+			//---------------------------------------------------------
+			// Enter instance, it is alone in its top-level leaf
+			//---------------------------------------------------------
+
+			const __global Instance *inst = (const __global Instance*)(prims + offsets[primAddr]);
+			if( (inst->base.type & PRIM_NOP_MASK) == PRIM_INSTANCE )
+			{
+				instance = &inst->base;
+				Mat34 m = inst->base.m;
+				m34rmul( &instanceRay, &m, worldRay );
+				raux( &instanceAux, &instanceRay );
+				r = &instanceRay;
+				aux = &instanceAux;
+
+				// The direction is not normalized, so t is the same in both spaces
+				++traversalStackPtr;
+				traversalStack[traversalStackPtr] = INSTANCE_SENTINEL;
+				nodeAddr = inst->root;
+				continue;
+			}
+			const float leafT = intc->t;
+#endif
 			
 			//---------------------------------------------------------
 			// Ray-primitive intersections
 			//---------------------------------------------------------
 			
-			if( computeIntersect( DEBUG_ARG, intc, primAddr, primCount, prims, offsets, r, aux, shadowRay ) )
+			const bool blocked = computeLeafIntersect( DEBUG_ARG, intc, primAddr, primCount, prims, offsets, r, aux, shadowRay );
+
+#ifdef BVH_INSTANCES
+			if( intc->t < leafT )
+				intc->instance = instance;
+#endif
+
+			if( blocked )
 			{
 				// Terminate for shadow ray intersection
 				return;
 			}
 
 			// POP stack
+#ifdef BVH_SHORT_STACK
+			nodeAddr = shortStackPop( &stack, bvh, nodeAddr, ENTRYPOINT_SENTINEL );
+#else
 			nodeAddr = traversalStack[traversalStackPtr];
 			--traversalStackPtr;
+#endif
 		}
 	}
 }
@@ -26,6 +26,10 @@
 #define _BVH_TRACE_SENSORS_H
 
 #include "trace/bvh/bvh.h"
+#include "trace/bvh/qbvh.h"
+#ifdef BVH_SHORT_STACK
+	#include "trace/bvh/shortstack.h"
+#endif
 #include "geo/sensor.h"
 #include "util/util.h"
 #include "color/color.h"
@@ -44,10 +48,15 @@ void bvhTraceSensor( DEBUG_PAR,
 	float length,
 	const Ray *r,
 	const __global Sensor *sensors,
-	const __global BVHNode *bvh,
+	const __global BVHTraceNode *bvh,
 	int root)
 {
+#ifdef BVH_SHORT_STACK
+	ShortStack stack;
+	shortStackInit( &stack );
+#else
 	int traversalStack[RAY_RESULT_POS+1];
+#endif
 	
 	//-----------------------------------------------------
 	// Fetch and init ray
@@ -65,8 +74,10 @@ void bvhTraceSensor( DEBUG_PAR,
 	// Traversal init
 	//-----------------------------------------------------
 
+#ifndef BVH_SHORT_STACK
 	traversalStack[0] = ENTRYPOINT_SENTINEL;	// init traversal stack
 	int traversalStackPtr = 0;
+#endif
 	int nodeAddr = root;
 	
 	//------------------------------------------------------
@@ -81,11 +92,12 @@ void bvhTraceSensor( DEBUG_PAR,
 
 		for(;nodeAddr>=0 && nodeAddr!=ENTRYPOINT_SENTINEL;)
 		{
-			// Fetch 2 child nodes (boxes + header)
-			const float4 n0xy 	= bvh[nodeAddr].n0xy;	// node0: x0,x1,y0,y1
-			const float4 nz		= bvh[nodeAddr].nz;		// node0: z0,z1, node1: z0,z1
-			const float4 n1xy 	= bvh[nodeAddr].n1xy;	// node1: x0,x1,y0,y1
-			const int4 	 cnodes = bvh[nodeAddr].cnodes;
+			// Fetch 2 child nodes (boxes + header), decoded when quantized
+			float4 n0xy, nz, n1xy;
+			const int4 	 cnodes = bvhFetchNode( bvh, nodeAddr, &n0xy, &nz, &n1xy );
+#ifdef BVH_SHORT_STACK
+			const int branchAddr = nodeAddr;
+#endif
 			
 			// Perform 2 ray-box tests
 			const float ood_x  = origx * idir_x;
@@ -131,18 +143,29 @@ void bvhTraceSensor( DEBUG_PAR,
 			{
 				if(traverseChild1)
 					nodeAddr = nodeAddrChild1;
+#ifdef BVH_SHORT_STACK
+				shortStackDescend( &stack );
+#endif
 			}
 			else
 			{
 				if(!traverseChild0)	// Neither
 				{
+#ifdef BVH_SHORT_STACK
+					nodeAddr = shortStackPop( &stack, bvh, branchAddr, ENTRYPOINT_SENTINEL );
+#else
 					nodeAddr = traversalStack[traversalStackPtr];
 					--traversalStackPtr;
+#endif
 				}
 				else				// Both
 				{
+#ifdef BVH_SHORT_STACK
+					shortStackPush( &stack, nodeAddrChild1 );
+#else
 					++traversalStackPtr;								// a separate statement thanks to 2.1 compiler shortcoming
 					traversalStack[traversalStackPtr] = nodeAddrChild1;	// push far
+#endif
 				}
 			}
 		}
@@ -154,7 +177,7 @@ void bvhTraceSensor( DEBUG_PAR,
 		if(nodeAddr<0)
 		{
 			// Fetch node header
-			int4 leaf = bvh[(-nodeAddr-1)].cnodes;
+			int2 leaf = bvhFetchLeaf( bvh, -nodeAddr-1 );
 			int sensorAddr  = leaf.x;					// stored as int
 			int sensorCount = leaf.y;					// stored as int
 			
@@ -164,8 +187,12 @@ void bvhTraceSensor( DEBUG_PAR,
 			computeSensorIntersects( DEBUG_ARG, irradiance_buffer, detectors, sensitivityCurves, depth, measurementBits, irradiance, spectrum, sensorAddr, sensorCount, sensors, length, r );
 			
 			// POP stack
+#ifdef BVH_SHORT_STACK
+			nodeAddr = shortStackPop( &stack, bvh, nodeAddr, ENTRYPOINT_SENTINEL );
+#else
 			nodeAddr = traversalStack[traversalStackPtr];
 			--traversalStackPtr;
+#endif
 		}
 	}
 }
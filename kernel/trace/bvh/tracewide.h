@@ -0,0 +1,110 @@
+#ifndef _WIDE_BVH_TRACE_H
+#define _WIDE_BVH_TRACE_H
+
+#include "trace/bvh/widebvh.h"
+#include "geo/intersect.h"
+#include "util/util.h"
+
+// a node pushes at most BVH_WIDTH-1 entries on top of the one it popped
+#define WIDE_STACK_SIZE (32 * (BVH_WIDTH - 1) + 1)
+
+/*
+	Traversal of a 4-wide or 8-wide BVH.
+	The boxes of all children are tested with one vector op per slab, the hit children are then
+	pushed far to near so that the nearest one is popped first. A leaf child is pushed as
+	-(node * BVH_WIDTH + slot) - 1 and its primitive range is fetched when it is popped.
+*/
+void bvhTrace( DEBUG_PAR,
+	Intc *intc,
+	const Ray *r,
+	const RayAux *aux,
+	const __global char *prims,
+	const __global int *offsets,
+	const __global WideBVHNode *bvh,
+	int root,
+	bool shadowRay )
+{
+	int traversalStack[WIDE_STACK_SIZE];
+	int traversalStackPtr = 0;
+	traversalStack[0] = 0;	// root
+
+	while(traversalStackPtr >= 0)
+	{
+		int nodeAddr = traversalStack[traversalStackPtr];
+		--traversalStackPtr;
+
+		//------------------------------------------------------
+		// Leaf
+		//------------------------------------------------------
+
+		if(nodeAddr < 0)
+		{
+			int slot = -nodeAddr - 1;
+			const __global WideBVHNode *parent = &bvh[slot / BVH_WIDTH];
+			int primAddr  = ((const __global int*)&parent->child)[slot % BVH_WIDTH];
+			int primCount = ((const __global int*)&parent->count)[slot % BVH_WIDTH];
+
+			if( computeLeafIntersect( DEBUG_ARG, intc, primAddr, primCount, prims, offsets, r, aux, shadowRay ) )
+			{
+				// Terminate for shadow ray intersection
+				return;
+			}
+			continue;
+		}
+
+		//------------------------------------------------------
+		// Inner node, test all children at once
+		//------------------------------------------------------
+
+		const __global WideBVHNode *node = &bvh[nodeAddr];
+
+		const floatw x0 = node->x0 * aux->idir.x - aux->ood.x;
+		const floatw x1 = node->x1 * aux->idir.x - aux->ood.x;
+		const floatw y0 = node->y0 * aux->idir.y - aux->ood.y;
+		const floatw y1 = node->y1 * aux->idir.y - aux->ood.y;
+		const floatw z0 = node->z0 * aux->idir.z - aux->ood.z;
+		const floatw z1 = node->z1 * aux->idir.z - aux->ood.z;
+
+		floatw tmin = max(max(min(x0, x1), min(y0, y1)), max(min(z0, z1), (floatw)(0.f)));
+		floatw tmax = min(min(max(x0, x1), max(y0, y1)), min(max(z0, z1), (floatw)(intc->t)));
+		intw traverse = (tmax >= tmin) & (node->count >= 0);
+
+		float tminChild[BVH_WIDTH];
+		int traverseChild[BVH_WIDTH];
+		vstorew( tmin, 0, tminChild );
+		vstorew( traverse, 0, traverseChild );
+
+		//------------------------------------------------------
+		// Sort the hit children by entry distance, far first
+		//------------------------------------------------------
+
+		int hitSlot[BVH_WIDTH];
+		float hitT[BVH_WIDTH];
+		int hits = 0;
+		for(int i = 0 ; i < BVH_WIDTH ; i++)
+		{
+			if(!traverseChild[i])
+				continue;
+
+			int j = hits++;
+			for(; j > 0 && hitT[j-1] < tminChild[i] ; j--)
+			{
+				hitT[j] = hitT[j-1];
+				hitSlot[j] = hitSlot[j-1];
+			}
+			hitT[j] = tminChild[i];
+			hitSlot[j] = i;
+		}
+
+		const __global int *child = (const __global int*)&node->child;
+		const __global int *count = (const __global int*)&node->count;
+		for(int i = 0 ; i < hits ; i++)
+		{
+			int s = hitSlot[i];
+			++traversalStackPtr;
+			traversalStack[traversalStackPtr] = count[s] > 0 ? -(nodeAddr * BVH_WIDTH + s) - 1 : child[s];
+		}
+	}
+}
+
+#endif
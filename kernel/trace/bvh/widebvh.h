@@ -0,0 +1,34 @@
+#ifndef _WIDE_BVH_H
+#define _WIDE_BVH_H
+
+/*
+	4-wide (-D BVH4) or 8-wide (-D BVH8) BVH node, the child boxes are stored as SoA vectors
+	so that all of them are tested at once.
+
+	For each child slot :
+	- count == 0 : branch, child is the index of the child node
+	- count > 0 : leaf, child is the first primitive and count the number of primitives
+	- count < 0 : empty slot
+	The root is always node 0.
+*/
+
+#ifdef BVH8
+	#define BVH_WIDTH 8
+	typedef float8 floatw;
+	typedef int8 intw;
+	#define vstorew vstore8
+#else
+	#define BVH_WIDTH 4
+	typedef float4 floatw;
+	typedef int4 intw;
+	#define vstorew vstore4
+#endif
+
+typedef struct
+{
+	floatw x0, x1, y0, y1, z0, z1;
+	intw child;
+	intw count;
+}WideBVHNode;
+
+#endif
@@ -19,8 +19,20 @@
 
 #define SPATIAL_STRUCTURE
 
+#if defined(BVH_INSTANCES) && (!defined(BVH) || defined(BVH4) || defined(BVH8))
+	#error "Instances are only traversed by the binary BVH"
+#endif
+
+#if defined(BVH_SHORT_STACK) && (!defined(BVH) || defined(BVH4) || defined(BVH8))
+	#error "The short stack is only used by the binary BVH traversal"
+#endif
+
 #ifdef BVH
-	#include "trace/bvh/trace.h"
+	#if defined(BVH4) || defined(BVH8)
+		#include "trace/bvh/tracewide.h"
+	#else
+		#include "trace/bvh/trace.h"
+	#endif
 #else
 	#include "trace/bih/trace.h"
 #endif
@@ -45,8 +57,10 @@ void trace( DEBUG_PAR,
 		return;
 
 #ifdef SPATIAL_STRUCTURE
-	#ifdef BVH
-		bvhTrace( DEBUG_ARG, intc, r, &aux, prims, offsets, (__global BVHNode*)bvh, root, shadowRay );
+	#if defined(BVH4) || defined(BVH8)
+		bvhTrace( DEBUG_ARG, intc, r, &aux, prims, offsets, (__global WideBVHNode*)bvh, root, shadowRay );
+	#elif defined(BVH)
+		bvhTrace( DEBUG_ARG, intc, r, &aux, prims, offsets, (__global BVHTraceNode*)bvh, root, shadowRay );
 	#else
 		bihTrace( DEBUG_ARG, intc, r, &aux, prims, offsets, (__global BIHNode*)bvh, root, shadowRay );
 	#endif
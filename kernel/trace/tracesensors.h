@@ -37,7 +37,7 @@ void traceSensor( DEBUG_PAR,
 	const Ray *r,
 	int ns ,
 	const __global Sensor *sensors,
-	const __global BVHNode *bvh,
+	const __global BVHTraceNode *bvh,
 	int root )
 {
 
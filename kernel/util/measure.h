@@ -49,7 +49,30 @@ typedef struct
 	#define NUM_SENSITIVITYSPDS 1
 #endif
 
-#ifdef SPECTRAL
+#ifdef DETERMINISTIC_ACCUMULATION
+
+	// fixed point measurements, with FIXED_POINT_BITS fraction bits (util/sync.h)
+	#if defined(SPECTRAL) && defined(MEASURE_FULL_SPECTRUM)
+		#error "The full spectrum measurements are only accumulated as floats"
+	#endif
+
+	#ifdef SPECTRAL
+	
+		typedef struct
+		{
+			long dat[NUM_SENSITIVITYSPDS];
+		}Measurement;
+		
+	#else
+	
+		typedef struct
+		{
+			long rgb[3];
+		}Measurement;
+		
+	#endif
+
+#elif defined(SPECTRAL)
 
 	#ifdef MEASURE_FULL_SPECTRUM
 		
@@ -246,6 +269,12 @@ inline void AtomicAddSpectrum( __global Measurement *measurement, const Spectrum
 			// contribute to spectrum
 			ContributeSpectrum( dat, value, &intervals );
 			
+		#elif defined(DETERMINISTIC_ACCUMULATION)
+		
+			// contribute to integrated spectra
+			for( int i = 0 ; i < NUM_SENSITIVITYSPDS ; i++ )
+				AtomicAddFixed( &measurement->dat[i], contributions[i] );
+		
 		#else
 		
 			__global float* dat = (__global float*)(&measurement->dat);
@@ -256,6 +285,13 @@ inline void AtomicAddSpectrum( __global Measurement *measurement, const Spectrum
 		
 		#endif
 		
+	#elif defined(DETERMINISTIC_ACCUMULATION)
+	
+			// contribute to color
+			AtomicAddFixed( &measurement->rgb[0], rgb.x );
+			AtomicAddFixed( &measurement->rgb[1], rgb.y );
+			AtomicAddFixed( &measurement->rgb[2], rgb.z );
+			
 	#else
 			
 			__global float* out_color = (__global float*)(&measurement->rgb);
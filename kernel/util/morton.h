@@ -0,0 +1,24 @@
+#ifndef _MORTON_H
+#define _MORTON_H
+
+// spread the lower 10 bits of v so that there are 2 zero bits between each bit
+inline uint expandBits( uint v )
+{
+	v = (v * 0x00010001u) & 0xFF0000FFu;
+	v = (v * 0x00000101u) & 0x0F00F00Fu;
+	v = (v * 0x00000011u) & 0xC30C30C3u;
+	v = (v * 0x00000005u) & 0x49249249u;
+	return v;
+}
+
+// Morton code of a point of the unit cube, on bits (at most 10) per axis
+inline uint morton3D( float x, float y, float z, int bits )
+{
+	const float cells = (float)(1 << bits);
+	x = clamp( x * cells, 0.f, cells - 1.f );
+	y = clamp( y * cells, 0.f, cells - 1.f );
+	z = clamp( z * cells, 0.f, cells - 1.f );
+	return (expandBits( (uint)x ) << 2) | (expandBits( (uint)y ) << 1) | expandBits( (uint)z );
+}
+
+#endif
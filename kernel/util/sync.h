@@ -169,6 +169,24 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 	};*/
 
 #endif
+
+#ifdef DETERMINISTIC_ACCUMULATION
+
+	// option 3 (-D DETERMINISTIC_ACCUMULATION) : the measurements are 64-bit fixed point integers. A contribution is rounded
+	// on its own before the atomic add, and integer sums don't depend on their order, so the measurements are the same
+	// whatever the scheduling of the work-items or the split of the paths over launches and devices
+	#pragma OPENCL EXTENSION cl_khr_int64_base_atomics : enable
+
+	#ifndef FIXED_POINT_BITS
+		#define FIXED_POINT_BITS 32		// fraction bits of the fixed point measurements
+	#endif
+
+	inline void AtomicAddFixed( __global long *val, const float delta )
+	{
+		atom_add( val, convert_long_sat_rte( delta * (float)(1L << FIXED_POINT_BITS) ) );
+	}
+
+#endif
 	
 
 #endif
\ No newline at end of file
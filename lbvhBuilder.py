@@ -0,0 +1,64 @@
+import sys
+import pyopencl as cl
+import pyopencl.tools
+import pyopencl.array
+import numpy as np
+import radixSort
+
+LBVH_GROUP_SIZE = 64 # Work-group size of the build kernels (power of two)
+MORTON_CODE_BITS = 30 # Must match MORTON_BITS in kernel/lbvh_kernel.cl (3 * 10 bits)
+BVH_NODE_SIZE = 64 # sizeof(BVHNode)
+
+# Round a work size up to a multiple of the work-group size
+def globalSize(n):
+    return max(1, (n + LBVH_GROUP_SIZE - 1) // LBVH_GROUP_SIZE) * LBVH_GROUP_SIZE
+
+# Linear BVH builder running on the OpenCL device (Morton codes + radix sort + Karras hierarchy)
+# It builds the primitive BVH straight from the primitive buffer already uploaded, in the BVHNode layout
+class LBVHBuilder():
+    def __init__(self, context, options) -> None:
+        kernelFile = open("kernel/lbvh_kernel.cl", "r")
+        kernelSource = kernelFile.read()
+        kernelFile.close()
+
+        self.context = context
+        self.program = cl.Program(context, kernelSource).build(options)
+        self.radixSort = radixSort.RadixSort(context, options)
+
+    # Build the BVH of nprims primitives
+    # Return the BVH buffer, the primitive offsets in leaf order, the parent of each node and the root address
+    def build(self, queue, nprims, bufPrims, bufOffsets):
+        assert nprims > 0, "Can't build a BVH without primitives."
+
+        nnodes = 2 * nprims - 1
+        mf = cl.mem_flags
+
+        bufBounds = cl.Buffer(self.context, mf.READ_WRITE | mf.COPY_HOST_PTR, hostbuf=np.array([0xFFFFFFFF] * 3 + [0] * 3, np.uint32))
+        bufCodes = cl.Buffer(self.context, mf.READ_WRITE, nprims * 4)
+        bufIndices = cl.Buffer(self.context, mf.READ_WRITE, nprims * 4)
+        bufSortedOffsets = cl.Buffer(self.context, mf.READ_WRITE, nprims * 4)
+        bufBVH = cl.Buffer(self.context, mf.READ_WRITE, nnodes * BVH_NODE_SIZE)
+        bufParents = cl.Buffer(self.context, mf.READ_WRITE, nnodes * 4)
+        bufFlags = cl.Buffer(self.context, mf.READ_WRITE, nnodes * 4)
+
+        cl.enqueue_fill_buffer(queue, bufBVH, np.int32(0), 0, nnodes * BVH_NODE_SIZE)
+        cl.enqueue_fill_buffer(queue, bufFlags, np.int32(0), 0, nnodes * 4)
+
+        n = np.int32(nprims)
+        local = (LBVH_GROUP_SIZE,)
+
+        # Morton codes of the primitive centroids in the scene bounds
+        self.program.computeSceneBounds(queue, (globalSize(nprims),), local, None, n, bufPrims, bufOffsets, bufBounds, cl.LocalMemory(6 * LBVH_GROUP_SIZE * 4))
+        self.program.computeMortonCodes(queue, (globalSize(nprims),), local, None, n, bufPrims, bufOffsets, bufBounds, bufCodes, bufIndices)
+
+        # Sort the primitives along the curve
+        self.radixSort.sort(queue, nprims, bufCodes, bufIndices, MORTON_CODE_BITS)
+        self.program.permuteOffsets(queue, (globalSize(nprims),), local, None, n, bufIndices, bufOffsets, bufSortedOffsets)
+
+        # Hierarchy and bounds
+        self.program.buildHierarchy(queue, (globalSize(nprims),), local, None, n, bufCodes, bufBVH, bufParents)
+        self.program.fitBounds(queue, (globalSize(nprims),), local, None, n, np.int32(nprims - 1), bufPrims, bufSortedOffsets, bufBVH, bufParents, bufFlags)
+
+        root = 0 if nprims > 1 else -1
+
+        return bufBVH, bufSortedOffsets, bufParents, root
@@ -0,0 +1,156 @@
+import sys
+import os
+import re
+import hashlib
+import tempfile
+import pyopencl as cl
+import numpy as np
+
+CACHE_VERSION = 1 # Bumped when the key or the layout of an entry changes
+
+INCLUDE = re.compile(r'^\s*#\s*include\s+"([^"]+)"', re.MULTILINE)
+
+# On-disk cache of the built OpenCL programs
+# An entry is the binary of a program for one device (CL_PROGRAM_BINARIES), in a file named after the hash of the kernel
+# source, of every header it includes, of the build options and of the device, driver and platform versions
+class ProgramCache():
+    def __init__(self, directory, includeDirectory = "kernel") -> None:
+        self.directory = directory
+        self.includeDirectory = includeDirectory
+        os.makedirs(directory, exist_ok=True)
+
+    # Headers included by a source, recursively. An include is looked up in the include directory (-I kernel/), then
+    # next to the file including it. The conditional includes are all followed, whatever the options
+    def headers(self, source, directory):
+        found = []
+        pending = [(source, directory)]
+        while pending:
+            text, base = pending.pop()
+            for name in INCLUDE.findall(text):
+                for path in (os.path.join(self.includeDirectory, name), os.path.join(base, name)):
+                    path = os.path.normpath(path)
+                    if os.path.isfile(path):
+                        if path not in found:
+                            found.append(path)
+                            with open(path, "r") as header:
+                                pending.append((header.read(), os.path.dirname(path)))
+                        break
+        return sorted(found)
+
+    # Key of a program : hash of its source, of its headers, of the build options and of the device
+    def key(self, source, options, device):
+        digest = hashlib.sha256()
+        digest.update(("version %d\n%s\n" % (CACHE_VERSION, options)).encode())
+        digest.update(("%s\n%s\n%s\n%s\n%s\n" % (device.name, device.vendor, device.version, device.driver_version, device.platform.version)).encode())
+        digest.update(source.encode())
+        for path in self.headers(source, self.includeDirectory):
+            with open(path, "rb") as header:
+                digest.update(path.encode())
+                digest.update(header.read())
+        return digest.hexdigest()
+
+    # Program built for the device of a context, from the cached binary when there is one
+    # A binary the driver rejects is replaced by a build from the source
+    def build(self, context, device, source, options):
+        path = os.path.join(self.directory, self.key(source, options, device) + ".bin")
+        if os.path.isfile(path):
+            with open(path, "rb") as entry:
+                binary = entry.read()
+            try:
+                return cl.Program(context, [device], [binary]).build(options)
+            except cl.Error:
+                print("Program cache : rejected binary ", path, ", building from the source")
+
+        program = cl.Program(context, source).build(options, devices=[device])
+        binary = program.get_info(cl.program_info.BINARIES)[program.get_info(cl.program_info.DEVICES).index(device)]
+
+        # Written in a temporary file and renamed, so a reader never sees a partial binary
+        handle, temp = tempfile.mkstemp(dir=self.directory)
+        with os.fdopen(handle, "wb") as entry:
+            entry.write(binary)
+        os.replace(temp, path)
+        return program
+
+    # Remove every entry
+    def clear(self):
+        for name in os.listdir(self.directory):
+            if name.endswith(".bin"):
+                os.remove(os.path.join(self.directory, name))
+
+    # Testing method : a program is stored once per source and options, reloaded from its binary, and rebuilt when the
+    # binary is rejected
+    def test(self):
+        # GPUFlux specific options
+        options = " -D MEASURE_FULL_SPECTRUM"
+        options += " -D MEASURE_MIN_LAMBDA=380"
+        options += " -D MEASURE_MAX_LAMBDA=720"
+        options += " -D MEASURE_SPECTRUM_BINS=340"
+        options += " -D SPECTRAL_WAVELENGTH_MIN=360"
+        options += " -D SPECTRAL_WAVELENGTH_MAX=830"
+        options += " -D SPECTRAL_WAVELENGTH_BINS=1"
+        options += " -D BVH"
+        options += " -D ENABLE_SENSORS"
+
+        # OpenCL config options
+        options += " -D CL_KHR_GLOBAL_INT32_BASE_ATOMICS"
+        options += " -D CL_KHR_GLOBAL_INT32_EXTENDED_ATOMICS"
+        options += " -D CL_KHR_INT64_BASE_ATOMICS"
+
+        # Directory option
+        options += " -I " + self.includeDirectory + "/"
+
+        context = cl.create_some_context()
+        queue = cl.CommandQueue(context)
+        device = context.devices[0]
+
+        kernelSource =  """
+                        #include "trace/bvh/bvh.h"
+
+                        __kernel void cacheTest(__global int* value) {
+                            value[get_global_id(0)] = (int)sizeof(BVHNode);
+                        }
+                        """
+
+        assert len(self.headers(kernelSource, self.includeDirectory)) > 0, "Error : the headers of the source were not found."
+
+        # Entries of the directory after each build
+        def entries():
+            return sorted(name for name in os.listdir(self.directory) if name.endswith(".bin"))
+
+        # Runs the test kernel of a program, the size of a BVH node is 64 bytes
+        def run(program):
+            bufValue = cl.Buffer(context, cl.mem_flags.WRITE_ONLY, 4)
+            program.cacheTest(queue, (1,), None, bufValue)
+            value = np.empty(1, np.int32)
+            cl.enqueue_copy(queue, value, bufValue)
+            assert value[0] == 64, "Error : the cached program doesn't run the test kernel."
+
+        self.clear()
+        run(self.build(context, device, kernelSource, options))
+        stored = entries()
+        assert len(stored) == 1, "Error : the built program was not stored."
+
+        # Same source and options : reloaded from the stored binary
+        run(self.build(context, device, kernelSource, options))
+        assert entries() == stored, "Error : an unchanged program was stored again."
+
+        # Other options or source : another entry
+        assert self.key(kernelSource, options + " -D CACHE_TEST", device) != self.key(kernelSource, options, device), "Error : the options are not part of the key."
+        run(self.build(context, device, kernelSource, options + " -D CACHE_TEST"))
+        assert len(entries()) == 2, "Error : a program built with other options reused the entry."
+        assert self.key(kernelSource + " ", options, device) != self.key(kernelSource, options, device), "Error : the source is not part of the key."
+
+        # A rejected binary is rebuilt from the source and replaced
+        path = os.path.join(self.directory, stored[0])
+        with open(path, "wb") as entry:
+            entry.write(b"not a binary")
+        run(self.build(context, device, kernelSource, options))
+        with open(path, "rb") as entry:
+            assert entry.read() != b"not a binary", "Error : the rejected binary was not replaced."
+
+        self.clear()
+        print("Program cache : reload, invalidation and rebuild checked")
+
+if __name__ == '__main__':
+    cache = ProgramCache(tempfile.mkdtemp())
+    cache.test()
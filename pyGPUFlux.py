@@ -1,4 +1,6 @@
 import sys
+import hashlib
+import concurrent.futures
 import pyopencl as cl
 import pyopencl.tools
 import pyopencl.array
@@ -7,10 +9,25 @@ from openalea.plantgl.all import *
 import serializer
 import lightSerializer
 import bvhBuilder
+import bihBuilder
+import lbvhBuilder
+import radixSort
+import bvhRefit
+import instanceBuilder
+import sceneCache
+import programCache
 import sensorSerializer
 import structfill
 
 SPECTRAL_WAVELENGTH_BINS = 1
+PERSISTENT_BATCH = 4 # Paths fetched at once by a persistent work-item
+PERSISTENT_GROUPS_PER_UNIT = 4 # Persistent work-groups launched per compute unit, to hide the memory latency
+MEASUREMENT_CHANNELS = 3 # Values of a Measurement, an rgb Vec3 since the kernel is built without SPECTRAL
+FIXED_POINT_BITS = 32 # Fraction bits of the fixed point measurements of the deterministic accumulation
+
+# Measurements of an output buffer : the 2^bits shuffled slots of the detectors, shifted by half of them per bounce (GetMeasurementIdx)
+def measurementCount(measurementBits, depth):
+    return (1 << int(measurementBits)) + int(depth) * (1 << (int(measurementBits) - 1))
 
 class FluxLightModel():
     def __init__(self, aScene) -> None:
@@ -23,6 +40,39 @@ class FluxLightModel():
         self.lightSerializer = lightSerializer.LightSerializer(SPECTRAL_WAVELENGTH_BINS) #Light sources serializer
         self.bvhBuilder = bvhBuilder.BVHBuilder() # Primitive Bounding Volume Hierarchy Builder and serializer
         self.sensorSerializer = sensorSerializer.SensorSerializer() #Sensor objects serializer
+        self.bihBuilder = bihBuilder.BIHBuilder() # Primitive Bounding Interval Hierarchy builder and serializer
+        self.accelerator = "bvh" # Spatial structure of the primitives : "bvh" or "bih" (built without -D BVH), the sensors always use a BVH
+        self.deviceBVH = False # Build the primitive BVH on the OpenCL device instead of the host
+        self.bvhWidth = 2 # Children per primitive BVH node : 2 (binary), 4 or 8 (-D BVH4 / -D BVH8)
+        self.bvhQuantization = 0 # Bits of the quantized BVH boxes (8 or 16, -D BVH_QUANTIZED), 0 for full precision
+        self.bvhImplicitLeft = False # Depth first node layout with the left child after its parent (-D BVH_IMPLICIT_LEFT)
+        self.bvhBlockBytes = 0 # With the depth first layout, small subtrees do not straddle blocks of that many bytes
+        self.bvhShortStack = 0 # Entries of the short traversal stack (-D BVH_SHORT_STACK), 0 for the full 64 entries stack
+        self.spatialSplitBudget = 0.0 # Allowed fraction of duplicated triangle references of the spatial split build, 0 for the object split build
+        self.instancing = False # Two-level BVH over instances of the distinct meshes of the scene (-D BVH_INSTANCES)
+        self.triangleRecords = False # Traverse compact triangle records put before the primitives (-D TRIANGLE_RECORDS)
+        self.indexedMeshes = False # Store the triangle sets as indexed meshes sharing their vertices (-D INDEXED_MESHES)
+        self.polygonArray = False # Lay out the polygons as a typed array indexed by the BVH leaves, without offsets (-D POLYGON_ARRAY)
+        self.trianglePacks = 0 # Triangles per SoA pack tested at once by the leaves (4 or 8, -D TRIANGLE_PACKS), 0 to disable
+        self.refitMode = False # Refit the primitive BVH of the previous compute instead of rebuilding it
+        self.refitThreshold = bvhRefit.REBUILD_THRESHOLD
+        self.raySorting = False # Trace the paths bounce by bounce, sorted by ray origin and direction before each bounce (-D RAY_SORTING)
+        self.wavefront = False # Trace the paths bounce by bounce with one kernel per stage, over device-side queues (-D WAVEFRONT)
+        self.persistentBatch = 0 # Paths fetched at once by the work-items of a persistent threads launch (-D PERSISTENT_THREADS), 0 to disable
+        self.batchSize = 0 # Paths per launch of a progressive compute, 0 to trace all the paths in one launch
+        self.progress = None # Called after each launch of a progressive compute with the paths done, all the paths and the power and irradiance so far
+        self.sceneCache = None # On-disk cache of the serialized scene buffers, None to serialize at every compute
+        self.programCache = None # On-disk cache of the program binaries, None to build the kernel at every compute
+        self.context = None # OpenCL context and queue, kept between computes
+        self.queue = None
+        self.batchQueue = None # Out-of-order queue of the progressive launches
+        self.devices = None # OpenCL devices the paths are split over, None for the device of create_some_context
+        self.deviceQueues = None # Queue of each device, in its own context
+        self.deviceThroughput = None # Paths per second of each device at the previous compute
+        self.deviceScenes = None # Scene buffers uploaded to each device and the key of their content, reused while the key matches
+        self.deterministic = False # Accumulate the measurements as 64-bit fixed point integers (-D DETERMINISTIC_ACCUMULATION)
+        self.fixedPointBits = FIXED_POINT_BITS
+        self.primTree = None # Primitive buffers and BVH of the previous compute, used by the refit
 
     # Setters
     def setScene(aScene):
@@ -30,6 +80,293 @@ class FluxLightModel():
         assert type(aScene) == openalea.plantgl.scenegraph._pglsg.Scene, "Error : input scene is not a PlantGL scene."
         self.scene = aScene
 
+    # Spatial structure of the primitives, "bvh" or "bih"
+    # The BIH only keeps two planes per node and is built without cost evaluation, it only comes in the binary host built layout
+    def setAccelerator(self, name):
+        assert name in ("bvh", "bih"), "Error : the accelerator is either bvh or bih."
+        self.accelerator = name
+        self.primTree = None
+
+    # Build the primitive BVH on the OpenCL device (LBVH) instead of the host SAH builder
+    def setDeviceBVH(self, enabled):
+        self.deviceBVH = bool(enabled)
+        self.primTree = None
+
+    # Width of the primitive BVH, the wide layouts are collapsed from the binary SAH tree and test all children at once
+    def setBVHWidth(self, width):
+        assert width in (2, 4, 8), "Error : the BVH width is either 2, 4 or 8."
+        self.bvhWidth = width
+        self.primTree = None
+
+    # Store the primitive and sensor BVH boxes on 8 or 16 bits per plane instead of floats, 0 to disable
+    def setBVHQuantization(self, bits):
+        assert bits in (0, 8, 16), "Error : quantized BVH nodes use either 8 or 16 bits."
+        self.bvhQuantization = bits
+        self.primTree = None
+
+    # Lay out the primitive and sensor BVH nodes depth first, the left child of a branch is the next node and is not stored
+    # blockBytes aligns the subtrees that fit in a block (a multiple of the cache line size) on block boundaries
+    def setBVHLayout(self, implicitLeft, blockBytes = 0):
+        self.bvhImplicitLeft = bool(implicitLeft)
+        self.bvhBlockBytes = blockBytes
+        self.primTree = None
+
+    # Traverse the binary BVHs with a stack of that many entries, dropped entries are found again through the parent links
+    # 0 restores the full stack
+    def setBVHShortStack(self, entries):
+        assert entries >= 0, "Error : the short stack size can't be negative."
+        self.bvhShortStack = entries
+        self.primTree = None
+
+    # Nodes per layout block of the binary BVH
+    def bvhBlockNodes(self):
+        nodeSize = {0: 64, 8: 36, 16: 48}[self.bvhQuantization]
+        return self.bvhBlockBytes // nodeSize
+
+    # Build the primitive BVH with spatial splits (SBVH), triangles straddling a split plane are clipped and referenced on both sides
+    # budget is the allowed fraction of extra references, e.g. 0.3 for at most 30% more references than triangles, 0 to disable
+    def setSpatialSplits(self, budget = bvhBuilder.SBVH_SPLIT_BUDGET):
+        assert budget >= 0.0, "Error : the spatial split budget can't be negative."
+        self.spatialSplitBudget = budget
+        self.primTree = None
+
+    # Serialize each distinct mesh of the scene once with its own BVH, and trace the shapes as instances of these meshes
+    # Shapes sharing a PlantGL geometry, or holding identical triangle sets, share one mesh
+    def setInstancing(self, enabled):
+        self.instancing = bool(enabled)
+        self.primTree = None
+
+    # Trace the paths one bounce at a time instead of one path per work-item, the paths still alive being sorted before each
+    # bounce by the Morton code of their ray origin and the octant of their direction, for coherent secondary rays
+    def setRaySorting(self, enabled):
+        self.raySorting = bool(enabled)
+
+    # Trace the paths one bounce at a time through a pipeline of kernels (extend to the closest hit, sensors on the segment,
+    # shading, accumulation of the absorbed power), each running over a queue of the paths reaching it, so the divergent
+    # shading does not stall the traversal. Combined with the ray sorting, the queue is sorted before each extension
+    def setWavefront(self, enabled):
+        self.wavefront = bool(enabled)
+
+    # Launch a fixed number of work-groups filling the compute units, whose work-items fetch batch paths at a time from a
+    # global counter until all are traced, instead of one work-item per path. Balances the paths of very different lengths
+    def setPersistentThreads(self, enabled, batch = PERSISTENT_BATCH):
+        assert batch > 0, "Error : the persistent work-items fetch at least one path."
+        self.persistentBatch = batch if enabled else 0
+
+    # Split the paths of a compute into launches of batchSize paths, enqueued ahead on an out-of-order queue. The launches
+    # alternate between two sets of output buffers, each read back without blocking while the next launch runs, and
+    # progress(done, total, power, irradiance) gets the measurements accumulated so far after each readback. 0 disables
+    def setProgressive(self, batchSize, progress = None):
+        assert batchSize >= 0, "Error : the batch size is a number of paths."
+        self.batchSize = batchSize
+        self.progress = progress
+
+    # Split the paths of compute() over several OpenCL devices (for instance CPU sub-devices from create_sub_devices and
+    # accelerators), each with its own copy of the scene buffers. Each device traces a range of sample indices proportional
+    # to its throughput measured at the previous compute, the measurements of the devices are summed. None disables
+    def setDevices(self, devices):
+        self.devices = list(devices) if devices is not None else None
+        self.deviceQueues = None
+        self.deviceThroughput = None
+        self.deviceScenes = None
+
+    # Accumulate the measurements as 64-bit fixed point integers with fixedPointBits fraction bits instead of float atomics
+    # The sums then don't depend on the order of the additions : a compute split over devices gives the same measurements,
+    # bit for bit, as on one of these devices with the same seed
+    # A slot holds sums below 2^(63 - fixedPointBits), 2^31 with the default 32 bits, with a resolution of 2^-fixedPointBits.
+    # A larger sum wraps around silently, so fewer fraction bits are needed for the scenes whose measurements exceed it
+    def setDeterministic(self, enabled, fixedPointBits = FIXED_POINT_BITS):
+        assert 0 < fixedPointBits < 63, "Error : the fixed point measurements are 64-bit integers."
+        self.deterministic = bool(enabled)
+        self.fixedPointBits = fixedPointBits
+
+    # Host type of the measurement values, and their float value
+    def measurementType(self):
+        return np.dtype(np.int64) if self.deterministic else np.dtype(np.float32)
+
+    def measurementValues(self, measurements):
+        if self.deterministic:
+            return measurements.astype(np.float64) / float(1 << self.fixedPointBits)
+        return measurements.astype(np.float64)
+
+    # Store the serialized scene buffers in a directory and reload them, memory-mapped, while the scene, sensors and settings don't change
+    # None disables the cache
+    def setSceneCache(self, directory):
+        self.sceneCache = sceneCache.SceneCache(directory) if directory is not None else None
+
+    # Store the binaries of the built light model programs in a directory, and reload them while the kernel sources, the
+    # options and the device and driver don't change. None disables the cache
+    def setProgramCache(self, directory):
+        self.programCache = programCache.ProgramCache(directory) if directory is not None else None
+
+    # Light model program for the device of a context, from the program cache if any
+    def buildProgram(self, context, device, source, options):
+        if self.programCache is not None:
+            return self.programCache.build(context, device, source, options)
+        return cl.Program(context, source).build(options)
+
+    # Test the rays against 48 bytes triangle records (first vertex and edges) stored in leaf order before the primitives,
+    # the full primitives are only read for the hit that is shaded. Needs the host built BVH or BIH, without instances
+    def setTriangleRecords(self, enabled):
+        self.triangleRecords = bool(enabled)
+        self.primTree = None
+
+    # Serialize each triangle set as one indexed mesh, its points, vertex normals and faces copied as they are, instead of a
+    # polygon per face holding copies of its vertices. Needs the host built BVH or BIH, without instances nor triangle records
+    def setIndexedMeshes(self, enabled):
+        self.indexedMeshes = bool(enabled)
+        self.primTree = None
+
+    # Store the polygons in leaf order as a typed array that the leaves index directly, instead of reading the offset and
+    # switching on the type of each primitive. Needs the host built BVH or BIH (no instances, indexed meshes nor triangle
+    # records). A scene with analytic primitives falls back to the generic offsets layout
+    def setPolygonArray(self, enabled):
+        self.polygonArray = bool(enabled)
+        self.primTree = None
+
+    # Test the leaf triangles 4 or 8 at a time, from SoA packs of their first vertices and edges stored in leaf order before
+    # the primitives, the leaves being aligned on the packs. Needs the host built BVH or BIH of a polygon scene, 0 disables
+    def setTrianglePacks(self, width):
+        assert width in (0, 4, 8), "Error : the triangle packs hold either 4 or 8 triangles."
+        self.trianglePacks = width
+        self.primTree = None
+
+    # Keep the primitive BVH between computes and only refit it, for scenes whose primitives move but stay the same
+    # The tree is rebuilt when its SAH cost grows past threshold times the cost at build time
+    def setRefitMode(self, enabled, threshold = bvhRefit.REBUILD_THRESHOLD):
+        self.refitMode = bool(enabled)
+        self.refitThreshold = threshold
+        self.primTree = None
+
+    # Build the primitive BVH on the host and serialize it in the configured layout
+    # Return the reordered primitives, their offsets, the BVH and its root address
+    def buildPrimitiveBVH(self, prims, primOffsets):
+        if self.accelerator == "bih":
+            self.bihBuilder.buildBIH(self.serializer.getPrimBounds(prims, primOffsets), max(bihBuilder.MAX_LEAF_SIZE, self.trianglePacks))
+            if self.trianglePacks:
+                self.bihBuilder.alignLeaves(self.trianglePacks)
+            prims, primOffsets = self.bihBuilder.reorderPrimitives(prims, primOffsets)
+            return prims, primOffsets, self.bihBuilder.serializeBIH(), self.bihBuilder.getRoot()
+
+        if self.spatialSplitBudget > 0.0:
+            self.bvhBuilder.buildSBVH(self.serializer.getTriangleVertices(prims, primOffsets), self.spatialSplitBudget)
+        else:
+            self.bvhBuilder.buildBVH(self.serializer.getPrimBounds(prims, primOffsets), packWidth = max(1, self.trianglePacks))
+        if self.trianglePacks:
+            self.bvhBuilder.alignLeaves(self.trianglePacks)
+        prims, primOffsets = self.bvhBuilder.reorderPrimitives(prims, primOffsets)
+        assert not self.bvhShortStack or self.bvhBuilder.getDepth() <= 64, "Error : the short stack traversal is limited to 64 levels."
+
+        if self.bvhQuantization:
+            return prims, primOffsets, self.bvhBuilder.serializeQuantizedBVH(self.bvhQuantization, self.bvhImplicitLeft, self.bvhBlockNodes()), self.bvhBuilder.getRoot()
+        if self.bvhWidth > 2:
+            return prims, primOffsets, self.bvhBuilder.serializeWideBVH(self.bvhWidth), 0
+        return prims, primOffsets, self.bvhBuilder.serializeBVH(self.bvhImplicitLeft, self.bvhBlockNodes()), self.bvhBuilder.getRoot()
+
+    # Key of the serialized scene : hash of its geometry and sensors, of the kernel options and of the BVH build settings
+    def sceneKey(self, options):
+        settings = "%s %s %d %d %d %d %f %d %d %d" % (options, self.accelerator, self.bvhWidth, self.bvhQuantization, self.bvhImplicitLeft, self.bvhBlockBytes,
+                                                   self.spatialSplitBudget, self.instancing, self.deviceBVH, self.refitMode)
+        return sceneCache.sceneKey(self.scene, self.serializer, self.sensorSerializer, settings)
+
+    # Serialize the scene, its detectors and sensors, and build the host BVH
+    # Return a dictionary of buffers : prims, offsets, bvh and root (only when the BVH is built on the host outside of
+    # the refit), detectors, sensors, sensorBVH and sensorRoot. With a scene cache, the buffers are loaded when the key
+    # (sceneKey, computed here if not given) matches
+    def serializeScene(self, options, key = None):
+        if self.sceneCache is not None:
+            if key is None:
+                key = self.sceneKey(options)
+            buffers = self.sceneCache.load(key)
+            if buffers is not None:
+                return buffers
+
+        buffers = {}
+        if self.instancing:
+            assert self.bvhWidth == 2 and not (self.deviceBVH or self.refitMode), "Error : instancing only supports the binary host built BVH."
+            prims, primOffsets, buffers["bvh"], root = instanceBuilder.InstanceBuilder(self.serializer).build(self.scene, self.bvhQuantization, self.bvhImplicitLeft, self.bvhBlockNodes(), self.spatialSplitBudget)
+            buffers["root"] = np.array([root], np.int32)
+        else:
+            if self.indexedMeshes:
+                prims, primOffsets = self.serializer.serializeIndexedScene(self.scene)
+            else:
+                prims, primOffsets = self.serializer.serializeTriangleScene(self.scene)
+            if not (self.deviceBVH or self.refitMode):
+                prims, primOffsets, buffers["bvh"], root = self.buildPrimitiveBVH(prims, primOffsets)
+                buffers["root"] = np.array([root], np.int32)
+                if self.triangleRecords:
+                    prims, primOffsets = self.serializer.prependTriangleRecords(prims, primOffsets)
+                if " -D POLYGON_ARRAY" in options:
+                    polygonArray = self.serializer.getPolygonArray(prims, primOffsets)
+                    assert polygonArray is not None, "Error : the typed polygon array only holds polygons."
+                    prims, primOffsets = polygonArray
+                if self.trianglePacks:
+                    prims, primOffsets = self.serializer.prependTrianglePacks(prims, primOffsets, self.trianglePacks)
+        buffers["prims"] = prims
+        buffers["offsets"] = primOffsets
+        buffers["detectors"] = self.serializer.serializeDetectors(1)
+        buffers["sensors"], buffers["sensorBVH"], sensorRoot = self.sensorSerializer.serialize(self.bvhQuantization, self.bvhImplicitLeft)
+        buffers["sensorRoot"] = np.array([sensorRoot], np.int32)
+
+        if key is not None:
+            self.sceneCache.store(key, buffers)
+        return buffers
+
+    # Upload the primitives and their BVH to the device, primBVH is the BVH already built on the host if any
+    # Otherwise the BVH is built here, on the device or for the refit
+    # In refit mode, the tree of the previous compute is refitted, and only rebuilt if it is degraded or the primitives changed
+    def uploadPrimitives(self, context, queue, options, prims, primOffsets, primBVH = None, primRoot = 0):
+        mf = cl.mem_flags
+        if primBVH is not None:
+            bufPrim = cl.Buffer(context, mf.READ_ONLY | mf.COPY_HOST_PTR, hostbuf=prims)
+            bufPrimOffsets = cl.Buffer(context, mf.READ_ONLY | mf.COPY_HOST_PTR, hostbuf=primOffsets)
+            bufPrimBVH = cl.Buffer(context, mf.READ_ONLY | mf.COPY_HOST_PTR, hostbuf=primBVH)
+            return bufPrim, bufPrimOffsets, bufPrimBVH, primRoot
+
+        nprims = len(primOffsets)
+        assert self.bvhWidth == 2 or not (self.deviceBVH or self.refitMode), "Error : the device build and the refit only support the binary BVH."
+        assert self.bvhQuantization == 0 or not (self.deviceBVH or self.refitMode or self.bvhWidth > 2), "Error : only the binary host built BVH can be quantized."
+        assert not self.bvhImplicitLeft or not (self.deviceBVH or self.refitMode or self.bvhWidth > 2), "Error : only the binary host built BVH has a depth first layout."
+
+        if self.refitMode and self.primTree is not None and self.primTree["count"] == nprims and self.primTree["size"] == len(prims):
+            tree = self.primTree
+            if not tree["device"]:
+                prims, primOffsets = self.bvhBuilder.reorderPrimitives(prims, primOffsets)
+            cl.enqueue_copy(queue, tree["prims"], np.frombuffer(prims, np.uint8))
+            cost = tree["refitter"].refit(queue, nprims, tree["prims"], tree["offsets"])
+            if not tree["refitter"].needsRebuild(cost):
+                return tree["prims"], tree["offsets"], tree["bvh"], tree["root"]
+            print("BVH refit SAH cost : ", cost, " (", tree["refitter"].buildCost, " at build), rebuilding")
+
+        # Full build
+        if self.deviceBVH:
+            assert self.spatialSplitBudget == 0.0, "Error : spatial splits are only available with the host build."
+        else:
+            prims, primOffsets, primBVH, primRoot = self.buildPrimitiveBVH(prims, primOffsets)
+
+        bufPrim = cl.Buffer(context, mf.READ_WRITE | mf.COPY_HOST_PTR, hostbuf=prims)
+        bufPrimOffsets = cl.Buffer(context, mf.READ_ONLY | mf.COPY_HOST_PTR, hostbuf=primOffsets)
+        if self.deviceBVH:
+            # The BVH is built from the uploaded primitives, only the primitive buffers are sent to the device
+            lbvh = lbvhBuilder.LBVHBuilder(context, options)
+            bufPrimBVH, bufPrimOffsets, bufPrimParents, primRoot = lbvh.build(queue, nprims, bufPrim, bufPrimOffsets)
+            nnodes = 2 * nprims - 1
+            leaves = np.arange(nprims - 1, nnodes, dtype=np.int32)
+        else:
+            bufPrimBVH = cl.Buffer(context, mf.READ_WRITE | mf.COPY_HOST_PTR, hostbuf=primBVH)
+            bufPrimParents = self.bvhBuilder.getParents()
+            nnodes = len(bufPrimParents)
+            leaves = self.bvhBuilder.getLeaves()
+
+        self.primTree = None
+        if self.refitMode:
+            refitter = bvhRefit.BVHRefitter(context, options, self.refitThreshold)
+            refitter.setTree(queue, nnodes, primRoot, bufPrimBVH, bufPrimParents, leaves, len(leaves))
+            self.primTree = {"count": nprims, "size": len(prims), "device": self.deviceBVH, "refitter": refitter,
+                             "prims": bufPrim, "offsets": bufPrimOffsets, "bvh": bufPrimBVH, "root": primRoot}
+
+        return bufPrim, bufPrimOffsets, bufPrimBVH, primRoot
+
     # Light serializer shortcuts 
     def addPointLight(self, samples, color, power, spectralCdF):
         self.lightSerializer.addPointLight(samples, color, power, spectralCdF)
@@ -41,13 +378,180 @@ class FluxLightModel():
         self.lightSerializer.removeLight(index)
 
     #Sensor serializer shortcuts
-    def addSensor(self, groupIndex, matrix, twoSided, color, exponent, bbox):
+    def addSensor(self, groupIndex, matrix, twoSided, color, exponent, bbox = None):
         self.sensorSerializer.addSensor(groupIndex, matrix, twoSided, color, exponent, bbox)
 
     def removeSensor(self, index):
         self.sensorSerializer.removeSensor(index)
 
     #GPUFlux launcher
+    # Upload the primitives, detectors, lights and sensors of a compute to a device, return the buffers by name
+    def uploadScene(self, context, queue, options, buffers, lights, lightOffsets, cumLightPower):
+        mf = cl.mem_flags
+        scene = {}
+        scene["prims"], scene["offsets"], scene["bvh"], scene["root"] = self.uploadPrimitives(context, queue, options, buffers["prims"], buffers["offsets"], buffers.get("bvh"), int(buffers["root"][0]) if "root" in buffers else 0)
+        scene["detectors"] = cl.Buffer(context, mf.READ_ONLY | mf.COPY_HOST_PTR, hostbuf=buffers["detectors"])
+        scene["lights"] = cl.Buffer(context, mf.READ_ONLY | mf.COPY_HOST_PTR, hostbuf=lights)
+        scene["lightOffsets"] = cl.Buffer(context, mf.READ_ONLY | mf.COPY_HOST_PTR, hostbuf=lightOffsets)
+        scene["cumLightPower"] = cl.Buffer(context, mf.READ_ONLY | mf.COPY_HOST_PTR, hostbuf=cumLightPower)
+        scene["sensors"] = cl.Buffer(context, mf.READ_ONLY | mf.COPY_HOST_PTR, hostbuf=buffers["sensors"])
+        scene["sensorBVH"] = cl.Buffer(context, mf.READ_ONLY | mf.COPY_HOST_PTR, hostbuf=buffers["sensorBVH"])
+        scene["sensorRoot"] = np.int32(buffers["sensorRoot"][0])
+        return scene
+
+    # Arguments of the compute kernels following their output buffers
+    def kernelArguments(self, scene, measurementBits, skyOffset, depth, minPower, bounds, sensivityCurves, seed):
+        return (scene["detectors"], np.int32(measurementBits), np.int32(len(self.scene)), np.int32(0), scene["prims"], scene["offsets"], np.int32(scene["root"]), scene["bvh"], None, None,
+                np.int32(len(self.lightSerializer.lightList)), scene["lights"], scene["lightOffsets"], scene["cumLightPower"], np.int32(skyOffset),
+                np.int32(len(self.sensorSerializer.sensorList)), scene["sensors"], np.int32(scene["sensorRoot"]), scene["sensorBVH"], np.int32(depth), np.float32(minPower), bounds, sensivityCurves, np.int32(seed))
+
+    # Blocking readback of the measurement buffers of a launch
+    def readMeasurements(self, queue, bufPower, bufIrradiance, measurements):
+        power = np.empty((measurements, MEASUREMENT_CHANNELS), self.measurementType())
+        irradiance = np.empty((measurements, MEASUREMENT_CHANNELS), self.measurementType())
+        cl.enqueue_copy(queue, power, bufPower)
+        cl.enqueue_copy(queue, irradiance, bufIrradiance)
+        return self.measurementValues(power), self.measurementValues(irradiance)
+
+    # Persistent threads kernel and its launch size for count paths : PERSISTENT_GROUPS_PER_UNIT work-groups per compute
+    # unit, fewer when they would not all get a batch of paths
+    def persistentLaunch(self, program, device, count):
+        kernel = program.computePersistent
+        groupSize = min(64, kernel.get_work_group_info(cl.kernel_work_group_info.WORK_GROUP_SIZE, device))
+        groups = device.max_compute_units * PERSISTENT_GROUPS_PER_UNIT
+        groups = max(1, min(groups, (count + groupSize * self.persistentBatch - 1) // (groupSize * self.persistentBatch)))
+        return kernel, (groups * groupSize,), (groupSize,)
+
+    # Trace the paths in launches of batchSize paths, the following launches being enqueued before the readback of the
+    # previous ones completes. Each launch clears and accumulates one of two sets of output buffers, the set is only
+    # cleared again once its readback has completed. Return the power and irradiance measurements summed over the launches
+    def computeProgressive(self, program, nthreads, sampleOffset, nsample, measurements, sceneArgs):
+        context = self.context
+        device = self.queue.device
+        if self.batchQueue is None:
+            try:
+                self.batchQueue = cl.CommandQueue(context, properties=cl.command_queue_properties.OUT_OF_ORDER_EXEC_MODE_ENABLE)
+            except cl.Error:
+                # Out-of-order execution unsupported, the launches still overlap the readbacks and the host work
+                self.batchQueue = cl.CommandQueue(context)
+        queue = self.batchQueue
+
+        mf = cl.mem_flags
+        valueType = self.measurementType()
+        nbytes = measurements * MEASUREMENT_CHANNELS * valueType.itemsize
+        sumType = np.int64 if self.deterministic else np.float64
+        power = np.zeros((measurements, MEASUREMENT_CHANNELS), sumType)
+        irradiance = np.zeros((measurements, MEASUREMENT_CHANNELS), sumType)
+        sets = [{
+            "power": cl.Buffer(context, mf.READ_WRITE, nbytes),
+            "irradiance": cl.Buffer(context, mf.READ_WRITE, nbytes),
+            "counter": cl.Buffer(context, mf.READ_WRITE, 4),
+            "hostPower": np.empty((measurements, MEASUREMENT_CHANNELS), valueType),
+            "hostIrradiance": np.empty((measurements, MEASUREMENT_CHANNELS), valueType),
+            "readback": None,
+            "paths": 0} for i in range(2)]
+
+        done = 0
+        # Wait for the readback of a set and add it to the sums
+        def collect(outputs):
+            nonlocal done
+            if outputs["readback"] is None:
+                return
+            cl.wait_for_events(outputs["readback"])
+            outputs["readback"] = None
+            power[:] += outputs["hostPower"]
+            irradiance[:] += outputs["hostIrradiance"]
+            done += outputs["paths"]
+            if self.progress is not None:
+                self.progress(done, nthreads, self.measurementValues(power), self.measurementValues(irradiance))
+
+        for batch, first in enumerate(range(0, int(nthreads), self.batchSize)):
+            count = min(self.batchSize, int(nthreads) - first)
+            outputs = sets[batch % 2]
+            collect(outputs)
+
+            cleared = [cl.enqueue_fill_buffer(queue, outputs["power"], np.float32(0), 0, nbytes),
+                       cl.enqueue_fill_buffer(queue, outputs["irradiance"], np.float32(0), 0, nbytes)]
+            offset = np.int32(sampleOffset + first)
+            if self.persistentBatch:
+                cleared.append(cl.enqueue_fill_buffer(queue, outputs["counter"], np.int32(0), 0, 4))
+                kernel, globalSize, localSize = self.persistentLaunch(program, device, count)
+                launch = kernel(queue, globalSize, localSize, None, np.int32(count), offset, np.int32(nsample), outputs["counter"], outputs["power"], outputs["irradiance"], *sceneArgs, wait_for=cleared)
+            else:
+                launch = program.compute(queue, (count,), None, None, np.int32(count), offset, np.int32(nsample), outputs["power"], outputs["irradiance"], *sceneArgs, wait_for=cleared)
+
+            outputs["readback"] = [cl.enqueue_copy(queue, outputs["hostPower"], outputs["power"], is_blocking=False, wait_for=[launch]),
+                                   cl.enqueue_copy(queue, outputs["hostIrradiance"], outputs["irradiance"], is_blocking=False, wait_for=[launch])]
+            outputs["paths"] = count
+            queue.flush()
+
+        # Remaining readbacks, in launch order
+        batches = (int(nthreads) + self.batchSize - 1) // self.batchSize
+        collect(sets[batches % 2])
+        collect(sets[(batches + 1) % 2])
+        return self.measurementValues(power), self.measurementValues(irradiance)
+
+    # Split the paths over the devices of setDevices, in sample ranges proportional to their throughput at the previous
+    # compute, or to their compute units times their clock at the first one. Each device runs the compute kernel on a copy
+    # of the scene, with the global offset of its range so that the global ids, which pick the measurement slots, are
+    # those of a single launch. The copy of the scene is kept on each device and only uploaded again when key changes,
+    # buffers may then be None. Return the power and irradiance measurements summed over the devices
+    def computeMultiDevice(self, programs, options, key, buffers, lights, lightOffsets, cumLightPower, nthreads, sampleOffset, nsample, params):
+        if None in self.deviceThroughput:
+            weights = np.array([device.max_compute_units * device.max_clock_frequency for device in self.devices], np.float64)
+        else:
+            weights = np.array(self.deviceThroughput, np.float64)
+        ends = np.rint(np.cumsum(weights) / np.sum(weights) * int(nthreads)).astype(np.int64)
+        firsts = np.concatenate([[0], ends[:-1]])
+
+        measurementBits, depth = params[0], params[2]
+        measurements = measurementCount(measurementBits, depth)
+        valueType = self.measurementType()
+        nbytes = measurements * MEASUREMENT_CHANNELS * valueType.itemsize
+
+        # Enqueue the range of each device before waiting for any
+        mf = cl.mem_flags
+        launches = []
+        for index, (queue, program, first, end) in enumerate(zip(self.deviceQueues, programs, firsts, ends)):
+            if end == first:
+                launches.append(None)
+                continue
+
+            context = queue.context
+            if self.deviceScenes[index] is None or self.deviceScenes[index][0] != key:
+                self.deviceScenes[index] = (key, self.uploadScene(context, queue, options, buffers, lights, lightOffsets, cumLightPower))
+            scene = self.deviceScenes[index][1]
+            bufPower = cl.Buffer(context, mf.READ_WRITE, nbytes)
+            bufIrradiance = cl.Buffer(context, mf.READ_WRITE, nbytes)
+            cl.enqueue_fill_buffer(queue, bufPower, np.float32(0), 0, nbytes)
+            cl.enqueue_fill_buffer(queue, bufIrradiance, np.float32(0), 0, nbytes)
+
+            # The kernel traces the global ids [first, end), shifted by sampleOffset
+            launch = program.compute(queue, (int(end - first),), None, None, np.int32(end), np.int32(sampleOffset), np.int32(nsample), bufPower, bufIrradiance, *self.kernelArguments(scene, *params), global_offset=(int(first),))
+
+            hostPower = np.empty((measurements, MEASUREMENT_CHANNELS), valueType)
+            hostIrradiance = np.empty((measurements, MEASUREMENT_CHANNELS), valueType)
+            readback = [cl.enqueue_copy(queue, hostPower, bufPower, is_blocking=False),
+                        cl.enqueue_copy(queue, hostIrradiance, bufIrradiance, is_blocking=False)]
+            queue.flush()
+            launches.append((launch, readback, hostPower, hostIrradiance, int(end - first)))
+
+        # Sum in device order, exact for the fixed point measurements
+        sumType = np.int64 if self.deterministic else np.float64
+        power = np.zeros((measurements, MEASUREMENT_CHANNELS), sumType)
+        irradiance = np.zeros((measurements, MEASUREMENT_CHANNELS), sumType)
+        for index, entry in enumerate(launches):
+            if entry is None:
+                continue
+            launch, readback, hostPower, hostIrradiance, count = entry
+            cl.wait_for_events(readback)
+            power += hostPower
+            irradiance += hostIrradiance
+            seconds = (launch.profile.end - launch.profile.start) * 1e-9
+            self.deviceThroughput[index] = count / max(seconds, 1e-9)
+
+        return self.measurementValues(power), self.measurementValues(irradiance)
+
     def compute(self, nbRays, nthreads, sampleOffset, nsample, measurementBits, skyOffset, depth, minPower, sceneCenter, radius, rgb, power, seed):
         
         #PARAMS BUILDING
@@ -59,14 +563,6 @@ class FluxLightModel():
         structfill.fillVec3(sensivityCurves, "rgb", rgb)
         sensivityCurves["power"] = power
 
-        #INPUT BUFFER CONTENT BUILDING
-        prims, primOffsets = self.serializer.serializeTriangleScene(self.scene)
-        self.bvhBuilder.buildBVHfromScene(self.scene)
-        primBVH = self.bvhBuilder.serializeBVH()
-        detectors = self.serializer.serializeDetectors(1)
-        lights, lightOffsets, cumLightPower = self.lightSerializer.serialize()
-        sensors, sensorBVH = self.sensorSerializer.serialize()
-        
         # GPUFLUX CONFIGURATION
 
         # GPUFlux specific options
@@ -76,8 +572,47 @@ class FluxLightModel():
         options += " -D MEASURE_SPECTRUM_BINS=340"
         options += " -D SPECTRAL_WAVELENGTH_MIN=360"
         options += " -D SPECTRAL_WAVELENGTH_MAX=830"
-        options += " -D SPECTRAL_WAVELENGTH_BINS=" + SPECTRAL_WAVELENGTH_BINS
-        options += " -D BVH"
+        options += " -D SPECTRAL_WAVELENGTH_BINS=" + str(SPECTRAL_WAVELENGTH_BINS)
+        if self.accelerator == "bih":
+            assert self.bvhWidth == 2 and self.bvhQuantization == 0 and not (self.bvhImplicitLeft or self.bvhShortStack or self.instancing), "Error : the BIH only has the binary full precision layout."
+            assert not (self.deviceBVH or self.refitMode or self.spatialSplitBudget > 0.0), "Error : the BIH is only built on the host, without refit nor spatial splits."
+        else:
+            options += " -D BVH"
+        if self.bvhWidth > 2:
+            options += " -D BVH" + str(self.bvhWidth)
+        if self.bvhQuantization:
+            options += " -D BVH_QUANTIZED=" + str(self.bvhQuantization)
+        if self.bvhImplicitLeft:
+            options += " -D BVH_IMPLICIT_LEFT"
+        if self.instancing:
+            options += " -D BVH_INSTANCES"
+        if self.bvhShortStack:
+            assert self.bvhWidth == 2 and self.bvhQuantization == 0 and not self.instancing, "Error : the short stack is only available for the full precision binary BVH without instances."
+            options += " -D BVH_SHORT_STACK=" + str(self.bvhShortStack)
+        if self.raySorting:
+            options += " -D RAY_SORTING"
+        if self.wavefront:
+            options += " -D WAVEFRONT"
+        if self.persistentBatch:
+            assert not (self.raySorting or self.wavefront), "Error : the persistent threads only run the compute megakernel."
+            options += " -D PERSISTENT_THREADS -D PERSISTENT_BATCH=" + str(self.persistentBatch)
+        if self.deterministic:
+            # The measurement slots are picked by global id, which only matches the path in the one path per work-item launches
+            assert not (self.raySorting or self.wavefront or self.persistentBatch), "Error : the deterministic accumulation needs the compute megakernel."
+            options += " -D DETERMINISTIC_ACCUMULATION -D FIXED_POINT_BITS=" + str(self.fixedPointBits)
+        if self.triangleRecords:
+            assert not (self.instancing or self.deviceBVH or self.refitMode), "Error : the triangle records are only built for the host built BVH, without instances."
+            options += " -D TRIANGLE_RECORDS"
+        if self.indexedMeshes:
+            assert not (self.instancing or self.triangleRecords or self.deviceBVH or self.refitMode), "Error : the indexed meshes are only built for the host built BVH, without instances nor triangle records."
+            options += " -D INDEXED_MESHES"
+        # A scene with analytic primitives keeps the generic offsets layout
+        if self.polygonArray and self.serializer.isPolygonScene(self.scene):
+            assert not (self.instancing or self.indexedMeshes or self.triangleRecords or self.deviceBVH or self.refitMode), "Error : the typed polygon array is only built for the host built BVH of a polygon scene."
+            options += " -D POLYGON_ARRAY"
+        if self.trianglePacks:
+            assert not (self.instancing or self.indexedMeshes or self.triangleRecords or self.polygonArray or self.deviceBVH or self.refitMode), "Error : the triangle packs are only built for the host built BVH of a polygon scene, without other leaf format."
+            options += " -D TRIANGLE_PACKS=" + str(self.trianglePacks)
         options += " -D ENABLE_SENSORS"
 
         # OpenCL config options
@@ -101,31 +636,146 @@ class FluxLightModel():
         # Directory option
         options += " -I kernel/"
 
-        # KERNEL COMPILATION
-        context = cl.create_some_context()
-        queue = cl.CommandQueue(context)
-        
+        # KERNEL COMPILATION, in the background while the scene is serialized
+        if self.devices is not None:
+            assert not (self.raySorting or self.wavefront or self.persistentBatch or self.batchSize or self.refitMode), "Error : the devices only share the paths of the compute megakernel, without refit."
+            if self.deviceQueues is None:
+                self.deviceQueues = [cl.CommandQueue(cl.Context([device]), device, properties=cl.command_queue_properties.PROFILING_ENABLE) for device in self.devices]
+                self.deviceThroughput = [None] * len(self.devices)
+                self.deviceScenes = [None] * len(self.devices)
+            queues = self.deviceQueues
+        else:
+            if self.context is None:
+                self.context = cl.create_some_context()
+                self.queue = cl.CommandQueue(self.context)
+            queues = [self.queue]
+
         kernelFile = open("kernel/lightmodel_kernel.cl", "r")
         kernelSource = kernelFile.read()
         kernelFile.close()
 
-        program = cl.Program(context, kernelSource).build(options)
+        compiler = concurrent.futures.ThreadPoolExecutor(max_workers=len(queues))
+        builds = [compiler.submit(self.buildProgram, queue.context, queue.device, kernelSource, options) for queue in queues]
+        compiler.shutdown(wait=False)
+
+        #INPUT BUFFER CONTENT BUILDING
+        lights, lightOffsets, cumLightPower = self.lightSerializer.serialize()
+        if self.devices is not None:
+            # The scene is not serialized again while every device holds a copy of it and of the lights
+            key = self.sceneKey(options)
+            deviceKey = hashlib.sha256(key.encode() + b"".join(np.asarray(part).tobytes() for part in (lights, lightOffsets, cumLightPower))).hexdigest()
+            reused = all(entry is not None and entry[0] == deviceKey for entry in self.deviceScenes)
+            buffers = None if reused else self.serializeScene(options, key)
+            programs = [build.result() for build in builds]
+            return self.computeMultiDevice(programs, options, deviceKey, buffers, lights, lightOffsets, cumLightPower, nthreads, sampleOffset, nsample, (measurementBits, skyOffset, depth, minPower, bounds, sensivityCurves, seed))
+
+        buffers = self.serializeScene(options)
+        programs = [build.result() for build in builds]
+
+        context = self.context
+        queue = self.queue
+        program = programs[0]
         compute = program.compute
 
         # INPUT BUFFERS BUILDING
 
-        bufPrim = cl.Buffer(context, cl.mem_flags.READ_ONLY | cl.mem_flags.COPY_HOST_PTR, hostbuf=prims)
-        bufPrimOffsets = cl.Buffer(context, cl.mem_flags.READ_ONLY | cl.mem_flags.COPY_HOST_PTR, hostbuf=primOffsets)
-        bufPrimBVH = cl.Buffer(context, cl.mem_flags.READ_ONLY | cl.mem_flags.COPY_HOST_PTR, hostbuf=primBVH)
-        bufDetectors = cl.Buffer(context, cl.mem_flags.READ_ONLY | cl.mem_flags.COPY_HOST_PTR, hostbuf=detectors)
-        bufLights = cl.Buffer(context, cl.mem_flags.READ_ONLY | cl.mem_flags.COPY_HOST_PTR, hostbuf=lights)
-        bufLightOffsets = cl.Buffer(context, cl.mem_flags.READ_ONLY | cl.mem_flags.COPY_HOST_PTR, hostbuf=lightOffsets)
-        bufCumLightPower = cl.Buffer(context, cl.mem_flags.READ_ONLY | cl.mem_flags.COPY_HOST_PTR, hostbuf=cumLightPower)
-        bufSensors = cl.Buffer(context, cl.mem_flags.READ_ONLY | cl.mem_flags.COPY_HOST_PTR, hostbuf=sensors)
-        bufSensorBVH = cl.Buffer(context, cl.mem_flags.READ_ONLY | cl.mem_flags.COPY_HOST_PTR, hostbuf=sensorBVH)
+        scene = self.uploadScene(context, queue, options, buffers, lights, lightOffsets, cumLightPower)
+        bufPrim, bufPrimOffsets, bufPrimBVH, primRoot = scene["prims"], scene["offsets"], scene["bvh"], scene["root"]
+        bufDetectors, bufLights, bufLightOffsets, bufCumLightPower = scene["detectors"], scene["lights"], scene["lightOffsets"], scene["cumLightPower"]
+        bufSensors, bufSensorBVH, sensorRoot = scene["sensors"], scene["sensorBVH"], scene["sensorRoot"]
 
         # OUTPUT BUFFERS BUILDING
-        bufAbsorbedPower = cl.Buffer(context, cl.mem_flags.WRITE_ONLY, len(self.scene))
-        bufIrradiance = cl.Buffer(context, cl.mem_flags.WRITE_ONLY, len(self.sensorSerializer.sensorList))
+        measurementBytes = measurementCount(measurementBits, depth) * MEASUREMENT_CHANNELS * self.measurementType().itemsize
+        bufAbsorbedPower = cl.Buffer(context, cl.mem_flags.READ_WRITE, measurementBytes)
+        bufIrradiance = cl.Buffer(context, cl.mem_flags.READ_WRITE, measurementBytes)
+
+        # Arguments following the output buffers of the compute kernels
+        sceneArgs = self.kernelArguments(scene, measurementBits, skyOffset, depth, minPower, bounds, sensivityCurves, seed)
+
+        if self.batchSize:
+            assert not (self.raySorting or self.wavefront), "Error : the progressive launches only run the compute or persistent kernels."
+            return self.computeProgressive(program, nthreads, sampleOffset, nsample, measurementCount(measurementBits, depth), sceneArgs)
+
+        # The kernels accumulate into the measurements
+        cl.enqueue_fill_buffer(queue, bufAbsorbedPower, np.float32(0), 0, measurementBytes)
+        cl.enqueue_fill_buffer(queue, bufIrradiance, np.float32(0), 0, measurementBytes)
+
+        if self.persistentBatch:
+            # Persistent launch : the work-groups are sized to the device, the paths are handed out by the counter
+            kernel, globalSize, localSize = self.persistentLaunch(program, queue.device, nthreads)
+            bufPathCounter = cl.Buffer(context, cl.mem_flags.READ_WRITE | cl.mem_flags.COPY_HOST_PTR, hostbuf=np.zeros(1, np.int32))
+            kernel(queue, globalSize, localSize, None, np.int32(nthreads), np.int32(sampleOffset), np.int32(nsample), bufPathCounter, bufAbsorbedPower, bufIrradiance, *sceneArgs)
+            return self.readMeasurements(queue, bufAbsorbedPower, bufIrradiance, measurementCount(measurementBits, depth))
+
+        if not (self.raySorting or self.wavefront):
+            compute(queue, (nbRays,), None, None, np.int32(nthreads), np.int32(sampleOffset), np.int32(nsample), bufAbsorbedPower, bufIrradiance, *sceneArgs)
+            return self.readMeasurements(queue, bufAbsorbedPower, bufIrradiance, measurementCount(measurementBits, depth))
+
+        # Bounce by bounce launches, over the queue of the paths still alive
+        mf = cl.mem_flags
+        bufSize = cl.Buffer(context, mf.WRITE_ONLY, 4)
+        program.pathStateSize(queue, (1,), None, None, bufSize)
+        pathStateSize = np.empty(1, np.int32)
+        cl.enqueue_copy(queue, pathStateSize, bufSize)
+
+        bufPaths = cl.Buffer(context, mf.READ_WRITE, nthreads * int(pathStateSize[0]))
+        bufPathQueue = cl.Buffer(context, mf.READ_WRITE, nthreads * 4)
+        bufKeys = cl.Buffer(context, mf.READ_WRITE, nthreads * 4)
+        sorter = radixSort.RadixSort(context, options) if self.raySorting else None
+
+        program.generatePaths(queue, (nthreads,), None, None, np.int32(nthreads), np.int32(sampleOffset), np.int32(nsample), np.int32(len(self.lightSerializer.lightList)), bufLights, bufLightOffsets, bufCumLightPower, bounds, np.int32(seed), bufPaths, bufPathQueue)
+
+        if self.wavefront:
+            # Wavefront pipeline : the hits and the paths of the next bounce are appended to their queues by the kernels,
+            # the queue lengths are counters read back once per bounce
+            program.pathHitSize(queue, (1,), None, None, bufSize)
+            pathHitSize = np.empty(1, np.int32)
+            cl.enqueue_copy(queue, pathHitSize, bufSize)
+
+            bufHits = cl.Buffer(context, mf.READ_WRITE, nthreads * int(pathHitSize[0]))
+            bufHitQueue = cl.Buffer(context, mf.READ_WRITE, nthreads * 4)
+            bufNextQueue = cl.Buffer(context, mf.READ_WRITE, nthreads * 4)
+            bufCounters = cl.Buffer(context, mf.READ_WRITE, 3 * 4)
+
+            counters = np.zeros(3, np.int32) # Paths of the bounce, hits, paths of the next bounce
+            active = nthreads
+            for d in range(depth + 1):
+                if active == 0:
+                    break
+
+                if self.raySorting:
+                    program.pathKeys(queue, (active,), None, None, np.int32(active), bufPathQueue, bufPaths, bounds, bufKeys)
+                    sorter.sort(queue, active, bufKeys, bufPathQueue)
+
+                counters[:] = (active, 0, 0)
+                cl.enqueue_copy(queue, bufCounters, counters)
+                program.extendPaths(queue, (active,), None, None, bufCounters, bufPathQueue, bufPaths, bufHits, bufHitQueue, np.int32(len(self.scene)), np.int32(0), bufPrim, bufPrimOffsets, np.int32(primRoot), bufPrimBVH)
+                program.senseSegments(queue, (active,), None, None, bufCounters, bufPathQueue, bufPaths, bufHits, np.int32(d), bufIrradiance, bufDetectors, np.int32(measurementBits), np.int32(len(self.sensorSerializer.sensorList)), bufSensors, np.int32(sensorRoot), bufSensorBVH, sensivityCurves)
+                program.shadePaths(queue, (active,), None, None, bufCounters, bufHitQueue, bufPaths, bufHits, bufNextQueue, np.int32(d), bufDetectors, np.int32(measurementBits), bufPrim, None, None, np.int32(depth), np.float32(minPower))
+                program.accumulatePaths(queue, (active,), None, None, bufCounters, bufHitQueue, bufPaths, bufHits, bufAbsorbedPower, sensivityCurves)
+                cl.enqueue_copy(queue, counters, bufCounters)
+
+                active = int(counters[2])
+                bufPathQueue, bufNextQueue = bufNextQueue, bufPathQueue
+            return self.readMeasurements(queue, bufAbsorbedPower, bufIrradiance, measurementCount(measurementBits, depth))
+
+        # Sorted launch : the ended paths are sorted last before each bounce and dropped
+        bufAlive = cl.Buffer(context, mf.READ_WRITE, 4)
+
+        queued = nthreads # Paths in the queue, the ended ones are sorted last and dropped
+        active = nthreads # Paths still alive
+        alive = np.empty(1, np.int32)
+        for d in range(depth + 1):
+            if active == 0:
+                break
+
+            program.pathKeys(queue, (queued,), None, None, np.int32(queued), bufPathQueue, bufPaths, bounds, bufKeys)
+            sorter.sort(queue, queued, bufKeys, bufPathQueue)
+            queued = active
+
+            cl.enqueue_fill_buffer(queue, bufAlive, np.int32(0), 0, 4)
+            program.bouncePaths(queue, (active,), None, None, np.int32(active), np.int32(d), bufPathQueue, bufPaths, bufAlive, bufAbsorbedPower, bufIrradiance, bufDetectors, np.int32(measurementBits), np.int32(len(self.scene)), np.int32(0), bufPrim, bufPrimOffsets, np.int32(primRoot), bufPrimBVH, None, None, np.int32(len(self.sensorSerializer.sensorList)), bufSensors, np.int32(sensorRoot), bufSensorBVH, np.int32(depth), np.float32(minPower), sensivityCurves)
+            cl.enqueue_copy(queue, alive, bufAlive)
+            active = int(alive[0])
 
-        compute(queue, (nbRays,), None, nthreads, sampleOffset, nsample, bufAbsorbedPower, bufIrradiance, bufDetectors, measurementBits, len(self.scene), 0, bufPrim, bufPrimOffsets, 0, bufPrimBVH, None, channels, len(self.lightSerializer.lightList), bufLights, bufLightOffsets, bufCumLightPower, skyOffset, len(self.sensorSerializer.sensorList), bufSensors, 0, bufSensorBVH, depth, minPower, bounds, sensivityCurves, seed)
\ No newline at end of file
+        return self.readMeasurements(queue, bufAbsorbedPower, bufIrradiance, measurementCount(measurementBits, depth))
@@ -0,0 +1,42 @@
+import sys
+import pyopencl as cl
+import pyopencl.tools
+import pyopencl.array
+import numpy as np
+
+RADIX_BITS = 4 # Must match kernel/radixsort_kernel.cl
+RADIX_ITEMS = 4096 # Work-items of the histogram and scatter passes
+RADIX_SCAN_GROUP = 64 # Work-group size of the scan pass
+
+# Device radix sort of (uint key, int value) pairs
+class RadixSort():
+    def __init__(self, context, options) -> None:
+        kernelFile = open("kernel/radixsort_kernel.cl", "r")
+        kernelSource = kernelFile.read()
+        kernelFile.close()
+
+        self.context = context
+        self.program = cl.Program(context, kernelSource).build(options)
+
+    # Sort n pairs in place, only the lower keyBits bits of the keys are sorted
+    def sort(self, queue, n, bufKeys, bufValues, keyBits = 32):
+        items = max(1, min(RADIX_ITEMS, n))
+        chunk = (n + items - 1) // items
+        passes = (keyBits + RADIX_BITS - 1) // RADIX_BITS
+
+        bufHist = cl.Buffer(self.context, cl.mem_flags.READ_WRITE, (1 << RADIX_BITS) * items * 4)
+        bufTempKeys = cl.Buffer(self.context, cl.mem_flags.READ_WRITE, max(n, 1) * 4)
+        bufTempValues = cl.Buffer(self.context, cl.mem_flags.READ_WRITE, max(n, 1) * 4)
+
+        keysIn, valuesIn, keysOut, valuesOut = bufKeys, bufValues, bufTempKeys, bufTempValues
+        for p in range(passes):
+            shift = np.int32(p * RADIX_BITS)
+            self.program.radixHistogram(queue, (items,), None, None, np.int32(n), np.int32(chunk), shift, keysIn, bufHist)
+            self.program.radixScan(queue, (RADIX_SCAN_GROUP,), (RADIX_SCAN_GROUP,), None, np.int32((1 << RADIX_BITS) * items), bufHist, cl.LocalMemory(RADIX_SCAN_GROUP * 4))
+            self.program.radixScatter(queue, (items,), None, None, np.int32(n), np.int32(chunk), shift, keysIn, valuesIn, bufHist, keysOut, valuesOut)
+            keysIn, valuesIn, keysOut, valuesOut = keysOut, valuesOut, keysIn, valuesIn
+
+        # An odd number of passes leaves the result in the temporary buffers
+        if passes % 2 == 1:
+            cl.enqueue_copy(queue, bufKeys, bufTempKeys, byte_count=n * 4)
+            cl.enqueue_copy(queue, bufValues, bufTempValues, byte_count=n * 4)
@@ -0,0 +1,144 @@
+import sys
+import os
+import hashlib
+import shutil
+import tempfile
+import numpy as np
+from openalea.plantgl.all import *
+import serializer
+import sensorSerializer
+import bvhBuilder
+
+CACHE_VERSION = 2 # Bumped when the layout of a cached buffer changes
+
+# Key of a scene : hash of the triangle sets, transformations and opacity of its shapes, of the sensors and of the settings
+# (kernel options and BVH build parameters). A geometry shared by several shapes is hashed once
+def sceneKey(scene, serializer, sensorSerializer, settings):
+    digest = hashlib.sha256()
+    digest.update(("version %d\n%s\n" % (CACHE_VERSION, settings)).encode())
+
+    geometryKeys = {}
+    for shape in scene:
+        trSet, matrix = serializer.unwrapGeometry(shape.geometry)
+        if trSet.getId() not in geometryKeys:
+            geometryKeys[trSet.getId()] = serializer.geometryKey(trSet)
+        digest.update(geometryKeys[trSet.getId()].encode())
+        digest.update(matrix.tobytes())
+        digest.update(b"opaque" if serializer.isOpaque(shape) else b"transmissive")
+
+    for sensor in sensorSerializer.sensorList:
+        digest.update(str([str(sensor[name]) for name in ("groupIndex", "WtOMatrix", "twoSided", "color", "exponent")]).encode())
+
+    return digest.hexdigest()
+
+# On-disk cache of the serialized scene buffers (primitives, offsets, BVH, detectors and sensors)
+# An entry is a directory named after the hash of the scene geometry, the sensors and the build settings,
+# holding one .npy file per buffer. Entries are loaded memory-mapped, so a warm start only reads what the upload touches
+class SceneCache():
+    def __init__(self, directory) -> None:
+        self.directory = directory
+        os.makedirs(directory, exist_ok=True)
+
+    # Key of a scene, see sceneKey
+    def key(self, scene, serializer, sensorSerializer, settings):
+        return sceneKey(scene, serializer, sensorSerializer, settings)
+
+    # Memory-mapped buffers of an entry, as a dictionary of numpy arrays, or None if the entry does not exist
+    def load(self, key):
+        path = os.path.join(self.directory, key)
+        if not os.path.isdir(path):
+            return None
+
+        buffers = {}
+        for name in os.listdir(path):
+            if name.endswith(".npy"):
+                buffers[name[:-4]] = np.load(os.path.join(path, name), mmap_mode='r')
+        return buffers
+
+    # Store the buffers of an entry, byte chains are stored as uint8 arrays
+    # The entry is written in a temporary directory and renamed, so a reader never sees a partial entry
+    def store(self, key, buffers):
+        path = os.path.join(self.directory, key)
+        if os.path.isdir(path):
+            return
+
+        temp = tempfile.mkdtemp(dir=self.directory)
+        for name, buffer in buffers.items():
+            if isinstance(buffer, bytes):
+                buffer = np.frombuffer(buffer, np.uint8)
+            np.save(os.path.join(temp, name + ".npy"), buffer)
+
+        try:
+            os.rename(temp, path)
+        except OSError:
+            # Stored meanwhile by another process
+            shutil.rmtree(temp, ignore_errors=True)
+
+    # Remove every entry
+    def clear(self):
+        for name in os.listdir(self.directory):
+            shutil.rmtree(os.path.join(self.directory, name), ignore_errors=True)
+
+    # Testing method : an entry loads back unchanged, and editing the geometry, the texture coordinates, a transformation
+    # or the settings changes the key
+    def test(self):
+        points = [(0.0, 0.0, 0.0),
+                  (0.0, 1.0, 0.0),
+                  (1.0, 0.0, 0.0),
+                  (1.0, 1.0, 1.0)]
+
+        indices = [(0, 1, 2),
+                   (0, 1, 3),
+                   (0, 2, 3),
+                   (1, 2, 3)]
+
+        tetra = TriangleSet(points, indices)
+        boule = Sphere(2)
+        tessel = Tesselator()
+        boule.apply(tessel)
+        triBoule = tessel.triangulation
+        scene = Scene()
+        scene.add(Shape(tetra))
+        scene.add(Shape(triBoule))
+
+        seri = serializer.Serializer()
+        sensors = sensorSerializer.SensorSerializer()
+        key = self.key(scene, seri, sensors, "settings")
+        assert key == self.key(scene, seri, sensors, "settings"), "Error : the key of an unchanged scene changed."
+        assert self.load(key) is None, "Error : an entry was found before it was stored."
+
+        # Round trip of the buffers of the scene
+        prims, offsets = seri.serializeTriangleScene(scene)
+        builder = bvhBuilder.BVHBuilder()
+        builder.buildBVH(seri.getPrimBounds(prims, offsets))
+        prims, offsets = builder.reorderPrimitives(prims, offsets)
+        buffers = {"prims": prims, "offsets": offsets, "bvh": builder.serializeBVH(), "root": np.array([builder.getRoot()], np.int32)}
+        self.store(key, buffers)
+
+        loaded = self.load(key)
+        assert loaded is not None and sorted(loaded) == sorted(buffers), "Error : the stored entry doesn't hold the stored buffers."
+        for name, buffer in buffers.items():
+            expected = np.frombuffer(buffer, np.uint8) if isinstance(buffer, bytes) else buffer
+            assert loaded[name].dtype == expected.dtype and np.array_equal(loaded[name], expected), "Error : the cached buffer " + name + " changed."
+
+        # Edited scenes
+        moved = TriangleSet(points[:3] + [(1.0, 1.0, 2.0)], indices)
+        textured = TriangleSet(points, indices)
+        textured.texCoordList = Point2Array([(0.0, 0.0), (0.0, 1.0), (1.0, 0.0), (1.0, 1.0)])
+        edits = [[Shape(moved), Shape(triBoule)],
+                 [Shape(textured), Shape(triBoule)],
+                 [Shape(Translated(Vector3(0.0, 0.0, 1.0), tetra)), Shape(triBoule)]]
+        for shapes in edits:
+            edited = Scene()
+            for shape in shapes:
+                edited.add(shape)
+            editedKey = self.key(edited, seri, sensors, "settings")
+            assert editedKey != key and self.load(editedKey) is None, "Error : an edited scene loads the entry of the original scene."
+        assert self.key(scene, seri, sensors, "other settings") != key, "Error : the settings are not part of the key."
+
+        self.clear()
+        print("Scene cache : round trip and key invalidation checked")
+
+if __name__ == '__main__':
+    cache = SceneCache(tempfile.mkdtemp())
+    cache.test()
@@ -5,64 +5,64 @@ import pyopencl.array
 import numpy as np
 from openalea.plantgl.all import *
 import structfill
-import aabbtree
 import bvhBuilder
 
 class SensorSerializer():
     def __init__(self) -> None:
         #Structure
-        self.sensor = [("groupIndex", np.int32), ("WtOMatrix", np.float32, 12), ("twoSided", np.bool8), ("color", np.float32, 3), ("exponent", np.float32)]
+        # Aligned like the kernel Sensor struct : the color starts on a 4 bytes boundary after the twoSided flag
+        self.sensor = np.dtype([("groupIndex", np.int32), ("WtOMatrix", np.float32, 12), ("twoSided", np.bool_), ("color", np.float32, 3), ("exponent", np.float32)], align=True)
 
         #Attributes
-        self.tree = aabbtree.AABBTree()
         self.sensorList = []
 
-    # Add a sensor object to the list (also add it in the BVH)
-    def addSensor(self, groupIndex, matrix, twoSided, color, exponent, bbox):
-            #First we add the sensor to the tree thanks to the bounding box
-            aabb = bvhBuilder.plantGLBBtoAABB(bbox)
-            self.tree.add(aabb, len(self.sensorList))
-
-            #Then we add it to the list
-            self.sensorList.append({"groupIndex": groupIndex, "WtOMatrix": matrix, "twoSided": twoSided, "color": color, "exponent": exponent, "bbox": bbox})
+    # Add a sensor object to the list
+    # The sensor BVH is built at serialization from the sensor matrices, bbox is not used anymore and only kept for the former callers
+    def addSensor(self, groupIndex, matrix, twoSided, color, exponent, bbox = None):
+            self.sensorList.append({"groupIndex": groupIndex, "WtOMatrix": np.array(structfill.matrix34(matrix), np.float32), "twoSided": twoSided,
+                                    "color": (color[0], color[1], color[2]), "exponent": exponent})
 
     # Remove sensor at index in the list
     def removeSensor(self, index):
-        #We remove the sensor from the list 
         self.sensorList.pop(index)
 
-        #Now, we need to recreate the tree
-        self.tree = aabbtree.AABBTree()
-        for i, sensor in enumerate(self.sensorList):
-            self.tree.add(sensor["bbox"], i)
-
-    # Serialize a sensor
-    def serializeSensor(self, groupIndex, matrix, twoSided, color, exponent):
-        buffer = np.array(1, dtype=self.sensor)
-
-        buffer["groupIndex"].fill(groupIndex)
-        structfill.fillMatrix34(buffer,"WtOMatrix", matrix)
-        buffer["twoSided"].fill(twoSided)
-        structfill.fillVec3(buffer, "color", color)
-        buffer["exponent"].fill(exponent)
-        
-        return buffer.tobytes()
-
-    # Serialize the sensor list and the BVH
-    def serialize(self):
+    # World bounds of sensors given their world to object matrices (n, 12), as (n, 6) [x0, x1, y0, y1, z0, z1] boxes
+    # The kernel tests the disk facing the ray, so a sensor covers the unit ball of its object space, an ellipsoid in world space.
+    # Its tight box is centered on the translation, with half extents the norms of the rows of the object to world matrix
+    def getSensorBounds(self, matrices):
+        matrices = np.asarray(matrices, np.float64).reshape(-1, 12)
+        linear = matrices[:, :9].reshape(-1, 3, 3)
+        assert np.all(np.abs(np.linalg.det(linear)) > 0.0), "Error : a sensor matrix can't be inverted."
+
+        center = matrices[:, 9:]
+        extent = np.linalg.norm(np.linalg.inv(linear), axis=2)
+
+        # Rounded outwards to float
+        bounds = np.empty((len(matrices), 6), np.float32)
+        bounds[:, 0::2] = np.nextafter((center - extent).astype(np.float32), np.float32(-np.inf))
+        bounds[:, 1::2] = np.nextafter((center + extent).astype(np.float32), np.float32(np.inf))
+        return bounds
+
+    # Serialize the sensor list and the BVH, the BVH nodes are quantized on that many bits if quantization is not 0
+    # and laid out depth first without the left child address with implicitLeft
+    # The sensors are written in one array, in BVH leaf order. Return the sensors, the BVH and its root address
+    def serialize(self, quantization = 0, implicitLeft = False):
+        assert len(self.sensorList) > 0, "Error : there is no sensor to serialize."
 
         #Serializing the sensors
-        sensorsInByte = self.serializeSensor(self.sensorList[0]["groupIndex"], self.sensorList[0]["WtOMatrix"], self.sensorList[0]["twoSided"], self.sensorList[0]["color"], self.sensorList[0]["exponent"])
-        for sensor in self.sensorList[1:]:
-            sensorsInByte+= self.serializeSensor(sensor["groupIndex"], sensor["WtOMatrix"], sensor["twoSided"], sensor["color"], sensor["exponent"])
+        sensors = np.zeros(len(self.sensorList), dtype=self.sensor)
+        for name in self.sensor.names:
+            sensors[name] = [sensor[name] for sensor in self.sensorList]
 
+        #Building the BVH over the sensor bounds with the binned SAH, then reordering the sensors so that each leaf covers a contiguous range
+        builder = bvhBuilder.BVHBuilder()
+        builder.buildBVH(self.getSensorBounds(sensors["WtOMatrix"]))
+        sensors = sensors[builder.primOrder]
 
         #Serializing the BVH
-        builder = bvhBuilder.BVHBuilder()
-        builder.setBVH(self.tree)
-        bvhInBytes = builder.serializeBVH()
+        bvhInBytes = builder.serializeQuantizedBVH(quantization, implicitLeft) if quantization else builder.serializeBVH(implicitLeft)
 
-        return sensorsInByte, bvhInBytes
+        return sensors.tobytes(), bvhInBytes, builder.getRoot()
 
     # Testing method
     def test(self):
@@ -72,11 +72,12 @@ class SensorSerializer():
 
         self.addSensor(0, Matrix4((1, 0, 0, 0 , 0, 1, 0, 0 , 0, 0, 1, 0 , 0, 0, 0, 1)), False, Vector3(1.0, 1.0, 1.0), 1.0, BoundingBox(Vector3(0.0,1.0,0.0),Vector3(1.0,1.0,0.0)))
 
-        sensors, bvh = self.serialize()
+        sensors, bvh, root = self.serialize()
 
         print("Sensors : ", sensors)
         print("BVH : ", bvh)
+        print("Root : ", root)
 
-if __name__ == __main__:
-    seri = sensorSerializer()
+if __name__ == '__main__':
+    seri = SensorSerializer()
     seri.test()
@@ -1,14 +1,30 @@
 import sys
-from numpy.lib.npyio import _savetxt_dispatcher
 import pyopencl as cl
 import pyopencl.tools
 import pyopencl.array
 import numpy as np
+import hashlib
 from openalea.plantgl.all import *
 import structfill
 
+SPHERE = 0x80 | 2 # PRIM_SPHERE, unit sphere
+FRUSTUM = 0x80 | 3 # PRIM_FRUSTUM, cone x^2 + y^2 = z^2 or unit cylinder between two heights
+BOX = 0x80 | 4 # PRIM_BOX, [-1, 1]^3 box
 POLYGON = 5
+INSTANCE = 0x80 | 7 # PRIM_INSTANCE, transformable
+OPAQUE = 0x400 # PRIM_OPAQUE flag of the type, shadow rays stop at the first hit of an opaque primitive
+TYPE_FLAGS = 0x100 | 0x200 | OPAQUE # Flags of the type, outside of the primitive kind (PRIM_NOP_MASK)
+PARALLELOGRAM = 6 # PRIM_PARALLEL, tested like a triangle with v <= 1 instead of u + v <= 1
+MESH = 8 # PRIM_MESH, indexed mesh header followed by its shared arrays (-D INDEXED_MESHES)
+MESH_TRIANGLE = 9 # PRIM_MESH_TRIANGLE, reference to a triangle of an indexed mesh
+DISC = 0x80 | 10 # PRIM_DISC, unit disc of the z = 0 plane
+FRUSTUM_CYLINDER = 0x1 # Flags of a frustum, as in kernel/geo/frustum.h
+FRUSTUM_TOP_OPEN = 0x2
+FRUSTUM_BASE_OPEN = 0x4
 EPSILON = 0.00001
+PRIM_AABB_OFFSET = 16 # Byte offset of the AABB in the Prim header (after type, groupIndex, shaderOffset and indexOfReflexion)
+POLYGON_VERTICES_OFFSET = 88 # Byte offset of the vertices in a Polygon (after the Prim header, its AABB and its matrix)
+MESH_ARRAYS_OFFSET = 88 # Byte offset of the array offsets in a Mesh (after the Prim header)
 
 # Summerise a bounding box into one value
 def area(bbox):
@@ -21,6 +37,12 @@ def area(bbox):
 
     return 2 * (dx * dy + dx * dz + dy * dz)
 
+# (n, width) numpy array of a PlantGL array of vectors or indices, converted by numpy instead of element by element in Python
+def plantglArray(array, dtype, width):
+    if array is None or len(array) == 0:
+        return np.empty((0, width), dtype)
+    return np.ascontiguousarray(np.asarray(array, dtype)[:, :width])
+
 # This serializer is used for primitives and detectors
 class Serializer():
     def __init__(self) -> None:
@@ -42,6 +64,18 @@ class Serializer():
                                          ("normalPoint2", np.float32, 3),
                                          ("normalPoint3", np.float32, 3)]
 
+        # Indexed mesh (kernel/geo/mesh.h), the byte offsets of its vertex, normal, uv and index arrays are relative to the mesh
+        self.mesh = self.primitive + [("vertices", np.int32), ("normals", np.int32), ("uvs", np.int32), ("indices", np.int32)]
+
+        # Triangle of an indexed mesh, referenced by the BVH leaves instead of a polygon, mesh is the byte offset of its mesh
+        self.meshTriangle = [("type", np.int32), ("mesh", np.int32), ("tri", np.int32)]
+
+        # Frustum, its base is the cap at height base_h of the object space and top the cap at top_h
+        self.frustum = self.primitive + [("base_h", np.float32), ("top_h", np.float32), ("scaleV", np.float32), ("flag", np.int32)]
+
+        # Instance of a shared mesh, the matrix moves the ray to the mesh space and root is the root of the mesh BVH
+        self.instance = self.primitive + [("root", np.int32)]
+
         # Detector structure
         self.detector = [("offset", np.int32), ("count", np.int32)]
 
@@ -65,6 +99,10 @@ class Serializer():
             resultList.append(triangle)
         return resultList
 
+    # A shape is opaque when its material transmits no light, textured or transparent shapes are walked through by shadow rays
+    def isOpaque(self, shape):
+        return isinstance(shape.appearance, Material) and shape.appearance.transparency <= 0.0
+
     # Put the generic infos of the primitive in the buffer
     def setPrimInfos(self, buffer, prim, primType, groupIndex, shaderOffset, indexOfReflexion, matrix):
 
@@ -91,10 +129,10 @@ class Serializer():
         #World to Object Matrix
         structfill.fillMatrix34(buffer, "WtOMatrix", matrix)
 
-    # Serialize a triangle (matrix definition will be changed)
-    def serializeTriangle(self, triangle, groupIndex, shaderOffset, indexOfReflexion):
+    # Serialize a triangle (matrix definition will be changed), opaque sets the PRIM_OPAQUE flag
+    def serializeTriangle(self, triangle, groupIndex, shaderOffset, indexOfReflexion, opaque = False):
         buffer = np.array(1, dtype= self.polygon)
-        self.setPrimInfos(buffer, triangle, POLYGON, groupIndex, shaderOffset, indexOfReflexion, Matrix4((1, 0, 0, 0 , 0, 1, 0, 0 , 0, 0, 1, 0 , 0, 0, 0, 1)))
+        self.setPrimInfos(buffer, triangle, (POLYGON | OPAQUE) if opaque else POLYGON, groupIndex, shaderOffset, indexOfReflexion, Matrix4((1, 0, 0, 0 , 0, 1, 0, 0 , 0, 0, 1, 0 , 0, 0, 0, 1)))
         normalVertex = triangle.normalList
 
         #Vertex coords
@@ -120,12 +158,12 @@ class Serializer():
         return buffer
 
     # Serialize a TriangleSet
-    def serializeTriangleSet(self, trSet, groupIndex, shaderOffset, indexOfReflexion):
+    def serializeTriangleSet(self, trSet, groupIndex, shaderOffset, indexOfReflexion, opaque = False):
         triangles = self.getTriangles(trSet)
         triangleDataList = []
 
         for triangle in triangles:
-            triangleDataList.append(self.serializeTriangle(triangle, groupIndex, shaderOffset, indexOfReflexion))
+            triangleDataList.append(self.serializeTriangle(triangle, groupIndex, shaderOffset, indexOfReflexion, opaque))
 
         bytechain = triangleDataList[0].tobytes()
 
@@ -140,19 +178,107 @@ class Serializer():
             offsets[offsetIndex] = acc
             offsetIndex+=1
             acc+= len(triangleInBytes)
-            sah = max(EPSILON, area(BoundingBox(trSet)))
+        sah = max(EPSILON, area(BoundingBox(trSet)))
 
         return bytechain, offsets, sah
 
-    # Serialize a scene of TriangleScene
+    # Object space of a PlantGL geometry that the kernel intersects analytically (sphere, box, disc, cylinder, frustum, cone)
+    # Return the primitive type, the (4, 4) object to geometry matrix and the frustum heights and flags, or None
+    # The frustum base is the cap of greater radius, at object height base_h = 1 with its normal along +z : the geometry axis is reversed
+    def getAnalyticFrame(self, geometry):
+        if isinstance(geometry, Sphere):
+            return SPHERE, np.diag([geometry.radius] * 3 + [1.0]), 0.0, 0.0, 0
+        if isinstance(geometry, Box):
+            size = geometry.size
+            return BOX, np.diag([size[0], size[1], size[2], 1.0]), 0.0, 0.0, 0
+        if isinstance(geometry, Disc):
+            return DISC, np.diag([geometry.radius, geometry.radius, 1.0, 1.0]), 0.0, 0.0, 0
+        if not isinstance(geometry, Cone):
+            return None
+
+        # Cylinder and Frustum are cones of PlantGL
+        height = geometry.height
+        baseRadius = geometry.radius
+        topRadius = baseRadius * geometry.taper if isinstance(geometry, Frustum) else (baseRadius if isinstance(geometry, Cylinder) else 0.0)
+        flag = 0 if geometry.solid else FRUSTUM_TOP_OPEN | FRUSTUM_BASE_OPEN
+        frame = np.identity(4)
+        if baseRadius == topRadius:
+            # Unit cylinder from z = 1 (geometry base) to z = -1 (geometry top)
+            frame[0, 0] = frame[1, 1] = baseRadius
+            frame[2, 2:] = [-0.5 * height, 0.5 * height]
+            return FRUSTUM, frame, 1.0, -1.0, flag | FRUSTUM_CYLINDER
+
+        # Cone x^2 + y^2 = z^2 between z = 1 at the greater radius and z = smaller / greater radius, the apex being z = 0
+        radius = max(baseRadius, topRadius)
+        top = min(baseRadius, topRadius) / radius
+        frame[0, 0] = frame[1, 1] = radius
+        scale = height / (1.0 - top)
+        frame[2, 2:] = [-scale, scale] if baseRadius > topRadius else [scale, -scale * top]
+        return FRUSTUM, frame, 1.0, top, flag | (FRUSTUM_TOP_OPEN if top == 0.0 else 0)
+
+    # Serialize a shape geometry that is an analytic primitive, with its world to object matrix taken from the transformations
+    # around it and exact world bounds. Return the bytes, the offsets and the sah, or None for the other geometries
+    def serializeAnalytic(self, geometry, groupIndex, shaderOffset, indexOfReflexion, opaque = False):
+        inner, matrix = self.unwrapGeometry(geometry)
+        analytic = self.getAnalyticFrame(inner)
+        if analytic is None:
+            return None
+
+        primType, frame, base, top, flag = analytic
+        objectToWorld = matrix @ frame
+        linear = objectToWorld[:3, :3]
+        origin = objectToWorld[:3, 3]
+
+        buffer = np.zeros(1, dtype= self.frustum if primType == FRUSTUM else self.primitive)
+        buffer["type"] = (primType | OPAQUE) if opaque else primType
+        buffer["groupIndex"] = groupIndex
+        buffer["shaderOffset"] = shaderOffset
+        buffer["indexOfReflexion"] = indexOfReflexion
+        buffer["WtOMatrix"] = np.concatenate([np.linalg.inv(linear).ravel(), origin])
+
+        # World bounds : ellipsoid of a sphere, corners of a box, union of the two caps of a frustum or a disc
+        if primType == SPHERE:
+            lo = origin - np.linalg.norm(linear, axis=1)
+            hi = origin + np.linalg.norm(linear, axis=1)
+        elif primType == BOX:
+            lo = origin - np.abs(linear).sum(axis=1)
+            hi = origin + np.abs(linear).sum(axis=1)
+        else:
+            caps = [(base, 1.0 if flag & FRUSTUM_CYLINDER else base), (top, 1.0 if flag & FRUSTUM_CYLINDER else top)] if primType == FRUSTUM else [(0.0, 1.0)]
+            discExtent = np.linalg.norm(linear[:, :2], axis=1)
+            lo = np.min([origin + z * linear[:, 2] - radius * discExtent for z, radius in caps], axis=0)
+            hi = np.max([origin + z * linear[:, 2] + radius * discExtent for z, radius in caps], axis=0)
+        for i, axis in enumerate("xyz"):
+            buffer[axis + "Min"] = np.nextafter(np.float32(lo[i]), np.float32(-np.inf))
+            buffer[axis + "Max"] = np.nextafter(np.float32(hi[i]), np.float32(np.inf))
+
+        if primType == FRUSTUM:
+            buffer["base_h"] = base
+            buffer["top_h"] = top
+            buffer["scaleV"] = 1.0
+            buffer["flag"] = flag
+
+        sah = max(EPSILON, area(BoundingBox(geometry)))
+        return buffer.tobytes(), np.zeros(1, np.int32), sah
+
+    # Serialize the geometry of a shape : analytic primitives are kept as they are, the other geometries are triangle sets
+    def serializeShape(self, shape, groupIndex):
+        analytic = self.serializeAnalytic(shape.geometry, groupIndex, 0, 0.0, self.isOpaque(shape))
+        if analytic is not None:
+            return analytic
+        return self.serializeTriangleSet(shape.geometry, groupIndex, 0, 0.0, self.isOpaque(shape))
+
+    # Serialize a scene of TriangleSet and analytic shapes
     def serializeTriangleScene(self, scene):
          # Type check :
         assert type(scene) == openalea.plantgl.scenegraph._pglsg.Scene, "Error : input scene is not a PlantGL scene."
 
-        sceneInBytes, offsets, sah = self.serializeTriangleSet(scene[0].geometry, 0, 0, 0.0)
+        self.sah = []
+        sceneInBytes, offsets, sah = self.serializeShape(scene[0], 0)
+        self.sah.append(sah)
         count = 1
         for shape in scene[1:]:
-            tempSceneBytes, tempOffset, sah = self.serializeTriangleSet(shape.geometry, count, 0, 0.0)
+            tempSceneBytes, tempOffset, sah = self.serializeShape(shape, count)
             self.sah.append(sah)
             print(len(offsets))
             print(len(tempOffset))
@@ -164,6 +290,260 @@ class Serializer():
             count+= 1
         return sceneInBytes, offsets
 
+    # Serialize a TriangleSet as an indexed mesh placed at byte base of the primitive buffer
+    # The points, vertex normals, uvs and faces of the set are copied as they are, without a primitive per face
+    # Return the mesh bytes, the bytes of its triangle references and the sah
+    def serializeMesh(self, trSet, groupIndex, shaderOffset, indexOfReflexion, opaque = False, base = 0):
+        points, indices = self.getMeshArrays(trSet)
+        normals = self.getVertexNormals(points, indices)
+
+        # Texture coordinates indexed like the points, zeros otherwise as for the polygons
+        uvs = np.zeros((len(points), 2), np.float32)
+        texCoords, uvIndices = self.getTexCoordArrays(trSet)
+        if len(texCoords) > 0:
+            if len(uvIndices) > 0:
+                assert uvIndices.shape == indices.shape, "Error : the texture coordinate indices of a mesh must match its triangles."
+                # A point can carry several texture coordinates, the vertices are split on each distinct (point, uv) pair
+                corners, remap = np.unique(np.stack((indices.ravel(), uvIndices.ravel()), axis=1), axis=0, return_inverse=True)
+                points, normals, uvs = points[corners[:, 0]], normals[corners[:, 0]], texCoords[corners[:, 1]]
+                indices = remap.reshape(-1, 3)
+            elif len(texCoords) == len(points):
+                uvs = texCoords
+        points = points.astype(np.float32)
+
+        header = np.zeros(1, dtype= self.mesh)
+        header["type"] = (MESH | OPAQUE) if opaque else MESH
+        header["groupIndex"] = groupIndex
+        header["shaderOffset"] = shaderOffset
+        header["indexOfReflexion"] = indexOfReflexion
+        for i, name in enumerate(["xMin", "yMin", "zMin"]):
+            header[name] = points[:, i].min()
+        for i, name in enumerate(["xMax", "yMax", "zMax"]):
+            header[name] = points[:, i].max()
+        header["WtOMatrix"] = np.array([1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0], np.float32)
+        header["vertices"] = header.dtype.itemsize
+        header["normals"] = header["vertices"] + points.nbytes
+        header["uvs"] = header["normals"] + normals.nbytes
+        header["indices"] = header["uvs"] + uvs.nbytes
+
+        triangles = np.zeros(len(indices), dtype= self.meshTriangle)
+        triangles["type"] = (MESH_TRIANGLE | OPAQUE) if opaque else MESH_TRIANGLE
+        triangles["mesh"] = base
+        triangles["tri"] = np.arange(len(indices))
+
+        meshBytes = header.tobytes() + points.tobytes() + normals.tobytes() + uvs.tobytes() + indices.astype(np.uint32).tobytes()
+        sah = max(EPSILON, area(BoundingBox(trSet)))
+        return meshBytes, triangles.tobytes(), sah
+
+    # Serialize a scene of TriangleSet as indexed meshes (-D INDEXED_MESHES), the analytic shapes are kept as they are
+    # The meshes are put at the start of the buffer, the triangle references and analytic primitives follow and are the only offsets
+    def serializeIndexedScene(self, scene):
+        # Type check :
+        assert type(scene) == openalea.plantgl.scenegraph._pglsg.Scene, "Error : input scene is not a PlantGL scene."
+
+        self.sah = []
+        meshChunks = []
+        primChunks = []
+        offsetChunks = []
+        base = 0
+        primBytes = 0
+        for groupIndex, shape in enumerate(scene):
+            analytic = self.serializeAnalytic(shape.geometry, groupIndex, 0, 0.0, self.isOpaque(shape))
+            if analytic is not None:
+                prims, offsets, sah = analytic
+            else:
+                meshBytes, prims, sah = self.serializeMesh(shape.geometry, groupIndex, 0, 0.0, self.isOpaque(shape), base)
+                meshChunks.append(meshBytes)
+                base += len(meshBytes)
+                offsets = np.arange(0, len(prims), np.dtype(self.meshTriangle).itemsize)
+            self.sah.append(sah)
+            primChunks.append(prims)
+            offsetChunks.append(offsets + primBytes)
+            primBytes += len(prims)
+
+        offsets = (base + np.concatenate(offsetChunks)).astype(np.int32)
+        return b"".join(meshChunks + primChunks), offsets
+
+    # Split a shape geometry into its triangle set and the object to world matrix of the transformations around it
+    def unwrapGeometry(self, geometry):
+        matrix = np.identity(4)
+        while isinstance(geometry, Transformed):
+            m = geometry.transformation().getMatrix()
+            matrix = matrix @ np.array([[m[i, j] for j in range(4)] for i in range(4)])
+            geometry = geometry.geometry
+        return geometry, matrix
+
+    # Points (n, 3) and faces (m, 3) of a triangle set
+    def getMeshArrays(self, trSet):
+        points = plantglArray(trSet.pointList, np.float64, 3)
+        indices = plantglArray(trSet.indexList, np.int64, 3)
+        return points, indices
+
+    # (n, 2) texture coordinates and (m, 3) texture coordinate indices of a triangle set, empty when it has none
+    def getTexCoordArrays(self, trSet):
+        return plantglArray(trSet.texCoordList, np.float32, 2), plantglArray(trSet.texCoordIndexList, np.int64, 3)
+
+    # Area weighted vertex normals of a mesh, computed here so the caller's TriangleSet is left untouched
+    def getVertexNormals(self, points, indices):
+        faceNormals = np.cross(points[indices[:, 1]] - points[indices[:, 0]], points[indices[:, 2]] - points[indices[:, 0]])
+        normals = np.zeros_like(points)
+        for corner in range(3):
+            np.add.at(normals, indices[:, corner], faceNormals)
+        length = np.linalg.norm(normals, axis=1, keepdims=True)
+        return (normals / np.maximum(length, EPSILON)).astype(np.float32)
+
+    # Content key of a triangle set, equal for identical meshes, or of the parameters of an analytic geometry
+    # The texture coordinates are part of the key since the serialized mesh carries them
+    def geometryKey(self, trSet):
+        analytic = self.getAnalyticFrame(trSet)
+        if analytic is not None:
+            return hashlib.sha1(np.array([analytic[0], analytic[2], analytic[3], analytic[4]], np.float64).tobytes() + analytic[1].tobytes()).hexdigest()
+        parts = self.getMeshArrays(trSet) + self.getTexCoordArrays(trSet)
+        digest = hashlib.sha1(np.array([len(part) for part in parts], np.int64).tobytes())
+        for part in parts:
+            digest.update(part.tobytes())
+        return digest.hexdigest()
+
+    # Find the distinct meshes of a scene, shared PlantGL objects and identical copies are merged
+    # Return the distinct triangle sets, the mesh index of each shape and the (n, 4, 4) object to world matrix of each shape
+    def getSceneInstances(self, scene):
+        # Type check :
+        assert type(scene) == openalea.plantgl.scenegraph._pglsg.Scene, "Error : input scene is not a PlantGL scene."
+
+        self.sah = []
+        geometries = []
+        byId = {}
+        byKey = {}
+        meshIndex = np.empty(len(scene), np.int32)
+        matrices = np.empty((len(scene), 4, 4))
+        for i, shape in enumerate(scene):
+            trSet, matrices[i] = self.unwrapGeometry(shape.geometry)
+            assert self.getAnalyticFrame(trSet) is None, "Error : instancing only supports triangle sets."
+            if trSet.getId() not in byId:
+                key = self.geometryKey(trSet)
+                if key not in byKey:
+                    byKey[key] = len(geometries)
+                    geometries.append(trSet)
+                byId[trSet.getId()] = byKey[key]
+            meshIndex[i] = byId[trSet.getId()]
+            self.sah.append(max(EPSILON, area(BoundingBox(shape))))
+
+        return geometries, meshIndex, matrices
+
+    # Serialize instances, given the group index, world bounds (n, 6), world to object matrix (n, 12), mesh BVH root and opacity of each
+    def serializeInstances(self, groupIndex, bounds, worldToObject, roots, opaque):
+        buffer = np.zeros(len(roots), dtype= self.instance)
+        buffer["type"] = np.where(opaque, INSTANCE | OPAQUE, INSTANCE)
+        buffer["groupIndex"] = groupIndex
+        for i, name in enumerate(["xMin", "xMax", "yMin", "yMax", "zMin", "zMax"]):
+            buffer[name] = bounds[:, i]
+        buffer["WtOMatrix"] = worldToObject
+        buffer["root"] = roots
+
+        offsets = (np.arange(len(roots)) * buffer.dtype.itemsize).astype(np.int32)
+        return buffer.tobytes(), offsets
+
+    # Read the AABB of each primitive of a serialized scene, as an (n, 6) [x0, x1, y0, y1, z0, z1] array
+    # The triangles of indexed meshes have no AABB, it is computed from their vertices
+    def getPrimBounds(self, prims, offsets):
+        raw = np.frombuffer(prims, dtype=np.uint8)
+        offsets = np.asarray(offsets, dtype=np.int64)
+        meshTriangles = self.isMeshTriangle(raw, offsets)
+        bounds = np.empty((len(offsets), 6), np.float32)
+
+        gather = offsets[~meshTriangles, None] + PRIM_AABB_OFFSET + np.arange(24)
+        bounds[~meshTriangles] = raw[gather].view(np.float32).reshape(-1, 6)
+
+        vertices = self.getMeshTriangleVertices(raw, offsets[meshTriangles])
+        bounds[meshTriangles, 0::2] = vertices.min(axis=1)
+        bounds[meshTriangles, 1::2] = vertices.max(axis=1)
+        return bounds
+
+    # Read the vertices of each triangle of a serialized scene, as an (n, 3, 3) array
+    def getTriangleVertices(self, prims, offsets):
+        raw = np.frombuffer(prims, dtype=np.uint8)
+        offsets = np.asarray(offsets, dtype=np.int64)
+        meshTriangles = self.isMeshTriangle(raw, offsets)
+        types = raw[offsets[:, None] + np.arange(4)].view(np.int32).ravel()
+        assert np.all(meshTriangles | np.isin(types & ~TYPE_FLAGS, (POLYGON, PARALLELOGRAM))), "Error : only triangles have vertices, the analytic primitives can't be split."
+        vertices = np.empty((len(offsets), 3, 3), np.float32)
+
+        gather = offsets[~meshTriangles, None] + POLYGON_VERTICES_OFFSET + np.arange(36)
+        vertices[~meshTriangles] = raw[gather].view(np.float32).reshape(-1, 3, 3)
+        vertices[meshTriangles] = self.getMeshTriangleVertices(raw, offsets[meshTriangles])
+        return vertices
+
+    # Mask of the primitives that are triangles of indexed meshes
+    def isMeshTriangle(self, raw, offsets):
+        types = raw[offsets[:, None] + np.arange(4)].view(np.int32).ravel()
+        return (types & ~TYPE_FLAGS) == MESH_TRIANGLE
+
+    # Vertices of triangles of indexed meshes, read through the index buffer of their mesh, as an (n, 3, 3) array
+    def getMeshTriangleVertices(self, raw, offsets):
+        fields = raw[offsets[:, None] + np.arange(12)].view(np.int32).reshape(-1, 3)
+        mesh = fields[:, 1].astype(np.int64)
+        arrays = raw[mesh[:, None] + MESH_ARRAYS_OFFSET + np.arange(16)].view(np.int32).reshape(-1, 4)
+        indices = raw[(mesh + arrays[:, 3] + fields[:, 2].astype(np.int64) * 12)[:, None] + np.arange(12)].view(np.uint32).reshape(-1, 3)
+        gather = (mesh + arrays[:, 0])[:, None, None] + indices[:, :, None].astype(np.int64) * 12 + np.arange(12)
+        return raw[gather].view(np.float32).reshape(-1, 3, 3)
+
+    # A scene serialized by serializeTriangleScene only holds polygons when none of its shapes is an analytic primitive
+    def isPolygonScene(self, scene):
+        return all(self.getAnalyticFrame(self.unwrapGeometry(shape.geometry)[0]) is None for shape in scene)
+
+    # Lay out the polygons of a serialized scene as a typed array (-D POLYGON_ARRAY), one polygon per offset in the order
+    # of the offsets, so that the kernel indexes them directly. A polygon referenced by several leaf entries (spatial splits)
+    # is copied for each. Return the array and its offsets, or None when the buffer holds other primitives than polygons
+    def getPolygonArray(self, prims, offsets):
+        offsets = np.asarray(offsets, dtype=np.int64)
+        size = np.dtype(self.polygon).itemsize
+        if len(prims) % size != 0 or np.any(offsets % size != 0):
+            return None
+        polygons = np.frombuffer(prims, dtype= self.polygon)
+        index = offsets // size
+        if not np.all(np.isin(polygons["type"] & ~TYPE_FLAGS, (POLYGON, PARALLELOGRAM))):
+            return None
+
+        arrayOffsets = (np.arange(len(offsets)) * size).astype(np.int32)
+        if np.array_equal(index, np.arange(len(polygons))):
+            return prims, arrayOffsets
+        return polygons[index].tobytes(), arrayOffsets
+
+    # Put compact triangle records (-D TRIANGLE_RECORDS, kernel/geo/trianglerecord.h) before the primitives, one per
+    # offset : the first vertex with the primitive type, and the two edges, on 48 bytes. The traversal only reads the
+    # records, the primitives behind them are the attributes of the hit. Return the new buffer and the shifted offsets
+    def prependTriangleRecords(self, prims, offsets):
+        offsets = np.asarray(offsets, dtype=np.int64)
+        types = np.frombuffer(prims, dtype=np.uint8)[offsets[:, None] + np.arange(4)].view(np.int32).ravel()
+        assert np.all(np.isin(types & ~TYPE_FLAGS, (POLYGON, PARALLELOGRAM))), "Error : triangle records only hold polygons."
+
+        vertices = self.getTriangleVertices(prims, offsets)
+        records = np.zeros((len(offsets), 3, 4), np.float32)
+        records[:, 0, :3] = vertices[:, 0]
+        records[:, 0, 3] = types.view(np.float32)
+        records[:, 1, :3] = vertices[:, 1] - vertices[:, 0]
+        records[:, 2, :3] = vertices[:, 2] - vertices[:, 0]
+
+        return records.tobytes() + bytes(prims), (offsets + records.nbytes).astype(np.int32)
+
+    # Put SoA packs of width triangles (-D TRIANGLE_PACKS, kernel/geo/trianglepack.h) before the primitives, one per width
+    # offsets : each component of the first vertices, of the two edges and the types of a pack is a vector of width floats.
+    # The leaves must start on a pack (BVHBuilder.alignLeaves). Return the new buffer and the shifted offsets
+    def prependTrianglePacks(self, prims, offsets, width):
+        offsets = np.asarray(offsets, dtype=np.int64)
+        assert len(offsets) % width == 0, "Error : the leaves are not aligned on the triangle packs."
+        types = np.frombuffer(prims, dtype=np.uint8)[offsets[:, None] + np.arange(4)].view(np.int32).ravel()
+        assert np.all(np.isin(types & ~TYPE_FLAGS, (POLYGON, PARALLELOGRAM))), "Error : triangle packs only hold polygons."
+
+        vertices = self.getTriangleVertices(prims, offsets).reshape(-1, width, 3, 3)
+        packs = np.zeros((len(vertices), 10, width), np.float32)
+        packs[:, 0:3] = vertices[:, :, 0].transpose(0, 2, 1)
+        packs[:, 3:6] = (vertices[:, :, 1] - vertices[:, :, 0]).transpose(0, 2, 1)
+        packs[:, 6:9] = (vertices[:, :, 2] - vertices[:, :, 0]).transpose(0, 2, 1)
+        packs[:, 9] = types.reshape(-1, width).view(np.float32)
+
+        return packs.tobytes() + bytes(prims), (offsets + packs.nbytes).astype(np.int32)
+
     # In GroIMP, it's said that minMeasurement value is usually 1
     def serializeDetectors(self, minMeasurement):
         assert len(self.sah) != 0, "Error : sah has not been computed. Can't build detectors."
@@ -17,11 +17,17 @@ def fillVec3(buffer, name, vect):
     
     buffer[name] = [vect[0], vect[1], vect[2]]
 
+# The 12 floats of a kernel Mat34 (3x3 part, then the translation row) from a PlantGL Matrix4
+def matrix34(mat):
+    #Type check
+    assert type(mat) == openalea.plantgl.math._pglmath.Matrix4, "Vect must be a PlantGL Matrix4."
+
+    return [mat[0,0], mat[0,1], mat[0,2], mat[1,0], mat[1,1], mat[1,2], mat[2,0], mat[2,1], mat[2,2], mat[3,0], mat[3,1], mat[3,2]]
+
 def fillMatrix34(buffer, name, mat):
     #Type check
     name = str(name)
     assert type(buffer) == np.ndarray, "Buffer must be a NumPy structured array."
-    assert type(mat) == openalea.plantgl.math._pglmath.Matrix4, "Vect must be a PlantGL Matrix4."
     
-    buffer[name] = [mat[0,0], mat[0,1], mat[0,2], mat[1,0], mat[1,1], mat[2,2], mat[2,0], mat[2,1], mat[2,2], mat[3,0], mat[3,1], mat[3,2]]
+    buffer[name] = matrix34(mat)
     
\ No newline at end of file